@@ -1,82 +1,158 @@
 classdef object < py.types.voidptr
   methods
       function objdir = dir(obj)
-          objdir = pymex('DIR', obj);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('DIR');
+          end
+          objdir = pymex(OP, obj);
       end
       
       function tf = is(obj1, obj2)
-          tf = pymex('IS', obj1, obj2);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('IS');
+          end
+          tf = pymex(OP, obj1, obj2);
       end
       
       function c = uminus(a)
-          c = pymex('NEGATE',a);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('NEGATE');
+          end
+          c = pymex(OP,a);
       end
       
       function c = uplus(a)
-          c = pymex('POSIFY',a);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('POSIFY');
+          end
+          c = pymex(OP,a);
       end      
       
       function c = invert(a)
-          c = pymex('INVERT',a);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('INVERT');
+          end
+          c = pymex(OP,a);
       end
       
       function c = plus(a, b)
-          c = pymex('ADD', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('ADD');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = minus(a, b)
-          c = pymex('SUBTRACT', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SUBTRACT');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = mtimes(a, b)
-          c = pymex('MULTIPLY', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('MULTIPLY');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = mrdivide(a, b)
-          c = pymex('DIVIDE', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('DIVIDE');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = pow(a,b,c)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('POWER');
+          end
           if nargin < 3
               c = [];
           end
-          c = pymex('POWER',a,b,c);
+          c = pymex(OP,a,b,c);
       end
       
       function c = mpower(a, b)
-          c = pymex('POWER',a,b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('POWER');
+          end
+          c = pymex(OP,a,b);
       end
       
       function c = lshift(a, b)
-          c = pymex('LSHIFT',a,b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('LSHIFT');
+          end
+          c = pymex(OP,a,b);
       end
       
       function c = rshift(a, b)
-          c = pymex('RSHIFT',a,b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('RSHIFT');
+          end
+          c = pymex(OP,a,b);
       end
       
       function c = rem(a, b)
-          c = pymex('REM', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('REM');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = mod(a, b)
-          c = pymex('MOD', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('MOD');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = bitand(a, b)
-          c = pymex('BITAND', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('BITAND');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = bitor(a, b)
-          c = pymex('BITOR', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('BITOR');
+          end
+          c = pymex(OP, a, b);
       end
       
       function c = bitxor(a, b)
-          c = pymex('BITXOR', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('BITXOR');
+          end
+          c = pymex(OP, a, b);
       end
       
       function tf = logical(obj)
-          tf = pymex('TO_BOOL', obj);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('TO_BOOL');
+          end
+          tf = pymex(OP, obj);
       end
       
       function tf = not(obj)
@@ -84,34 +160,66 @@ classdef object < py.types.voidptr
       end
       
       function tf = lt(a, b)
-          tf = pymex('LT', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('LT');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function tf = le(a, b)
-          tf = pymex('LE', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('LE');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function tf = eq(a, b)
-          tf = pymex('EQ', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('EQ');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function tf = gt(a, b)
-          tf = pymex('GT', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('GT');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function tf = ge(a, b)
-          tf = pymex('GE', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('GE');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function tf = ne(a, b)
-          tf = pymex('NE', a, b);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('NE');
+          end
+          tf = pymex(OP, a, b);
       end
       
       function attr = getattr(obj, attrname)
-          attr = pymex('GET_ATTR', obj, attrname);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('GET_ATTR');
+          end
+          attr = pymex(OP, obj, attrname);
       end
       
       function item = getitem(obj, varargin)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('GET_ITEM');
+          end
           if numel(varargin) > 1
               key = py.tuple(varargin{:});
           elseif numel(varargin) == 1
@@ -119,18 +227,30 @@ classdef object < py.types.voidptr
           else
               key = py.tuple;
           end
-          item = pymex('GET_ITEM', obj, key);
+          item = pymex(OP, obj, key);
       end
       
       function setattr(obj, attrname, val)
-          pymex('SET_ATTR', obj, attrname, val);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SET_ATTR');
+          end
+          pymex(OP, obj, attrname, val);
       end
       
       function tf = hasattr(obj, attrname)
-          tf = pymex('HAS_ATTR', obj, attrname);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('HAS_ATTR');
+          end
+          tf = pymex(OP, obj, attrname);
       end
       
       function setitem(obj, val, varargin)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SET_ITEM');
+          end
           if numel(varargin) > 1
               key = py.tuple(varargin{:});
           elseif numel(varargin) == 1
@@ -138,30 +258,39 @@ classdef object < py.types.voidptr
           else
               key = py.tuple();
           end
-          pymex('SET_ITEM', obj, key, val);
+          pymex(OP, obj, key, val);
       end
       
       function c = char(obj)
-          c = pymex('TO_STR', obj);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('TO_STR');
+          end
+          c = pymex(OP, obj);
       end
       
       function t = type(obj)         
-          t = pymex('GET_TYPE', obj);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('GET_TYPE');
+          end
+          t = pymex(OP, obj);
       end      
       
-      function r = call(obj, varargin)
-          iskw = cellfun(@(o) isa(o, 'kw'), varargin);
-          kwargs = horzcat(varargin{iskw});
-          args = varargin(~iskw);
-          if numel(kwargs) > 0
-              r = pymex('CALL', obj, args, dict(kwargs));
-          else
-              r = pymex('CALL', obj, args);
+      function varargout = call(obj, varargin)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('CALL');
           end
+          [varargout{1:max(nargout,1)}] = pymex(OP, obj, varargin);
       end
       
-      function r = methodcall(obj, method, varargin)
-          r = subsref(obj, substruct('.', method, '()', varargin));
+      function varargout = methodcall(obj, method, varargin)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SUBSREF');
+          end
+          varargout = pymex(OP, obj, substruct('.', method, '()', varargin), max(nargout,1));
       end
       
       function r = abs(obj)
@@ -204,6 +333,17 @@ classdef object < py.types.voidptr
           r = pycall('iter',obj);
       end
       
+      function [items, done] = next_n(obj, n, convert)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('ITER_NEXT_N');
+          end
+          if nargin < 3
+              convert = false;
+          end
+          [items, done] = pymex(OP, obj, n, convert);
+      end
+      
       function n = double(obj)
           v = unpy(obj);
           if ~isa(v, 'py.types.builtin.object')
@@ -283,11 +423,19 @@ classdef object < py.types.voidptr
       end
       
       function tf = iscallable(obj)
-          tf = pymex('IS_CALLABLE', obj);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('IS_CALLABLE');
+          end
+          tf = pymex(OP, obj);
       end
       
       function tf = isinstance(obj, pytype)
-          tf = pymex('IS_INSTANCE', obj, pytype);
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('IS_INSTANCE');
+          end
+          tf = pymex(OP, obj, pytype);
       end
       
       function pstruct = saveobj(obj)
@@ -301,73 +449,20 @@ classdef object < py.types.voidptr
           end
       end      
       
-      function varargout = subsref(obj, S)          
-          out = obj;
-          subs = S(1).subs;
-          switch S(1).type
-              case '.'
-                  out = getattr(out, subs);
-              case '()'
-                  out = call(out, subs{:});
-              case '{}'
-                  [slice None] = pybuiltins('slice', 'None');
-                  for s = 1:numel(subs)
-                      if ischar(subs{s}) && isequal(subs{s}, ':')
-                          subs{s} = call(slice, None);
-                      end
-                  end                   
-                  out = getitem(out, subs{:});
-              otherwise
-                  error('pymex:subsref:wtf','wtf is "%s" doing in a substruct?', S(1).type);                  
-          end
-          if numel(S) > 1
-              out = subsref(out, S(2:end));
-          end
-          if nargout == 1 || (nargout == 0 && ~is(pybuiltins('None'), out))
-              varargout{1} = out;
-          elseif nargout > 1
-              iter = pybuiltins('iter');
-              iterobj = call(iter, out);
-              for i=1:nargout
-                  try
-                      varargout{i} = methodcall(iterobj, 'next');
-                  catch ME
-                      if strcmp(ME.identifier, 'Python:StopIteration')
-                         break
-                      else
-                          rethrow(ME);
-                      end
-                  end
-              end
+      function varargout = subsref(obj, S)
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SUBSREF');
           end
+          varargout = pymex(OP, obj, S, nargout);
       end
                
       function obj = subsasgn(obj, S, val)
-          if numel(S) > 1
-              preS = S(1:end-1);
-              S = S(end);
-              if strcmp(S.type, '()')
-                  error('PyObject:BadAssign', 'Invalid lvalue. Can''t assign to expression ending in ().');
-              end
-              endobj = subsref(obj, preS);
-              subsasgn(endobj, S, val);
-          else
-              subs = S.subs;
-              switch S.type
-                  case '.'
-                      setattr(obj, subs, val);
-                  case '{}'
-                      for s = 1:numel(subs)
-                          [slice None] = pybuiltins('slice','None');
-                          if isequal(subs{s}, ':')
-                              subs{s} = call(slice, None);
-                          end
-                      end                      
-                      setitem(obj, val, subs{:});
-                  otherwise
-                      error('pymex:subsasgn:wtf','wtf is "%s" doing in a substruct?', S.type);
-              end
+          persistent OP
+          if isempty(OP)
+              OP = pymexop('SUBSASGN');
           end
+          pymex(OP, obj, S, val);
       end
       
       function n = colon(a, b, c)
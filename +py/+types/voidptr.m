@@ -3,6 +3,8 @@ classdef voidptr < handle
     %#ok<*INUSD>
     %#ok<*STOUT>
     properties (Hidden)
+        % Handle id into pymex's object registry (0 is null), not an
+        % actual address. Only pymex should touch this.
         pointer = uint64(0);
     end
     
@@ -40,7 +42,11 @@ classdef voidptr < handle
         end
         
         function delete(obj)
-                pymex('DELETE_OBJ', obj);
+                persistent OP
+                if isempty(OP)
+                    OP = pymexop('DELETE_OBJ');
+                end
+                pymex(OP, obj);
         end
     end
 end
@@ -3,6 +3,9 @@
 
 /* format is:
 PYMEX(NAME, minimum_number_of_args, maximum_number_of_args, docstring, { function body} )
+
+The operator families below are also expanded by pymex.c for BATCH,
+with PYMEX_BATCH_EXPANSION defined and its own PYMEX_BIN_OP etc.
 */
 
 PYMEX(MEXLOCK, 0,0, 
@@ -31,8 +34,8 @@ PYMEX(DELETE_OBJ, 1,1,
       "Releases a reference to the given Python object and frees the mex lock "
       "associated with it. See MEXLOCK.",
       {
-	if (!mxIsPyNull(prhs[0])) {
-	  PyObject *pyobj = unbox(prhs[0]);
+	PyObject *pyobj = Handle_release(prhs[0]);
+	if (pyobj) {
 	  Py_DECREF(pyobj);
 	  mexUnlock();
 	}
@@ -74,16 +77,18 @@ PYMEX(TO_BOOL, 1,1,
 	plhs[0] = PyObject_to_mxLogical(unbox(prhs[0]));
       })
 
+#ifndef PYMEX_BATCH_EXPANSION
 #define PYMEX_BIN_OP(name, pyfun)			\
   PYMEX(name, 2,2,					\
 	"Binary operator: " #pyfun,			\
 	{						\
-	  PyObject *L = unboxn(prhs[0]);		\
-	  PyObject *R = unboxn(prhs[1]);		\
+	  PyObject *L = unboxv(prhs[0]);		\
+	  PyObject *R = unboxv(prhs[1]);		\
 	  plhs[0] = box(pyfun(L,R));			\
 	  Py_XDECREF(L);				\
 	  Py_XDECREF(R);				\
 	})
+#endif
 
 PYMEX_BIN_OP(ADD, PyNumber_Add)
 PYMEX_BIN_OP(SUBTRACT, PyNumber_Subtract)
@@ -98,14 +103,16 @@ PYMEX_BIN_OP(LSHIFT, PyNumber_Lshift)
 PYMEX_BIN_OP(RSHIFT, PyNumber_Rshift)
 #undef PYMEX_BIN_OP
 
+#ifndef PYMEX_BATCH_EXPANSION
 #define PYMEX_UNARY_OP(name, pyfun)		\
   PYMEX(name, 1,1,				\
 	"Unary operator: " #pyfun,		\
 	{					\
-	  PyObject *O = unboxn(prhs[0]);	\
+	  PyObject *O = unboxv(prhs[0]);	\
 	  plhs[0] = box(pyfun(O));		\
 	  Py_XDECREF(O);			\
 	})
+#endif
 
 PYMEX_UNARY_OP(NEGATE, PyNumber_Negative)
 PYMEX_UNARY_OP(POSIFY, PyNumber_Positive)
@@ -113,16 +120,18 @@ PYMEX_UNARY_OP(ABS, PyNumber_Absolute)
 PYMEX_UNARY_OP(INVERT, PyNumber_Invert)
 #undef PYMEX_UNARY_OP
 
+#ifndef PYMEX_BATCH_EXPANSION
 #define PYMEX_CMP_OP(name)					\
   PYMEX(name, 2,2,						\
 	"Comparison operator: " #name,				\
 	{							\
-	  PyObject *A = unboxn(prhs[0]);			\
-	  PyObject *B = unboxn(prhs[1]);			\
+	  PyObject *A = unboxv(prhs[0]);			\
+	  PyObject *B = unboxv(prhs[1]);			\
 	  plhs[0] = box(PyObject_RichCompare(A, B, Py_##name));	\
 	  Py_XDECREF(A);					\
 	  Py_XDECREF(B);					\
 	})
+#endif
 
 PYMEX_CMP_OP(LT)
 PYMEX_CMP_OP(LE)
@@ -137,15 +146,15 @@ PYMEX(POWER, 2,3,
       "Python's power operator. Has an optional third argument, "
       "see the python docs for details. ",
       {
-	PyObject *x = unboxn(prhs[0]);
-	PyObject *y = unboxn(prhs[1]);
+	PyObject *x = unboxv(prhs[0]);
+	PyObject *y = unboxv(prhs[1]);
 	PyObject *z;
 	if (nrhs != 3) {
 	  z = Py_None;
 	  Py_INCREF(z);
 	}
 	else {
-	  z = unboxn(prhs[2]);
+	  z = unboxv(prhs[2]);
 	}
 	plhs[0] = box(PyNumber_Power(x, y, z));
 	Py_XDECREF(x);
@@ -184,27 +193,49 @@ PYMEX(TO_PYOBJECT, 1,1,
 	plhs[0] = box(Any_mxArray_to_PyObject(prhs[0]));
       })
 
-PYMEX(CALL, 2,3, 
+PYMEX(CALL, 2,4, 
       "Calls a callable python object. In addition to the "
       "object itself, the second argument is a cell array or tuple "
-      "of arguments. An optional third argument is a dict of keyword arguments. "
-      "No output unpacking is done. The standard object wrapper class implements that.",
+      "of arguments; kw objects in the cell become keyword arguments. "
+      "An optional third argument gives more keyword arguments, as a dict, "
+      "a kw object array or a cell of name/value pairs (or [] for none). "
+      "With more than one output, the result is unpacked "
+      "as a sequence into the outputs, like [a, b] = f(). If the optional fourth "
+      "argument is true, the outputs are converted as by TO_MXARRAY instead "
+      "of boxed. "
+      "Array arguments in the cell are passed as read-only views unless the "
+      "borrow_args option is off; see OPTION.",
       {
 	PyObject *callobj = unbox(prhs[0]);
 	if (!PyCallable_Check(callobj))
 	  mexErrMsgIdAndTxt("python:NotCallable", "tried to call object which is not callable.");
-	PyObject *args = NULL;
-	if (mxIsCell(prhs[1]))
-	  args = mxCell_to_PyTuple(prhs[1]);
-	else
-	  args = unboxn(prhs[1]);
-	if (!args || !PyTuple_Check(args))
+	if (!mxIsCell(prhs[1]) && 
+	    !(mxIsPyObject(prhs[1]) && PyTuple_Check(unbox(prhs[1]))))
 	  mexErrMsgIdAndTxt("python:NotTuple", "args must be a tuple");
+	bool convert = nrhs > 3 && (mxIsLogicalScalarTrue(prhs[3]) ||
+				    (mxIsNumeric(prhs[3]) && mxGetScalar(prhs[3]) != 0));
+	const mxArray *kwspec = nrhs > 2 && !mxIsEmpty(prhs[2]) ? prhs[2] : NULL;
+	if (kwspec && !Is_kwargs_spec(kwspec) &&
+	    !(mxIsPyObject(kwspec) && PyDict_Check(unbox(kwspec))))
+	  mexErrMsgIdAndTxt("python:NoKWargs", "kwargs must be a dict, kw objects, a name/value cell or null");
+	/* Nothing below here may mexErrMsg: the arguments may be borrowed. */
+	PyObject *args = NULL;
 	PyObject *kwargs = NULL;
-	if (nrhs > 2) {
-	  kwargs = unbox(prhs[2]);
-	  if (kwargs && !PyDict_Check(kwargs))
-	    mexErrMsgIdAndTxt("python:NoKWargs", "kwargs must be a dict or null");
+	if (mxIsCell(prhs[1])) {
+	  if (!Split_call_args(prhs[1], &args, &kwargs)) break;
+	}
+	else if (!(args = unboxn(prhs[1]))) break;
+	if (kwspec) {
+	  PyObject *extra = Is_kwargs_spec(kwspec) ? Kwargs_from_mxArray(kwspec) : unboxn(kwspec);
+	  if (!kwargs)
+	    kwargs = extra;
+	  else if (!extra || PyDict_Update(kwargs, extra) < 0)
+	    Py_CLEAR(kwargs);
+	  if (extra != kwargs) Py_XDECREF(extra);
+	  if (!kwargs) {
+	    Py_DECREF(args);
+	    break;
+	  }
 	}
 	#if PYMEX_DEBUG_FLAG
 	PyObject *crepr = PyObject_Repr(callobj);
@@ -221,8 +252,59 @@ PYMEX(CALL, 2,3,
 	Py_XDECREF(krepr);
 	#endif
 	PyObject *result = PyObject_Call(callobj, args, kwargs);
-	plhs[0] = box(result);
-	Py_XDECREF(args);
+	Py_DECREF(args);
+	Py_XDECREF(kwargs);
+	if (!result) break;
+	int i;
+	int n = Unpack_outputs(result, nlhs, plhs, convert);
+	if (n >= 0 && n < nlhs) {
+	  for (i=0; i<n; i++) {
+	    mxDestroyArray(plhs[i]);
+	    plhs[i] = NULL;
+	  }
+	  PyErr_Format(PyExc_ValueError, "need more than %d values to unpack", n);
+	}
+      })
+
+PYMEX(KWARGS, 1,1,
+      "Builds a dict of keyword arguments from a kw object array or a cell of "
+      "name/value pairs, in one go. See CALL.",
+      {
+	if (!Is_kwargs_spec(prhs[0]))
+	  mexErrMsgIdAndTxt("pymex:KWARGS:badspec", "Expected kw objects or a name/value cell.");
+	plhs[0] = box(Kwargs_from_mxArray(prhs[0]));
+      })
+
+PYMEX(SUBSREF, 2,3,
+      "Evaluates a whole subsref chain (obj, S[, nargout]) on a python object: "
+      "'.' gets an attribute, '()' calls (kw arguments become keyword "
+      "arguments) and '{}' gets an item, with ':' standing for slice(None). "
+      "Only the final result is boxed. Returns a cell of outputs: with "
+      "nargout 0, an empty cell if the result is None; with nargout > 1, "
+      "the result is unpacked by iterating over it. Defaults to nargout 1.",
+      {
+	if (!mxIsStruct(prhs[1]))
+	  mexErrMsgIdAndTxt("pymex:SUBSREF:badS", "S must be a subsref struct array.");
+	int nout = nrhs > 2 ? (int) mxGetScalar(prhs[2]) : 1;
+	PyObject *pyobj = unbox(prhs[0]);
+	if (!pyobj) break;
+	PyObject *result = Subsref_chain(pyobj, prhs[1], mxGetNumberOfElements(prhs[1]));
+	if (result) plhs[0] = Box_outputs(result, nout);
+      })
+
+PYMEX(SUBSASGN, 3,3,
+      "Assigns through a whole subsasgn chain (obj, S, value). Everything "
+      "but the last element of S is followed as by SUBSREF; the last one "
+      "must be '.' (setattr) or '{}' (setitem).",
+      {
+	if (!mxIsStruct(prhs[1]))
+	  mexErrMsgIdAndTxt("pymex:SUBSASGN:badS", "S must be a subsasgn struct array.");
+	PyObject *pyobj = unbox(prhs[0]);
+	if (!pyobj) break;
+	PyObject *value = unboxn(prhs[2]);
+	if (!value) break;
+	Subsasgn_chain(pyobj, prhs[1], value);
+	Py_DECREF(value);
       })
 
 PYMEX(IS_CALLABLE, 1,1, 
@@ -234,18 +316,19 @@ PYMEX(IS_CALLABLE, 1,1,
 PYMEX(GET_ATTR, 2,2, 
       "Gets the named attribute from the object.",
       {
-	/* Perhaps we should use GetAttrString instead... */
 	PyObject *pyobj = unbox(prhs[0]);
-	PyObject *name = unboxn(prhs[1]);
+	PyObject *name = Attr_name(prhs[1]);
+	if (!name) break;
 	plhs[0] = box(PyObject_GetAttr(pyobj, name));
-	Py_XDECREF(name);
+	Py_DECREF(name);
       })
 
 PYMEX(SET_ATTR, 3,3, 
       "Sets the named attribute. Argument order is name, value.",
       {    
 	PyObject *pyobj = unbox(prhs[0]);
-	PyObject *key = unboxn(prhs[1]);
+	PyObject *key = Attr_name(prhs[1]);
+	if (!key) break;
 	PyObject *val = unboxn(prhs[2]);
 	PyObject_SetAttr(pyobj, key, val);
 	Py_XDECREF(key);
@@ -256,9 +339,10 @@ PYMEX(HAS_ATTR, 2, 2,
       "Asks the object whether it has a particular attribute.",
       {
 	PyObject *pyobj = unbox(prhs[0]);
-	PyObject *name = unboxn(prhs[1]);
+	PyObject *name = Attr_name(prhs[1]);
+	if (!name) break;
 	plhs[0] = mxCreateLogicalScalar(PyObject_HasAttr(pyobj, name));
-	Py_XDECREF(name);
+	Py_DECREF(name);
       })
 
 PYMEX(GET_ITEM, 2,2, 
@@ -306,6 +390,62 @@ PYMEX(CELL_TO_TUPLE, 1,1,
 	  plhs[0] = box(mxCell_to_PyTuple(prhs[0]));
       })
 
+PYMEX(MAP, 4,5,
+      "Calls a python callable on each item of an array, as (fn, A, axis, out[, yield]). "
+      "With axis 0 the items are the elements of A (Python scalars, or the "
+      "contents of a cell); with axis k they are the slices A(:,..,i,..,:) along "
+      "dimension k, each copied into an array of its own. The results are "
+      "collected into an array the size of A (or with size(A,k) along "
+      "dimension k only) of class out: a numeric class, 'logical', 'char', "
+      "or 'cell' for boxed objects. If yield is true, other Python threads "
+      "may run between items.",
+      {
+	PyObject *fn = unbox(prhs[0]);
+	if (!fn || !PyCallable_Check(fn))
+	  mexErrMsgIdAndTxt("python:NotCallable", "tried to call object which is not callable.");
+	const mxArray *input = prhs[1];
+	if (!mxIsCell(input) && (!(mxIsNumeric(input) || mxIsLogical(input) || mxIsChar(input))
+				 || mxIsComplex(input) || mxIsSparse(input)))
+	  mexErrMsgIdAndTxt("pymex:MAP:badinput", "A must be a cell or a real, full numeric, logical or char array.");
+	if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || mxGetScalar(prhs[2]) < 0)
+	  mexErrMsgIdAndTxt("pymex:MAP:badaxis", "axis must be a nonnegative scalar.");
+	mwSize axis = (mwSize) mxGetScalar(prhs[2]);
+	if (axis && mxIsCell(input))
+	  mexErrMsgIdAndTxt("pymex:MAP:badaxis", "Cells can only be mapped over their elements (axis 0).");
+	char outname[16] = "";
+	if (mxIsChar(prhs[3])) mxGetString(prhs[3], outname, sizeof(outname));
+	mxClassID outclass = mxClassID_from_name(outname);
+	if (outclass == mxUNKNOWN_CLASS || outclass == mxSTRUCT_CLASS)
+	  mexErrMsgIdAndTxt("pymex:MAP:badout", "out must be a numeric class name, 'logical', 'char' or 'cell'.");
+	bool yield = nrhs > 4 && (mxIsLogicalScalarTrue(prhs[4]) ||
+				  (mxIsNumeric(prhs[4]) && mxGetScalar(prhs[4]) != 0));
+	/* Nothing below here may mexErrMsg: the items may be borrowed. */
+	plhs[0] = Map_array(fn, input, axis, outclass, yield);
+      })
+
+PYMEX(ITER_NEXT_N, 2,3,
+      "Takes up to n items from a python iterator in one go: "
+      "[items, done] = pymex('ITER_NEXT_N', it, n[, convert]). items is a "
+      "1 x k cell of boxed objects, k <= n. If convert is true, the items are "
+      "converted as by TO_MXARRAY instead, and if they are all plain numbers, "
+      "all arrays of one type and shape or all rectangular lists of numbers "
+      "of one shape, items is a single array with them stacked along its "
+      "last dimension. done is true once the "
+      "iterator is exhausted; StopIteration is never raised.",
+      {
+	PyObject *iter = unbox(prhs[0]);
+	if (!iter) break;
+	if (!PyIter_Check(iter))
+	  mexErrMsgIdAndTxt("pymex:ITER_NEXT_N:notiter", "Object is not an iterator; use iter() first.");
+	if (!mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1 || mxGetScalar(prhs[1]) < 0)
+	  mexErrMsgIdAndTxt("pymex:ITER_NEXT_N:badcount", "n must be a nonnegative scalar.");
+	bool convert = nrhs > 2 && (mxIsLogicalScalarTrue(prhs[2]) ||
+				    (mxIsNumeric(prhs[2]) && mxGetScalar(prhs[2]) != 0));
+	bool done;
+	plhs[0] = Iter_next_n(iter, (mwSize) mxGetScalar(prhs[1]), convert, &done);
+	if (plhs[0] && nlhs > 1) plhs[1] = mxCreateLogicalScalar(done);
+      })
+
 PYMEX(TO_MXARRAY, 1,1,
       "Attempts to coerce a Python object to an appropriate MATLAB type.",
       {
@@ -315,6 +455,107 @@ PYMEX(TO_MXARRAY, 1,1,
 	  plhs[0] = Any_PyObject_to_mxArray(unbox(prhs[0]));
       })
 
+PYMEX(BATCH, 3, 4,
+      "Runs a list of operations in one go. Arguments are (ops, regs, outs[, convert]). "
+      "Operations work on a set of registers holding Python objects; registers "
+      "1..numel(regs) start out as the (unboxed) contents of the cell regs. "
+      "Each row of the double matrix ops is [command dst src1 src2 ...], where "
+      "command is a numeric command code (see OPCODE), dst is the register the result goes to (0 to discard "
+      "it), and the sources are register numbers. A 0 ends the sources early. "
+      "Supported commands: the arithmetic, bitwise and comparison operators, "
+      "POWER, GET_ATTR, SET_ATTR, HAS_ATTR, GET_ITEM, SET_ITEM, CALL (src1 is "
+      "the callable, the rest are the arguments), IS, TO_BOOL, GET_TYPE, "
+      "IS_CALLABLE, IS_INSTANCE, DIR and TO_STR. The registers listed in outs "
+      "are returned, one per output, boxed - or converted as by TO_MXARRAY "
+      "if convert is true. Execution stops at the first Python error.",
+      {
+	if (!mxIsDouble(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]))
+	  mexErrMsgIdAndTxt("pymex:BATCH:badops", "ops must be a real double matrix.");
+	if (!mxIsCell(prhs[1]))
+	  mexErrMsgIdAndTxt("pymex:BATCH:badregs", "regs must be a cell array.");
+	if (!mxIsDouble(prhs[2]) || mxIsComplex(prhs[2]) || mxIsSparse(prhs[2]))
+	  mexErrMsgIdAndTxt("pymex:BATCH:badouts", "outs must be a real double vector.");
+	if (mxGetNumberOfElements(prhs[2]) < nlhs)
+	  mexErrMsgIdAndTxt("pymex:BATCH:nargout", "More outputs requested than listed in outs.");
+	Batch_run(nlhs, plhs, prhs[0], prhs[1], prhs[2],
+		  nrhs > 3 && mxIsLogicalScalarTrue(prhs[3]));
+      })
+
+PYMEX(OPCODE, 1, 1,
+      "Returns the numeric code for a command name, or an array of codes "
+      "for a cell array of names. pymex(code, ...) is the same as "
+      "pymex(name, ...) but skips the name lookup. Codes include a hash of "
+      "the command's name, so they stay good across rebuilds for as long as "
+      "the command exists; pymexop.m keeps the codes the wrappers use.",
+      {
+	if (mxIsChar(prhs[0])) {
+	  int cmd = find_command(prhs[0]);
+	  if (cmd < 0)
+	    mexErrMsgIdAndTxt("pymex:OPCODE:unknown", "No such pymex command.");
+	  plhs[0] = mxCreateDoubleScalar(encode_opcode(cmd));
+	}
+	else if (mxIsCell(prhs[0])) {
+	  mwSize n = mxGetNumberOfElements(prhs[0]);
+	  plhs[0] = mxCreateNumericArray(mxGetNumberOfDimensions(prhs[0]),
+					 mxGetDimensions(prhs[0]),
+					 mxDOUBLE_CLASS, mxREAL);
+	  double *codes = mxGetPr(plhs[0]);
+	  mwSize i;
+	  for (i=0; i<n; i++) {
+	    const mxArray *name = mxGetCell(prhs[0], i);
+	    int cmd = name && mxIsChar(name) ? find_command(name) : -1;
+	    if (cmd < 0)
+	      mexErrMsgIdAndTxt("pymex:OPCODE:unknown", "No such pymex command (element %d).",
+				(int) i+1);
+	    codes[i] = encode_opcode(cmd);
+	  }
+	}
+	else {
+	  mexErrMsgIdAndTxt("pymex:OPCODE:badname", "Expected a command name or cell of names.");
+	}
+      })
+
+PYMEX(OPTION, 1, 2,
+      "Gets or sets one of the kernel's conversion switches: "
+      "pymex('OPTION', name) returns its value, and pymex('OPTION', name, value) "
+      "sets it and returns the old one. "
+      "borrow_args (default true): CALL and the operators pass MATLAB arrays "
+      "to Python as read-only views of the caller's data instead of copies. "
+      "A view Python holds on to after the command is copied then, and one "
+      "whose data Python exports (asarray, memoryview) is copied first. "
+      "dense_sequences (default true): lists and tuples of plain numbers, "
+      "nested or not, convert to one numeric or logical array instead of a "
+      "cell of scalars, as long as they're rectangular. "
+      "dict_structs (default true): dicts whose keys are all valid field "
+      "names convert to structs, and lists of dicts sharing their keys to "
+      "struct arrays, all the way down; other dicts stay boxed.",
+      {
+	if (!mxIsChar(prhs[0]))
+	  mexErrMsgIdAndTxt("pymex:OPTION:badname", "Option name must be a string.");
+	char *name = mxArrayToString(prhs[0]);
+	bool *option = Find_option(name);
+	if (!option) {
+	  PyErr_Format(PyExc_KeyError, "No pymex option '%s'", name);
+	  mxFree(name);
+	  break;
+	}
+	mxFree(name);
+	plhs[0] = mxCreateLogicalScalar(*option);
+	if (nrhs > 1) *option = mxIsLogicalScalarTrue(prhs[1]) || 
+			(mxIsNumeric(prhs[1]) && mxGetScalar(prhs[1]) != 0);
+      })
+
+PYMEX(FLUSH_CACHES, 0, 0,
+      "Forgets which py.types wrapper class was chosen for each Python type, "
+      "which MATLAB classes are known to be wrappers, and which mltypes "
+      "class wraps each MATLAB class, along with the opcodes cached by pymexop. "
+      "Run this after adding wrapper classes or changing the MATLAB path, "
+      "otherwise types that have already been wrapped keep their old wrapper.",
+      {
+	Flush_caches();
+	mexEvalStringWithTrap("clear('pymexop')");
+      })
+
 PYMEX(VERSION, 0, 0,
       "Returns the git branch/tag where pymex was last built.",
       {
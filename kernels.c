@@ -0,0 +1,512 @@
+/* Copyright (c) 2009 Ken Watford (kwatford@cise.ufl.edu)
+   For full license details, see the LICENSE file. */
+
+/*
+  Data movement kernels used by the converters. Nothing in here talks
+  to Python or MATLAB - they just shuffle bytes between buffers that
+  the caller has already set up, which is also what makes it safe to
+  hand the big ones to a few threads.
+*/
+#include "pymex.h"
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/* Below this many bytes, starting threads costs more than it saves. */
+#define PARALLEL_MIN_BYTES (8 << 20)
+#define PARALLEL_MAX_THREADS 8
+
+typedef struct {
+  Parallel_fn fn;
+  void *ctx;
+  size_t begin;
+  size_t end;
+} parallel_chunk;
+
+static void *parallel_worker(void *arg) {
+  parallel_chunk *chunk = (parallel_chunk *) arg;
+  chunk->fn(chunk->ctx, chunk->begin, chunk->end);
+  return NULL;
+}
+
+/* Calls fn on pieces of [0, count) that together cover the range,
+   splitting it across threads when there are enough bytes involved
+   to make that worthwhile. fn must not touch Python or MATLAB. */
+void Run_parallel(Parallel_fn fn, void *ctx, size_t count, size_t bytes) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = bytes / PARALLEL_MIN_BYTES;
+  if (ncpu > 0 && nthreads > (size_t) ncpu) nthreads = ncpu;
+  if (nthreads > PARALLEL_MAX_THREADS) nthreads = PARALLEL_MAX_THREADS;
+  if (nthreads > count) nthreads = count;
+  if (nthreads < 2) {
+    fn(ctx, 0, count);
+    return;
+  }
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  parallel_chunk chunks[PARALLEL_MAX_THREADS];
+  bool started[PARALLEL_MAX_THREADS];
+  size_t i;
+  for (i=0; i<nthreads; i++) {
+    chunks[i].fn = fn;
+    chunks[i].ctx = ctx;
+    chunks[i].begin = count * i / nthreads;
+    chunks[i].end = count * (i+1) / nthreads;
+  }
+  /* The first chunk is ours. If a thread won't start, do its share too. */
+  for (i=1; i<nthreads; i++)
+    started[i] = !pthread_create(&threads[i], NULL, parallel_worker, &chunks[i]);
+  fn(ctx, chunks[0].begin, chunks[0].end);
+  for (i=1; i<nthreads; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+    else fn(ctx, chunks[i].begin, chunks[i].end);
+  }
+}
+
+typedef struct {
+  char *dst;
+  const char *src;
+  int ndim;
+  const Py_ssize_t *shape;
+  const Py_ssize_t *strides;
+  size_t itemsize;
+} strided_copy;
+
+#define COPY_COLUMN(type)						\
+  for (i=0; i<n; i++, s += stride, d += sizeof(type))			\
+    *(type *) d = *(const type *) s;
+
+/* Copies "columns" [begin, end) - that is, runs along the first
+   dimension - into their Fortran-ordered places in dst. */
+static void strided_copy_columns(void *arg, size_t begin, size_t end) {
+  strided_copy *c = (strided_copy *) arg;
+  Py_ssize_t n = c->shape[0];
+  Py_ssize_t stride = c->strides[0];
+  Py_ssize_t index[c->ndim];
+  size_t col, rest;
+  int k;
+  /* Work out where column 'begin' starts in the source. */
+  const char *colstart = c->src;
+  rest = begin;
+  for (k=1; k<c->ndim; k++) {
+    index[k] = rest % c->shape[k];
+    rest /= c->shape[k];
+    colstart += index[k] * c->strides[k];
+  }
+  for (col=begin; col<end; col++) {
+    const char *s = colstart;
+    char *d = c->dst + col * n * c->itemsize;
+    Py_ssize_t i;
+    switch (c->itemsize) {
+    case 1: COPY_COLUMN(uint8_t); break;
+    case 2: COPY_COLUMN(uint16_t); break;
+    case 4: COPY_COLUMN(uint32_t); break;
+    case 8: COPY_COLUMN(uint64_t); break;
+    default:
+      for (i=0; i<n; i++, s += stride, d += c->itemsize)
+	memcpy(d, s, c->itemsize);
+    }
+    /* Step the odometer to the next column. */
+    for (k=1; k<c->ndim; k++) {
+      colstart += c->strides[k];
+      if (++index[k] < c->shape[k]) break;
+      colstart -= index[k] * c->strides[k];
+      index[k] = 0;
+    }
+  }
+}
+
+static void memcpy_chunk(void *arg, size_t begin, size_t end) {
+  strided_copy *c = (strided_copy *) arg;
+  memcpy(c->dst + begin, c->src + begin, end - begin);
+}
+
+/*
+  Copies an arbitrarily strided array (strides in bytes, possibly
+  negative, as the buffer protocol hands them out) into dst, which
+  must be a Fortran-ordered block big enough for the whole thing.
+  ndim must be at least 1.
+*/
+void Copy_strided_to_fortran(void *dst, const void *src, int ndim,
+			     const Py_ssize_t *shape, const Py_ssize_t *strides,
+			     size_t itemsize) {
+  strided_copy c = {dst, src, ndim, shape, strides, itemsize};
+  size_t numel = 1, columns = 1;
+  bool fortran = true;
+  Py_ssize_t expected = itemsize;
+  int k;
+  for (k=0; k<ndim; k++) {
+    numel *= shape[k];
+    if (k > 0) columns *= shape[k];
+    if (shape[k] > 1 && strides[k] != expected) fortran = false;
+    expected *= shape[k];
+  }
+  if (!numel) return;
+  if (fortran)
+    Run_parallel(memcpy_chunk, &c, numel * itemsize, numel * itemsize);
+  else
+    Run_parallel(strided_copy_columns, &c, columns, numel * itemsize);
+}
+
+typedef struct {
+  mwIndex *dst;
+  const void *src;
+  int width;
+  mwIndex limit;
+  bool bad;
+} index_copy;
+
+static void index_copy_chunk(void *arg, size_t begin, size_t end) {
+  index_copy *c = (index_copy *) arg;
+  size_t i;
+  bool bad = false;
+  if (c->width == 4) {
+    const int32_t *src = (const int32_t *) c->src;
+    for (i=begin; i<end; i++) {
+      c->dst[i] = (mwIndex) src[i];
+      bad |= src[i] < 0 || c->dst[i] >= c->limit;
+    }
+  }
+  else {
+    const int64_t *src = (const int64_t *) c->src;
+    for (i=begin; i<end; i++) {
+      c->dst[i] = (mwIndex) src[i];
+      bad |= src[i] < 0 || c->dst[i] >= c->limit;
+    }
+  }
+  if (bad) c->bad = true;
+}
+
+/* Widens int32 or int64 (width 4 or 8) sparse indices to mwIndex.
+   Returns false if any of them is negative or not below limit. */
+bool Copy_indices(mwIndex *dst, const void *src, int width, size_t n, mwIndex limit) {
+  index_copy c = {dst, src, width, limit, false};
+  Run_parallel(index_copy_chunk, &c, n, n * sizeof(mwIndex));
+  return !c.bad;
+}
+
+typedef struct {
+  int32_t *dst;
+  const mwIndex *src;
+} index_narrow;
+
+static void index_narrow_chunk(void *arg, size_t begin, size_t end) {
+  index_narrow *c = (index_narrow *) arg;
+  size_t i;
+  for (i=begin; i<end; i++) c->dst[i] = (int32_t) c->src[i];
+}
+
+/* The other way, for indices the caller knows fit in an int32. */
+void Narrow_indices(int32_t *dst, const mwIndex *src, size_t n) {
+  index_narrow c = {dst, src};
+  Run_parallel(index_narrow_chunk, &c, n, n * sizeof(mwIndex));
+}
+
+/* Row-start pointers (n+1 of them) to a row index per entry. Returns
+   false unless they start at 0, never go down, and end at nnz. */
+bool Expand_pointers(mwIndex *rows, const mwIndex *ptr, size_t n, size_t nnz) {
+  size_t r;
+  mwIndex k;
+  if (ptr[0] != 0 || ptr[n] != nnz) return false;
+  for (r=0; r<n; r++) {
+    if (ptr[r+1] < ptr[r]) return false;
+    for (k=ptr[r]; k<ptr[r+1]; k++) rows[k] = r;
+  }
+  return true;
+}
+
+/* A counting sort of entries by row: order gets the entries with rows
+   in ascending order, ties kept as they came. counts is scratch space
+   for nrows+1 indices. */
+void Order_by_row(mwIndex *order, mwIndex *counts, const mwIndex *rows,
+		  size_t nnz, size_t nrows) {
+  size_t k, r;
+  memset(counts, 0, (nrows+1) * sizeof(mwIndex));
+  for (k=0; k<nnz; k++) counts[rows[k]+1]++;
+  for (r=0; r<nrows; r++) counts[r+1] += counts[r];
+  for (k=0; k<nnz; k++) order[counts[rows[k]]++] = k;
+}
+
+/*
+  MATLAB's compressed columns from entries taken in row order: the k-th
+  entry is e = order[k] (or k when order is NULL), at rows[e], cols[e],
+  with its value at index e of values. A counting sort by column keeps
+  each column's rows in order, so repeats of a position end up next to
+  each other and get added up (or'd, for logicals). jc needs ncols+1
+  slots; ir, pr and pi (complex only) one per entry. Returns the number
+  of entries left, after Drop_sparse_zeros.
+*/
+size_t Rows_to_columns(const Sparse_entries *in, mwIndex *jc, mwIndex *ir,
+		       void *pr, double *pi) {
+  const double *re = (const double *) in->values;
+  const mxLogical *lv = (const mxLogical *) in->values;
+  double *dr = (double *) pr;
+  mxLogical *dl = (mxLogical *) pr;
+  size_t k, c, p, out;
+  memset(jc, 0, (in->ncols+1) * sizeof(mwIndex));
+  for (k=0; k<in->nnz; k++) jc[in->cols[k]+1]++;
+  for (c=0; c<in->ncols; c++) jc[c+1] += jc[c];
+  for (k=0; k<in->nnz; k++) {
+    size_t e = in->order ? in->order[k] : k;
+    p = jc[in->cols[e]]++;
+    ir[p] = in->rows[e];
+    switch (in->kind) {
+    case SPARSE_LOGICAL: dl[p] = lv[e]; break;
+    case SPARSE_COMPLEX: dr[p] = re[2*e]; pi[p] = re[2*e+1]; break;
+    default: dr[p] = re[e];
+    }
+  }
+  /* The scatter left each jc[c] at the start of column c+1. */
+  for (c=in->ncols; c>0; c--) jc[c] = jc[c-1];
+  jc[0] = 0;
+  for (c=0, out=0; c<in->ncols; c++) {
+    size_t start = jc[c], end = jc[c+1];
+    jc[c] = out;
+    for (p=start; p<end; p++) {
+      if (out > jc[c] && ir[out-1] == ir[p]) {
+	switch (in->kind) {
+	case SPARSE_LOGICAL: dl[out-1] |= dl[p]; break;
+	case SPARSE_COMPLEX: pi[out-1] += pi[p]; /* fall through */
+	default: dr[out-1] += dr[p];
+	}
+	continue;
+      }
+      ir[out] = ir[p];
+      switch (in->kind) {
+      case SPARSE_LOGICAL: dl[out] = dl[p]; break;
+      case SPARSE_COMPLEX: pi[out] = pi[p]; /* fall through */
+      default: dr[out] = dr[p];
+      }
+      out++;
+    }
+  }
+  jc[in->ncols] = out;
+  return Drop_sparse_zeros(jc, ir, pr, pi, in->ncols, in->kind);
+}
+
+/* MATLAB doesn't store zeros in sparse arrays, so entries that are zero
+   (explicitly, or after adding up repeats) are squeezed out in place.
+   Returns the number left. */
+size_t Drop_sparse_zeros(mwIndex *jc, mwIndex *ir, void *pr, double *pi,
+			 size_t ncols, int kind) {
+  double *dr = (double *) pr;
+  mxLogical *dl = (mxLogical *) pr;
+  size_t c, p, out, start = 0;
+  for (c=0, out=0; c<ncols; c++) {
+    size_t end = jc[c+1];
+    jc[c] = out;
+    for (p=start; p<end; p++) {
+      switch (kind) {
+      case SPARSE_LOGICAL:
+	if (!dl[p]) continue;
+	dl[out] = dl[p];
+	break;
+      case SPARSE_COMPLEX:
+	if (dr[p] == 0 && pi[p] == 0) continue;
+	dr[out] = dr[p];
+	pi[out] = pi[p];
+	break;
+      default:
+	if (dr[p] == 0) continue;
+	dr[out] = dr[p];
+      }
+      ir[out++] = ir[p];
+    }
+    start = end;
+  }
+  jc[ncols] = out;
+  return out;
+}
+
+/*
+  Complex data: MATLAB keeps the real and imaginary parts in separate
+  blocks, NumPy keeps each value's parts together. These move between
+  the two for doubles and singles (realsize 8 or 4). The loops are
+  unrolled with SSE2 (or AVX, if the build enables it) on x86, and
+  fall back to plain C elsewhere or for the odd elements at the end.
+*/
+typedef struct {
+  char *re;
+  char *im;
+  char *z;
+  size_t realsize;
+} complex_split;
+
+static void deinterleave_chunk(void *arg, size_t begin, size_t end) {
+  complex_split *c = (complex_split *) arg;
+  size_t i = begin;
+  if (c->realsize == 8) {
+    double *re = (double *) c->re, *im = (double *) c->im;
+    const double *z = (const double *) c->z;
+#if defined(__AVX__)
+    for (; i+4 <= end; i += 4) {
+      __m256d a = _mm256_loadu_pd(z + 2*i), b = _mm256_loadu_pd(z + 2*i + 4);
+      __m256d lo = _mm256_permute2f128_pd(a, b, 0x20), hi = _mm256_permute2f128_pd(a, b, 0x31);
+      _mm256_storeu_pd(re + i, _mm256_unpacklo_pd(lo, hi));
+      _mm256_storeu_pd(im + i, _mm256_unpackhi_pd(lo, hi));
+    }
+#elif defined(__SSE2__)
+    for (; i+2 <= end; i += 2) {
+      __m128d a = _mm_loadu_pd(z + 2*i), b = _mm_loadu_pd(z + 2*i + 2);
+      _mm_storeu_pd(re + i, _mm_unpacklo_pd(a, b));
+      _mm_storeu_pd(im + i, _mm_unpackhi_pd(a, b));
+    }
+#endif
+    for (; i<end; i++) {
+      re[i] = z[2*i];
+      im[i] = z[2*i+1];
+    }
+  }
+  else {
+    float *re = (float *) c->re, *im = (float *) c->im;
+    const float *z = (const float *) c->z;
+#ifdef __SSE2__
+    for (; i+4 <= end; i += 4) {
+      __m128 a = _mm_loadu_ps(z + 2*i), b = _mm_loadu_ps(z + 2*i + 4);
+      _mm_storeu_ps(re + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(im + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for (; i<end; i++) {
+      re[i] = z[2*i];
+      im[i] = z[2*i+1];
+    }
+  }
+}
+
+static void interleave_chunk(void *arg, size_t begin, size_t end) {
+  complex_split *c = (complex_split *) arg;
+  size_t i = begin;
+  if (c->realsize == 8) {
+    const double *re = (const double *) c->re, *im = (const double *) c->im;
+    double *z = (double *) c->z;
+#if defined(__AVX__)
+    for (; i+4 <= end; i += 4) {
+      __m256d r = _mm256_loadu_pd(re + i), m = _mm256_loadu_pd(im + i);
+      __m256d lo = _mm256_unpacklo_pd(r, m), hi = _mm256_unpackhi_pd(r, m);
+      _mm256_storeu_pd(z + 2*i, _mm256_permute2f128_pd(lo, hi, 0x20));
+      _mm256_storeu_pd(z + 2*i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+    }
+#elif defined(__SSE2__)
+    for (; i+2 <= end; i += 2) {
+      __m128d r = _mm_loadu_pd(re + i), m = _mm_loadu_pd(im + i);
+      _mm_storeu_pd(z + 2*i, _mm_unpacklo_pd(r, m));
+      _mm_storeu_pd(z + 2*i + 2, _mm_unpackhi_pd(r, m));
+    }
+#endif
+    for (; i<end; i++) {
+      z[2*i] = re[i];
+      z[2*i+1] = im[i];
+    }
+  }
+  else {
+    const float *re = (const float *) c->re, *im = (const float *) c->im;
+    float *z = (float *) c->z;
+#ifdef __SSE2__
+    for (; i+4 <= end; i += 4) {
+      __m128 r = _mm_loadu_ps(re + i), m = _mm_loadu_ps(im + i);
+      _mm_storeu_ps(z + 2*i, _mm_unpacklo_ps(r, m));
+      _mm_storeu_ps(z + 2*i + 4, _mm_unpackhi_ps(r, m));
+    }
+#endif
+    for (; i<end; i++) {
+      z[2*i] = re[i];
+      z[2*i+1] = im[i];
+    }
+  }
+}
+
+/* n interleaved complex values from z into separate re and im blocks. */
+void Deinterleave_complex(void *re, void *im, const void *z, size_t n, size_t realsize) {
+  complex_split c = {re, im, (char *) z, realsize};
+  Run_parallel(deinterleave_chunk, &c, n, 2 * n * realsize);
+}
+
+/* The other way: re and im into n interleaved values at z. */
+void Interleave_complex(void *z, const void *re, const void *im, size_t n, size_t realsize) {
+  complex_split c = {(char *) re, (char *) im, z, realsize};
+  Run_parallel(interleave_chunk, &c, n, 2 * n * realsize);
+}
+
+/*
+  Text. MATLAB chars are UTF-16; most of what goes back and forth is
+  ASCII, which is just a matter of dropping or adding the zero high
+  byte. These do that sixteen at a time with SSE2 where it's available
+  and report whether everything was ASCII, so the caller can fall back
+  to real decoding.
+*/
+
+/* ASCII UTF-16 to bytes. Returns false, with dst partly written, if
+   any char isn't ASCII. */
+bool Narrow_ascii(char *dst, const mxChar *src, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i high = _mm_set1_epi16((short) 0xff80);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i+16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i + 8));
+    __m128i over = _mm_and_si128(_mm_or_si128(a, b), high);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(over, zero)) != 0xffff) return false;
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(a, b));
+  }
+#endif
+  for (; i<n; i++) {
+    if (src[i] >= 128) return false;
+    dst[i] = (char) src[i];
+  }
+  return true;
+}
+
+/* ASCII bytes to UTF-16. Returns false, with dst partly written, if
+   any byte isn't ASCII. */
+bool Widen_ascii(mxChar *dst, const char *src, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i+16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+    if (_mm_movemask_epi8(a)) return false;
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi8(a, zero));
+    _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpackhi_epi8(a, zero));
+  }
+#endif
+  for (; i<n; i++) {
+    if (src[i] & 0x80) return false;
+    dst[i] = (mxChar) src[i];
+  }
+  return true;
+}
+
+/* Blocks of rows small enough that both sides of a transpose stay in
+   cache. */
+#define TRANSPOSE_BLOCK 64
+
+/* The rows of an m x n char matrix, one after another. */
+void Char_rows(mxChar *dst, const mxChar *src, size_t m, size_t n) {
+  size_t i0, i, j;
+  for (i0=0; i0<m; i0+=TRANSPOSE_BLOCK) {
+    size_t i1 = i0 + TRANSPOSE_BLOCK < m ? i0 + TRANSPOSE_BLOCK : m;
+    for (j=0; j<n; j++)
+      for (i=i0; i<i1; i++)
+	dst[i*n + j] = src[j*m + i];
+  }
+}
+
+/* The other way: m rows of lens[i] ASCII bytes each (at rows[i]) into an
+   m x n char matrix, padded out with spaces. */
+void Pad_char_rows(mxChar *dst, const char *const *rows, const size_t *lens,
+		   size_t m, size_t n) {
+  size_t i0, i, j;
+  for (i0=0; i0<m; i0+=TRANSPOSE_BLOCK) {
+    size_t i1 = i0 + TRANSPOSE_BLOCK < m ? i0 + TRANSPOSE_BLOCK : m;
+    for (j=0; j<n; j++)
+      for (i=i0; i<i1; i++)
+	dst[j*m + i] = j < lens[i] ? (mxChar) rows[i][j] : ' ';
+  }
+}
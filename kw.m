@@ -6,8 +6,8 @@
 % x = pyfunc(a, kw('b', 'bee'), c, kw('d', 'dee', 'e', 'iii'))
 % The kw() constructor takes key/value pairs and produces an object array. 
 % When MATLAB tries to call a python function using the 'call' method (or the ()
-% syntax), any objects of type kw will be concatenated, converted to a python
-% dict, and passed in as the **kwargs parameter. 
+% syntax), any objects of type kw will be collected into a python dict and
+% passed in as the **kwargs parameter. 
 classdef kw
     properties
         keyword
@@ -35,11 +35,11 @@ classdef kw
         end
         
         function d = dict(kwargs)
-            dict = pybuiltins('dict');
-            d = dict();
-            for i=1:numel(kwargs)
-                d{kwargs(i).keyword} = kwargs(i).value;
+            persistent OP
+            if isempty(OP)
+                OP = pymexop('KWARGS');
             end
+            d = pymex(OP, kwargs);
         end
     end    
 end
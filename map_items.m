@@ -0,0 +1,10 @@
+% [k, v] = map_items(map)
+% Returns the keys and values of a containers.Map as two cell arrays,
+% in the same order. pymex uses this to convert a whole Map with a
+% single call into MATLAB rather than one per key.
+function [k, v] = map_items(map)
+k = keys(map);
+v = values(map, k);
+
+% Copyright (c) 2009 Ken Watford (kwatford@cise.ufl.edu)
+% For full license details, see the LICENSE file.
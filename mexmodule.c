@@ -83,15 +83,26 @@ static PyObject *m_call(PyObject *self, PyObject *args, PyObject *kwargs) {
   Py_DECREF(fakeargs);
   int nargin = PySequence_Size(args);  
   mxArray *inargs[nargin];
+  bool converted[nargin];
   int i;
   for (i=0; i<nargin; i++) {
-    inargs[i] = Any_PyObject_to_mxArray(PyTuple_GetItem(args, i));
+    /* mxArrays can be passed as they are, everything else is converted
+       and thrown away after the call. */
+    PyObject *arg = PyTuple_GetItem(args, i);
+    converted[i] = !Py_mxArray_Check(arg) && !mxArrayPtr_Check(arg);
+    inargs[i] = converted[i] ? Any_PyObject_to_mxArray(arg) : mxArrayPtr(arg);
+    if (!inargs[i]) {
+      while (i--) if (converted[i]) mxDestroyArray(inargs[i]);
+      return NULL;
+    }
   }
   int tupleout = nargout >= 0;
   if (nargout < 0) nargout = 1;
   mxArray *outargs[nargout];
   mxArray *err = mexCallMATLABWithTrap(nargout, outargs, 
 				       nargin, inargs, "feval");
+  for (i=0; i<nargin; i++)
+    if (converted[i]) mxDestroyArray(inargs[i]);
   if (err)
     return _raiselasterror(NULL);
   else {
@@ -113,10 +124,290 @@ static PyObject *m_call(PyObject *self, PyObject *args, PyObject *kwargs) {
   }
 }
 
+/*
+  A prepared call: mex.call for one function called over and over, as
+  an objective for scipy.optimize might be. The function handle is
+  found once. Each argument has a slot that keeps its mxArray between
+  calls, and a float, or a contiguous double array that would convert to
+  the slot's shape, is written straight into it instead of being
+  converted again. Outputs
+  come back in a fixed form per output, with no wrapper class to look
+  up: 'float' (the first element), 'array' (a NumPy array onto the
+  output) or 'mxarray' (the bare pointer, as with wrap=False).
+
+  Slots are written in place, so the function shouldn't keep its
+  arguments (in a persistent variable, say) from one call to the next.
+  An output that shares a slot's data gets the slot, and the next call
+  makes a new one. A cell, struct or object output could be holding any
+  of them, so then they're all given up. A prepared call can't be
+  called again while it's running.
+*/
+enum { OUT_FLOAT, OUT_ARRAY, OUT_MXARRAY };
+
+typedef struct {
+  PyObject_HEAD
+  int nargin, nargout;
+  mxArray **in;			/* the handle, then the argument slots */
+  mxArray **argv;		/* what's passed: in, or mxArrays given */
+  mxArray **out;
+  bool busy;
+  int *out_types;
+  PyObject *array_type;		/* mx.Array */
+  PyObject *asarray;		/* numpy.asarray, if any output needs it */
+} PreparedCall;
+
+/* Writes a float or a double buffer into the slot, if converting it
+   would have given an array of the slot's class and shape. */
+static bool fill_slot(mxArray *slot, PyObject *arg) {
+  if (!slot || mxGetClassID(slot) != mxDOUBLE_CLASS || mxIsComplex(slot) || mxIsSparse(slot))
+    return false;
+  size_t numel = mxGetNumberOfElements(slot);
+  if (PyFloat_CheckExact(arg)) {
+    if (numel != 1) return false;
+    *mxGetPr(slot) = PyFloat_AS_DOUBLE(arg);
+    return true;
+  }
+  if (!PyObject_CheckBuffer(arg)) return false;
+  Py_buffer view;
+  if (PyObject_GetBuffer(arg, &view, PyBUF_F_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+    PyErr_Clear();
+    return false;
+  }
+  mwSize ndim = mxGetNumberOfDimensions(slot);
+  const mwSize *dims = mxGetDimensions(slot);
+  bool fits = view.itemsize == sizeof(double) && view.format && !strcmp(view.format, "d")
+    && (size_t) view.len == numel * sizeof(double);
+  /* Shaped as np.atleast_2d would, like Buffer_to_mxArray. */
+  int k, lead = view.ndim < 2 ? 2 - view.ndim : 0;
+  fits = fits && ndim == (mwSize) (lead + view.ndim);
+  for (k=0; fits && k<(int) ndim; k++)
+    fits = dims[k] == (k < lead ? 1 : (mwSize) view.shape[k-lead]);
+  if (fits) memcpy(mxGetPr(slot), view.buf, view.len);
+  PyBuffer_Release(&view);
+  return fits;
+}
+
+static PyObject *prepared_output(PreparedCall *self, int i) {
+  mxArray *out = self->out[i];
+  self->out[i] = NULL;
+  if (self->out_types[i] == OUT_FLOAT) {
+    PyObject *value = NULL;
+    if (!mxIsEmpty(out) && !mxIsSparse(out) && (mxIsNumeric(out) || mxIsLogical(out)))
+      value = PyFloat_FromDouble(mxGetScalar(out));
+    else
+      PyErr_Format(PyExc_TypeError, "Output %d is %s, not a number", i,
+		   mxIsEmpty(out) ? "empty" : mxGetClassName(out));
+    mxDestroyArray(out);
+    return value;
+  }
+  PyObject *ptr = mxArrayPtr_New(out);
+  if (!ptr || self->out_types[i] == OUT_MXARRAY) return ptr;
+  /* A plain mx.Array, so there's no mro to work out. */
+  PyObject *args = PyTuple_New(0);
+  PyObject *kw = Py_BuildValue("{sO}", "mxpointer", ptr);
+  PyObject *wrapped = args && kw ? PyObject_Call(self->array_type, args, kw) : NULL;
+  Py_XDECREF(args);
+  Py_XDECREF(kw);
+  Py_DECREF(ptr);
+  if (!wrapped) return NULL;
+  PyObject *array = PyObject_CallFunctionObjArgs(self->asarray, wrapped, NULL);
+  Py_DECREF(wrapped);
+  return array;
+}
+
+static PyObject *PreparedCall_call(PreparedCall *self, PyObject *args, PyObject *kw) {
+  int i, j, nargin = self->nargin;
+  if (kw && PyDict_Size(kw))
+    return PyErr_Format(PyExc_TypeError, "Prepared calls take no keyword arguments");
+  if (PyTuple_GET_SIZE(args) != nargin)
+    return PyErr_Format(PyExc_TypeError, "Prepared for %d arguments, got %d",
+			nargin, (int) PyTuple_GET_SIZE(args));
+  if (self->busy)
+    return PyErr_Format(PyExc_RuntimeError, "Prepared call is already running");
+  /* mxArrays passed in are used as they are, for this call only. */
+  self->argv[0] = self->in[0];
+  for (i=0; i<nargin; i++) {
+    PyObject *arg = PyTuple_GET_ITEM(args, i);
+    mxArray **slot = &self->in[i+1];
+    if (Py_mxArray_Check(arg) || mxArrayPtr_Check(arg)) {
+      if (!(self->argv[i+1] = mxArrayPtr(arg))) break;
+      continue;
+    }
+    if (!fill_slot(*slot, arg)) {
+      mxArray *value = Any_PyObject_to_mxArray(arg);
+      if (!value) break;
+      PERSIST_ARRAY(value);
+      if (*slot) mxDestroyArray(*slot);
+      *slot = value;
+    }
+    self->argv[i+1] = *slot;
+  }
+  if (i < nargin) return NULL;
+  self->busy = true;
+  mxArray *err = mexCallMATLABWithTrap(self->nargout, self->out, nargin + 1, self->argv, "feval");
+  self->busy = false;
+  if (err) return _raiselasterror(NULL);
+  /* Float outputs are only read, so only the others can hold a slot. */
+  bool give_up = false;
+  for (i=0; i<self->nargout; i++) {
+    mxArray *out = self->out[i];
+    if (self->out_types[i] == OUT_FLOAT) continue;
+    /* A cell, struct or object could be holding any of them. */
+    if (!(mxIsNumeric(out) || mxIsLogical(out) || mxIsChar(out)))
+      give_up = true;
+    for (j=1; j<=nargin; j++)
+      if (self->in[j] && (give_up || (!mxIsEmpty(self->in[j]) && mxGetData(self->in[j]) == mxGetData(out)))) {
+	mxDestroyArray(self->in[j]);
+	self->in[j] = NULL;
+      }
+  }
+  if (self->nargout == 0) Py_RETURN_NONE;
+  if (self->nargout == 1) return prepared_output(self, 0);
+  PyObject *outseq = PyTuple_New(self->nargout);
+  for (i=0; outseq && i<self->nargout; i++) {
+    PyObject *value = prepared_output(self, i);
+    if (!value) Py_CLEAR(outseq);
+    else PyTuple_SET_ITEM(outseq, i, value);
+  }
+  for (; i<self->nargout; i++) mxDestroyArray(self->out[i]);
+  return outseq;
+}
+
+static void PreparedCall_dealloc(PreparedCall *self) {
+  int i;
+  if (self->in)
+    for (i=0; i<=self->nargin; i++)
+      if (self->in[i]) mxDestroyArray(self->in[i]);
+  PyMem_Free(self->in);
+  PyMem_Free(self->argv);
+  PyMem_Free(self->out);
+  PyMem_Free(self->out_types);
+  Py_XDECREF(self->array_type);
+  Py_XDECREF(self->asarray);
+  self->ob_type->tp_free((PyObject *) self);
+}
+
+static PyTypeObject PreparedCallType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "mex.PreparedCall",        /*tp_name*/
+    sizeof(PreparedCall),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PreparedCall_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    (ternaryfunc)PreparedCall_call, /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "A MATLAB function prepared by mex.prepare",	/* tp_doc */
+};
+
+/* The handle for a name, or a copy of a handle. */
+static mxArray *prepared_handle(PyObject *fn) {
+  mxArray *handle = NULL;
+  if (PyBytes_Check(fn)) {
+    mxArray *name = mxCreateString(PyBytes_AS_STRING(fn));
+    mxArray *err = mexCallMATLABWithTrap(1, &handle, 1, &name, "str2func");
+    mxDestroyArray(name);
+    if (err) {
+      _raiselasterror(NULL);
+      return NULL;
+    }
+  }
+  else if (Py_mxArray_Check(fn) || mxArrayPtr_Check(fn)) {
+    mxArray *ptr = mxArrayPtr(fn);
+    if (!ptr) return NULL;
+    if (mxGetClassID(ptr) != mxFUNCTION_CLASS) {
+      PyErr_Format(PyExc_TypeError, "Expected a function handle, got %s", mxGetClassName(ptr));
+      return NULL;
+    }
+    handle = mxDuplicateArray(ptr);
+  }
+  else {
+    PyErr_Format(PyExc_TypeError, "fn must be a function name or handle");
+    return NULL;
+  }
+  PERSIST_ARRAY(handle);
+  return handle;
+}
+
+static PyObject *m_prepare(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"fn", "nargin", "nargout", "out_types", NULL};
+  static const char *type_names[] = {"float", "array", "mxarray"};
+  PyObject *fn = NULL, *types = Py_None;
+  int i, k, nargin = 0, nargout = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|iO", kwlist,
+				   &fn, &nargin, &nargout, &types))
+    return NULL;
+  if (nargin < 0 || nargout < 0)
+    return PyErr_Format(PyExc_ValueError, "nargin and nargout must be non-negative");
+  if (types != Py_None && PySequence_Size(types) != nargout)
+    return PyErr_Format(PyExc_ValueError, "Need one out_type per output");
+  PreparedCall *call = PyObject_New(PreparedCall, &PreparedCallType);
+  if (!call) return NULL;
+  call->nargin = nargin;
+  call->nargout = nargout;
+  call->in = PyMem_New(mxArray *, nargin + 1);
+  call->argv = PyMem_New(mxArray *, nargin + 1);
+  call->out = PyMem_New(mxArray *, nargout + 1);
+  call->busy = false;
+  call->out_types = PyMem_New(int, nargout + 1);
+  call->array_type = PyObject_GetAttrString(mxmodule, "Array");
+  call->asarray = NULL;
+  if (!call->in || !call->argv || !call->out || !call->out_types) {
+    if (call->in) call->in[0] = NULL;
+    call->nargin = 0;
+    Py_DECREF(call);
+    return PyErr_NoMemory();
+  }
+  for (i=0; i<=nargin; i++) call->in[i] = NULL;
+  bool need_numpy = false;
+  for (i=0; i<nargout; i++) {
+    const char *name = "array";
+    PyObject *item = types == Py_None ? NULL : PySequence_GetItem(types, i);
+    if (item) name = PyBytes_AsString(item);
+    for (k=0; name && k<3 && strcmp(name, type_names[k]); k++);
+    Py_XDECREF(item);
+    if (!name || k == 3) {
+      if (name)
+	PyErr_Format(PyExc_ValueError, "out_types are 'float', 'array' or 'mxarray', not '%s'", name);
+      Py_DECREF(call);
+      return NULL;
+    }
+    call->out_types[i] = k;
+    need_numpy = need_numpy || k == OUT_ARRAY;
+  }
+  if (need_numpy) {
+    PyObject *numpy = PyImport_ImportModule("numpy");
+    call->asarray = numpy ? PyObject_GetAttrString(numpy, "asarray") : NULL;
+    Py_XDECREF(numpy);
+  }
+  if (!call->array_type || (need_numpy && !call->asarray) || !(call->in[0] = prepared_handle(fn))) {
+    Py_DECREF(call);
+    return NULL;
+  }
+  return (PyObject *) call;
+}
+
 static PyMethodDef mex_methods[] = {
   {"printf", m_printf, METH_VARARGS, "Print a string using mexPrintf"},
   {"eval", m_eval, METH_VARARGS, "Evaluates a string using mexEvalString"},
   {"call", (PyCFunction)m_call, METH_VARARGS | METH_KEYWORDS, "feval the inputs"},
+  {"prepare", (PyCFunction)m_prepare, METH_VARARGS | METH_KEYWORDS,
+   "prepare(fn, nargin, nargout=1, out_types=None): a callable that calls the "
+   "function (a name or handle) with nargin arguments, reusing their mxArrays "
+   "between calls. Each output comes back as out_types says: 'float', 'array' "
+   "(a NumPy array, the default) or 'mxarray' (a bare pointer)."},
   {"__raiselasterror", (PyCFunction)_raiselasterror, METH_NOARGS,
    "Raises a MATLABError. Attempts to retrieve the MATLAB error struct to do so."},
   {NULL, NULL, 0, NULL}
@@ -142,6 +433,12 @@ PyMODINIT_FUNC initmexmodule(void) {
   if (!m) return;
 
   mexmodule = m;
+  #if MATLAB_MEX_FILE
+  if (PyType_Ready(&PreparedCallType) == 0) {
+    Py_INCREF(&PreparedCallType);
+    PyModule_AddObject(m, "PreparedCall", (PyObject *) &PreparedCallType);
+  }
+  #endif
   
   PyObject *sys = PyImport_AddModule("sys");
   PyObject *path = PyObject_GetAttrString(sys, "path");
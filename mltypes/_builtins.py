@@ -2,6 +2,7 @@
 # For full license details, see the LICENSE file.
 
 from pymexutil import _check_dims
+import pymexutil
 import mx
 import mex
 import numbers
@@ -19,6 +20,26 @@ class cell(mx.Array):
         self._set_cell(ind, val)
     def __len__(self):
         return self._get_number_of_elements()
+    def tostrings(self, strip=False):
+        '''
+        Returns the contents as a list, in one pass. Char arrays
+        become str; anything else is converted as usual.
+        With strip=True, trailing spaces are dropped.
+        '''
+        return self._to_strings(strip=strip)
+    def totree(self, leaves='wrap'):
+        '''
+        The contents as nested tuples, in one pass. Other arrays
+        come out as wrappers, as read-only views (leaves='view')
+        or as NumPy arrays (leaves='numpy').
+
+        Views are only views until the current pymex command
+        returns, when any still held get copies of their own; until
+        then this cell is read-only. An array MATLAB shares between
+        several cells comes out as one object in all those places,
+        and that object is read-only.
+        '''
+        return self._to_tree(leaves=leaves)
 
 class _structel(object):
     '''
@@ -91,6 +112,14 @@ class struct(mx.Array):
         return self._get_number_of_elements()
     def __call__(self, *ind):
         return _structel(self, _check_dims(self,ind))
+    def columns(self, structured=False):
+        '''
+        Converts the whole struct array in one pass: returns a dict
+        of field name -> column, where fields holding numeric scalars
+        of one class are NumPy arrays and the rest are lists. With
+        structured=True, returns a NumPy record array instead.
+        '''
+        return self._to_columns(structured=structured)
 
 
 class _object(mx.Array):
@@ -182,6 +211,18 @@ class _numeric(mx.Array):
         # probably good enough for now...
         floatval = float(self)
         return cmp(floatval, other)
+    def tostrings(self, strip=False):
+        '''
+        For char arrays: the rows as a list of str. With
+        strip=True, trailing spaces are dropped, as cellstr does.
+        '''
+        return self._to_strings(strip=strip)
+    def tocsc(self, index_dtype=None):
+        '''
+        For sparse arrays: a scipy.sparse.csc_matrix onto the
+        same storage. See pymexutil.sparse_to_scipy.
+        '''
+        return pymexutil.sparse_to_scipy(self, index_dtype)
 
 
 class function_handle(mx.Array):
@@ -29,4 +29,25 @@ class Map(mx.Array):
         return keys(self)
     def values(self):
         return values(self)
+    def todict(self):
+        '''
+        All of the Map's entries as a dict, fetched in a single call.
+        '''
+        return dict(zip(*self._map_items()))
+    def iteritems(self, chunk=4096):
+        '''
+        Yields (key, value) pairs, fetching the values chunk at a time.
+        '''
+        keys, cell = self._map_keys()
+        for first in xrange(0, len(keys), chunk):
+            values = self._map_values(cell, first, chunk)
+            for item in zip(keys[first:first+chunk], values):
+                yield item
+    @classmethod
+    def fromdict(cls, d):
+        '''
+        A new Map holding the contents of d, whose keys must be all
+        strings or all numbers.
+        '''
+        return mx.create_map(d, wrap=True)
 
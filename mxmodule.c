@@ -76,6 +76,22 @@ static PyObject *CreateNumericArray(PyObject *self, PyObject *args, PyObject *kw
     return mxArrayPtr_New(array);
 }
 
+static PyObject *CreateScalar(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"value", "mxclass", "wrap", NULL};
+  PyObject *value = NULL;
+  mxClassID class = mxDOUBLE_CLASS;
+  int wrap = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|ii", kwlist,
+				   &value, &class, &wrap))
+    return NULL;
+  mxArray *array = PyObject_to_mxScalar(value, class);
+  if (!array) return NULL;
+  if (wrap)
+    return dowrap(mxArrayPtr_New(array));
+  else
+    return mxArrayPtr_New(array);
+}
+
 static PyObject *CreateStructArray(PyObject *self, PyObject *args, PyObject *kw) {
   static char *kwlist[] = {"dims", "wrap", NULL};
   PyObject *pydims = NULL;
@@ -126,6 +142,51 @@ static PyObject *CreateString(PyObject *self, PyObject *args, PyObject *kw) {
     return mxArrayPtr_New(array);
 }
 
+static PyObject *CreateCellstr(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"strings", "wrap", NULL};
+  PyObject *strings = NULL;
+  int wrap = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|i", kwlist,
+				   &strings, &wrap))
+    return NULL;
+  mxArray *array = PyStrings_to_cellstr(strings);
+  if (!array) return NULL;
+  if (wrap)
+    return dowrap(mxArrayPtr_New(array));
+  else
+    return mxArrayPtr_New(array);
+}
+
+static PyObject *CreateCharMatrix(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"strings", "wrap", NULL};
+  PyObject *strings = NULL;
+  int wrap = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|i", kwlist,
+				   &strings, &wrap))
+    return NULL;
+  mxArray *array = PyStrings_to_mxChar(strings);
+  if (!array) return NULL;
+  if (wrap)
+    return dowrap(mxArrayPtr_New(array));
+  else
+    return mxArrayPtr_New(array);
+}
+
+static PyObject *CreateMap(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"dict", "wrap", NULL};
+  PyObject *dict = NULL;
+  int wrap = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O!|i", kwlist,
+				   &PyDict_Type, &dict, &wrap))
+    return NULL;
+  mxArray *array = PyDict_to_Map(dict);
+  if (!array) return NULL;
+  if (wrap)
+    return dowrap(mxArrayPtr_New(array));
+  else
+    return mxArrayPtr_New(array);
+}
+
 static PyObject *CreateFunctionHandle(PyObject *self, PyObject *args, PyObject *kw) {
   static char *kwlist[] = {"name", "closure", "wrap", NULL};
   char *name = NULL;
@@ -181,12 +242,24 @@ static PyMethodDef mx_methods[] = {
    "Creates a numeric array with given tuple of dimensions. Specify class and complexity "
    "with one of the enum constants (defaults are mx.DOUBLE and mx.REAL, respectively). "
    "Example: mx.create_numeric_array((5,4,2), mx.DOUBLE, mx.REAL)"},
+  {"create_scalar", (PyCFunction)CreateScalar, METH_VARARGS | METH_KEYWORDS,
+   "Creates a 1x1 array of the given class (default mx.DOUBLE) holding value, "
+   "i.e., mx.create_scalar(2**64-1, mx.UINT64). Integer classes saturate, "
+   "except that int64 and uint64 raise OverflowError."},
   {"create_struct_array", (PyCFunction)CreateStructArray, METH_VARARGS | METH_KEYWORDS, 
    "Creates a struct array with no fields."},
   {"create_char_array", (PyCFunction)CreateCharArray, METH_VARARGS | METH_KEYWORDS,
    "Creates a character array with the given dimensions."},
   {"create_string", (PyCFunction)CreateString, METH_VARARGS | METH_KEYWORDS,
    "Creates a character array from the given string."},
+  {"create_cellstr", (PyCFunction)CreateCellstr, METH_VARARGS | METH_KEYWORDS,
+   "Creates a 1xN cell array of strings from a sequence of str or unicode."},
+  {"create_char_matrix", (PyCFunction)CreateCharMatrix, METH_VARARGS | METH_KEYWORDS,
+   "Creates a char matrix with the given strings as its rows, padded with "
+   "spaces to the longest, as char() does in MATLAB."},
+  {"create_map", (PyCFunction)CreateMap, METH_VARARGS | METH_KEYWORDS,
+   "Creates a containers.Map from a dict whose keys are all strings or all "
+   "numbers, in a single call to the constructor."},
   {"create_function_handle", (PyCFunction)CreateFunctionHandle, METH_VARARGS | METH_KEYWORDS,
    "If called with name='somefunc', returns a handle to that function. "
    "If called with closure='@(x) x+1', returns a MATLAB lambda function. "
@@ -216,6 +289,8 @@ static int mxArray_init(mxArrayObject* self, PyObject *args, PyObject *kw) {
 
 static void mxArray_dealloc(mxArrayObject* self) {
   Py_XDECREF(self->mxptr);
+  PyMem_Free(self->layout);
+  PyMem_Free(self->interface);
   self->ob_type->tp_free((PyObject *) self);
 }
 
@@ -265,6 +340,7 @@ static PyObject *mxArray_mxGetField(PyObject *self, PyObject *args, PyObject *kw
     return PyErr_Format(PyExc_KeyError, "Struct has no '%s' field.", fieldname);
   mxArray *item = mxGetField(ptr, (mwIndex) index, fieldname);
   if (!item) {
+    if (!(ptr = mxArray_Writable(self))) return NULL;
     item = mxCreateDoubleMatrix(0,0,mxREAL);
     PERSIST_ARRAY(item);
     mxSetField(ptr, (mwIndex) index, fieldname, item);
@@ -304,6 +380,7 @@ static PyObject *mxArray_mxGetCell(PyObject *self, PyObject *args, PyObject *kw)
     return PyErr_Format(PyExc_IndexError, "Index %ld out of bounds (0 <= i < %ld)", index, (long) numel);
   mxArray *item = mxGetCell(ptr, (mwIndex) index);
   if (!item) {
+    if (!(ptr = mxArray_Writable(self))) return NULL;
     item = mxCreateDoubleMatrix(0,0,mxREAL);
     PERSIST_ARRAY(item);
     mxSetCell(ptr, (mwIndex) index, item);
@@ -314,7 +391,8 @@ static PyObject *mxArray_mxGetCell(PyObject *self, PyObject *args, PyObject *kw)
 
 static PyObject *mxArray_mxSetField(PyObject *self, PyObject *args, PyObject *kw) {
   static char *kwlist[] = {"fieldname", "value", "index", NULL};
-  mxArray *ptr = mxArrayPtr(self);
+  mxArray *ptr = mxArray_Writable(self);
+  if (!ptr) return NULL;
   if (!mxIsStruct(ptr))
     return PyErr_Format(PyExc_TypeError, "Expected struct, got %s", mxGetClassName(ptr));
   char *fieldname;
@@ -329,8 +407,8 @@ static PyObject *mxArray_mxSetField(PyObject *self, PyObject *args, PyObject *kw
   if (mxGetFieldNumber(ptr, fieldname) < 0)
     if (mxAddField(ptr, fieldname) < 0)
       return PyErr_Format(PyExc_KeyError, "Struct has no '%s' field, and could not create it.", fieldname);
-  mxArray *mxvalue = mxDuplicateArray(Any_PyObject_to_mxArray(newvalue)); /*FIXME: This probably leaks when the input isn't already an mxArray, since the returned object is new but never freed */
-  PERSIST_ARRAY(mxvalue);
+  mxArray *mxvalue = Any_PyObject_to_mxArray(newvalue);
+  if (!mxvalue) return NULL;
   mxArray *oldval = mxGetField(ptr, (mwIndex) index, fieldname);
   if (oldval) mxDestroyArray(oldval);
   mxSetField((mxArray *) ptr, (mwIndex) index, fieldname, mxvalue);
@@ -340,7 +418,8 @@ static PyObject *mxArray_mxSetField(PyObject *self, PyObject *args, PyObject *kw
 /* See Issue #4 */
 static PyObject *mxArray_mxSetProperty(PyObject *self, PyObject *args, PyObject *kw) {
   static char *kwlist[] = {"propname", "value", "index", NULL};
-  mxArray *ptr = mxArrayPtr(self);
+  mxArray *ptr = mxArray_Writable(self);
+  if (!ptr) return NULL;
   char *propname;
   PyObject *newvalue;
   long index = 0;
@@ -352,13 +431,16 @@ static PyObject *mxArray_mxSetProperty(PyObject *self, PyObject *args, PyObject
     return PyErr_Format(PyExc_IndexError, "Index %ld out of bounds (0 <= i < %ld)", 
 			index, (long) numel);
   mxArray *mxvalue = Any_PyObject_to_mxArray(newvalue);
+  if (!mxvalue) return NULL;
   mxSetProperty(ptr, (mwIndex) index, propname, mxvalue);
+  mxDestroyArray(mxvalue);
   Py_RETURN_NONE;
 }
 
 static PyObject *mxArray_mxSetCell(PyObject *self, PyObject *args, PyObject *kw) {
   static char* kwlist[] = {"index", "value", NULL};
-  const mxArray *ptr = mxArrayPtr(self);
+  mxArray *ptr = mxArray_Writable(self);
+  if (!ptr) return NULL;
   if (!mxIsCell(ptr))
     return PyErr_Format(PyExc_TypeError, "Expected cell, got %s", mxGetClassName(ptr));
   PyObject *newvalue;
@@ -368,8 +450,8 @@ static PyObject *mxArray_mxSetCell(PyObject *self, PyObject *args, PyObject *kw)
   const mwSize numel = mxGetNumberOfElements(ptr);
   if (index >= numel || index < 0)
     return PyErr_Format(PyExc_IndexError, "Index %ld out of bounds (0 <= i < %ld)", index, (long) numel);
-  mxArray *mxvalue = mxDuplicateArray(Any_PyObject_to_mxArray(newvalue));
-  PERSIST_ARRAY(mxvalue);
+  mxArray *mxvalue = Any_PyObject_to_mxArray(newvalue);
+  if (!mxvalue) return NULL;
   mxArray *oldval = mxGetCell(ptr, (mwIndex) index);
   if (oldval) mxDestroyArray(oldval);
   mxSetCell((mxArray *) ptr, (mwIndex) index, mxvalue);
@@ -391,6 +473,87 @@ static PyObject *mxArray_mxGetFields(PyObject *self) {
   return outtuple;
 }
 
+static PyObject *mxArray_to_columns(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"structured", NULL};
+  mxArray *ptr = mxArrayPtr(self);
+  int structured = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &structured))
+    return NULL;
+  if (!ptr || !mxIsStruct(ptr))
+    return PyErr_Format(PyExc_TypeError, "Expected struct, got %s", 
+			ptr ? mxGetClassName(ptr) : "null pointer");
+  return Struct_to_columns(ptr, structured);
+}
+
+static PyObject *mxArray_to_strings(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"strip", NULL};
+  mxArray *ptr = mxArrayPtr(self);
+  int strip = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &strip))
+    return NULL;
+  if (!ptr) return NULL;
+  return mxArray_to_PyStrings(ptr, strip);
+}
+
+static PyObject *mxArray_to_tree(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"leaves", NULL};
+  mxArray *ptr = mxArrayPtr(self);
+  const char *leaves = "wrap";
+  int policy;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|s", kwlist, &leaves))
+    return NULL;
+  if (!ptr) return NULL;
+  if (!strcmp(leaves, "wrap"))
+    policy = CELL_LEAF_WRAP;
+  else if (!strcmp(leaves, "numpy"))
+    policy = CELL_LEAF_NUMPY;
+  else if (!strcmp(leaves, "view")) {
+    /* The views point into this array, which has to outlast them and
+       stay as it is until they're released. */
+    if (!Views_keep(self)) return NULL;
+    policy = CELL_LEAF_VIEW;
+  }
+  else
+    return PyErr_Format(PyExc_ValueError, "leaves must be 'wrap', 'view' or 'numpy', not '%s'",
+			leaves);
+  return mxCell_to_PyTree(ptr, policy);
+}
+
+static PyObject *mxArray_map_items(PyObject *self) {
+  mxArray *ptr = mxArrayPtr(self);
+  if (!ptr) return NULL;
+  return Map_items(ptr);
+}
+
+static PyObject *mxArray_map_keys(PyObject *self) {
+  mxArray *ptr = mxArrayPtr(self);
+  mxArray *mxkeys = NULL;
+  if (!ptr) return NULL;
+  PyObject *keys = Map_keys(ptr, &mxkeys);
+  if (!keys) return NULL;
+  PyObject *cobj = mxArrayPtr_New(mxkeys);
+  PyObject *retval = cobj ? PyTuple_Pack(2, keys, cobj) : NULL;
+  Py_DECREF(keys);
+  Py_XDECREF(cobj);
+  return retval;
+}
+
+static PyObject *mxArray_map_values(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"keys", "first", "count", NULL};
+  mxArray *ptr = mxArrayPtr(self);
+  PyObject *keys = NULL;
+  Py_ssize_t first = 0, count = PY_SSIZE_T_MAX;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|nn", kwlist, &keys, &first, &count))
+    return NULL;
+  mxArray *mxkeys = mxArrayPtr(keys);
+  if (!ptr || !mxkeys) return NULL;
+  if (!mxIsCell(mxkeys))
+    return PyErr_Format(PyExc_TypeError, "Expected the key cell from _map_keys");
+  if (first < 0 || count < 0)
+    return PyErr_Format(PyExc_ValueError, "first and count must be non-negative");
+  return Map_values(ptr, mxkeys, first, count);
+}
+
 static PyObject *mxArray_mxGetNumberOfElements(PyObject *self) {
   mwSize len = mxGetNumberOfElements(mxArrayPtr(self));
   return PyLong_FromLong(len);
@@ -439,9 +602,17 @@ static PyObject *mxArray_float(PyObject *self) {
 static PyObject *mxArray_long(PyObject *self) {
   mxArray *ptr = mxArrayPtr(self);
   if (ptr && mxGetNumberOfElements(ptr) == 1 && (mxIsNumeric(ptr) || mxIsLogical(ptr) || mxIsChar(ptr))) {
-    /* FIXME: This is a bad idea. Look up the correct type and interpret appropriately. */
-    long long val = (long long) mxGetScalar(ptr);
-    return PyLong_FromLongLong(val);
+    /* Integers are read in their own type, so that int64 and uint64
+       values don't get rounded on the way through a double. */
+    if (mxIsDouble(ptr) || mxIsSingle(ptr))
+      return PyLong_FromDouble(mxGetScalar(ptr));
+    if (mxIsChar(ptr))
+      return PyLong_FromLong(mxGetChars(ptr)[0]);
+    PyObject *val = mxElement_to_PyObject(ptr, 0);
+    if (!val || PyLong_CheckExact(val)) return val;
+    PyObject *lval = PyNumber_Long(val);
+    Py_DECREF(val);
+    return lval;
   }
   else {
     if (!ptr)
@@ -536,7 +707,8 @@ static PyObject *mxArray_set_element(PyObject *self, PyObject *args, PyObject *k
   Py_ssize_t index = 0;
   PyObject *bytes = NULL;
   if (!PyArg_ParseTupleAndKeywords(args, kw, "S|n", kwlist, &bytes, &index)) return NULL;
-  mxArray *ptr = mxArrayPtr(self);
+  mxArray *ptr = mxArray_Writable(self);
+  if (!ptr) return NULL;
   Py_ssize_t numel = (Py_ssize_t) mxGetNumberOfElements(ptr);
   Py_ssize_t elsize = (Py_ssize_t) mxGetElementSize(ptr);
   if (index < 0 || index >= numel)
@@ -577,30 +749,320 @@ typedef struct {
 #define NPY_ARR_HAS_DESCR  0x0800
 /* end things copied from NumPy */
 
+/* Python's buffer format for each class MATLAB will let us export.
+   Char is UTF-16, but NumPy can't read the struct module's 'u', so it
+   goes out as 'H'. */
+static const char *mxArray_buffer_format(mxClassID mxclass) {
+  switch (mxclass) {
+  case mxLOGICAL_CLASS: return "?";
+  case mxCHAR_CLASS: return "H";
+  case mxINT8_CLASS: return "b";
+  case mxUINT8_CLASS: return "B";
+  case mxINT16_CLASS: return "h";
+  case mxUINT16_CLASS: return "H";
+  case mxINT32_CLASS: return "i";
+  case mxUINT32_CLASS: return "I";
+  case mxINT64_CLASS: return "q";
+  case mxUINT64_CLASS: return "Q";
+  case mxSINGLE_CLASS: return "f";
+  case mxDOUBLE_CLASS: return "d";
+  default: return NULL;
+  }
+}
+
+/* Returns the array if its data can be exported as a single strided
+   block, otherwise sets exc and returns NULL. */
+static mxArray *mxArray_exportable(mxArrayObject *self, PyObject *exc) {
+  /* An export can outlive the command, so a borrowed view gets a copy
+     of its own before anything points at its data. */
+  mxArray *ptr = mxArray_Writable((PyObject *) self);
+  if (!ptr) {
+    if (!PyErr_Occurred())
+      PyErr_Format(exc, "mxArray has already been handed over");
+    return NULL;
+  }
+  if (!mxArray_buffer_format(mxGetClassID(ptr)))
+    PyErr_Format(exc, "Can't export the data of a %s array", mxGetClassName(ptr));
+  else if (mxIsComplex(ptr))
+    PyErr_Format(exc, "Complex arrays don't have a single data segment to export");
+  else if (mxIsSparse(ptr))
+    PyErr_Format(exc, "Sparse arrays don't have a single data segment to export");
+  else
+    return ptr;
+  return NULL;
+}
+
+/* Shape then Fortran strides for ptr, worked out once per wrapper. */
+static Py_ssize_t *mxArray_layout(mxArrayObject *self, mxArray *ptr) {
+  if (self->layout && self->layout_of == ptr)
+    return self->layout;
+  mwSize nd = mxGetNumberOfDimensions(ptr);
+  const mwSize *dims = mxGetDimensions(ptr);
+  Py_ssize_t *layout = PyMem_Resize(self->layout, Py_ssize_t, 2*nd);
+  if (!layout) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  Py_ssize_t stride = (Py_ssize_t) mxGetElementSize(ptr);
+  mwSize i;
+  for (i=0; i<nd; i++) {
+    layout[i] = (Py_ssize_t) dims[i];
+    layout[nd+i] = stride;
+    stride *= layout[i];
+  }
+  self->layout = layout;
+  self->layout_of = ptr;
+  return layout;
+}
+
 static void numpy_array_struct_destructor(void* ptr, void* desc) {
+  ((mxArrayObject *) desc)->exports--;
+  Py_DECREF((PyObject *) desc);
+}
+
+static void complex_array_struct_destructor(void* ptr, void* desc) {
+  Py_DECREF((PyObject *) desc);
   PyMem_Free(ptr);
-  Py_DECREF(desc);
 }
+
+/* Complex double and single arrays can't be exported in place, since
+   NumPy wants each value's parts side by side. They go out as a
+   read-only interleaved copy, which the struct owns: writes to it
+   couldn't reach MATLAB's data, so they aren't allowed. */
+static PyObject *complex_array_struct(mxArrayObject *obj, mxArray *ptr) {
+  mxClassID mxclass = mxGetClassID(ptr);
+  if (mxclass != mxDOUBLE_CLASS && mxclass != mxSINGLE_CLASS)
+    return PyErr_Format(PyExc_AttributeError, "NumPy has no complex %s type",
+			mxGetClassName(ptr));
+  Py_ssize_t *layout = mxArray_layout(obj, ptr);
+  if (!layout) return NULL;
+  int i, nd = (int) mxGetNumberOfDimensions(ptr);
+  size_t realsize = mxGetElementSize(ptr);
+  size_t numel = mxGetNumberOfElements(ptr);
+  /* One block: the interface, its shape and strides, then the data. */
+  size_t head = sizeof(PyArrayInterface) + 2 * nd * sizeof(Py_intptr_t);
+  head = (head + 15) & ~(size_t) 15;
+  char *block = PyMem_Malloc(head + 2 * realsize * numel);
+  if (!block) return PyErr_NoMemory();
+  PyArrayInterface *info = (PyArrayInterface *) block;
+  info->two = 2;
+  info->nd = nd;
+  info->typekind = 'c';
+  info->itemsize = (int) (2 * realsize);
+  info->flags = NPY_FORTRAN | NPY_ALIGNED | NPY_NOTSWAPPED;
+  info->shape = (Py_intptr_t *) (info + 1);
+  info->strides = info->shape + nd;
+  for (i=0; i<nd; i++) {
+    info->shape[i] = layout[i];
+    info->strides[i] = 2 * layout[nd+i];
+  }
+  info->data = block + head;
+  info->descr = NULL;
+  Interleave_complex(info->data, mxGetData(ptr), mxGetImagData(ptr), numel, realsize);
+  PyObject *retval = PyCObject_FromVoidPtrAndDesc(info, obj, complex_array_struct_destructor);
+  if (!retval) {
+    PyMem_Free(block);
+    return NULL;
+  }
+  Py_INCREF(obj);
+  return retval;
+}
+
 static PyObject *mxArray_numpy_array_struct(PyObject *self, void* closure) {
-  PyArrayInterface* info = PyMem_New(PyArrayInterface, 1);
+  mxArrayObject *obj = (mxArrayObject *) self;
   mxArray *ptr = mxArrayPtr(self);
+  if (ptr && mxIsComplex(ptr) && !mxIsSparse(ptr))
+    return complex_array_struct(obj, ptr);
+  PyErr_Clear();
+  ptr = mxArray_exportable(obj, PyExc_AttributeError);
+  if (!ptr) return NULL;
+  Py_ssize_t *layout = mxArray_layout(obj, ptr);
+  if (!layout) return NULL;
+  PyArrayInterface* info = obj->interface;
+  if (!info) {
+    info = obj->interface = PyMem_New(PyArrayInterface, 1);
+    if (!info) return PyErr_NoMemory();
+  }
+  mxClassID mxclass = mxGetClassID(ptr);
   info->two = 2;
   info->nd = (int) mxGetNumberOfDimensions(ptr);
-  info->typekind = mxClassID_to_Numpy_Typekind(mxGetClassID(ptr));
+  info->typekind = mxClassID_to_Numpy_Typekind(mxclass);
   info->itemsize = (int) mxGetElementSize(ptr);
-  info->flags = NPY_FORTRAN | NPY_ALIGNED | NPY_NOTSWAPPED | NPY_WRITEABLE;
-  info->shape = PyMem_New(Py_intptr_t, info->nd);
-  int i;
-  const mwSize* dims = mxGetDimensions(ptr);
-  for(i=0; i<info->nd; i++)
-    info->shape[i] = (Py_intptr_t) dims[i];
-  info->strides = NULL;
+  info->flags = NPY_FORTRAN | NPY_ALIGNED | NPY_NOTSWAPPED;
+  if (!obj->readonly) info->flags |= NPY_WRITEABLE;
+  info->shape = (Py_intptr_t *) layout;
+  info->strides = (Py_intptr_t *) layout + info->nd;
   info->data = mxGetData(ptr);
   info->descr = NULL;
-  Py_INCREF(self);  
-  return PyCObject_FromVoidPtrAndDesc(info, self, numpy_array_struct_destructor);
+  PyObject *retval = PyCObject_FromVoidPtrAndDesc(info, self, numpy_array_struct_destructor);
+  if (retval) {
+    Py_INCREF(self);
+    obj->exports++;
+  }
+  return retval;
 }
 
+/* A piece of a sparse array's storage (ir, jc, pr or pi) as a 1-d
+   __array_struct__. Straight onto the array's data it counts as an
+   export, like the whole-array one; owned is a copy it frees instead. */
+typedef struct {
+  PyArrayInterface info;
+  Py_intptr_t shape;
+  Py_intptr_t stride;
+  void *owned;
+} sparse_part;
+
+static void sparse_part_destructor(void *ptr, void *desc) {
+  sparse_part *part = (sparse_part *) ptr;
+  if (!part->owned) ((mxArrayObject *) desc)->exports--;
+  Py_DECREF((PyObject *) desc);
+  PyMem_Free(part->owned);
+  PyMem_Free(part);
+}
+
+static PyObject *sparse_part_struct(mxArrayObject *self, void *data, void *owned,
+				    size_t n, char typekind, int itemsize) {
+  sparse_part *part = PyMem_New(sparse_part, 1);
+  if (!part) {
+    PyMem_Free(owned);
+    return PyErr_NoMemory();
+  }
+  part->shape = (Py_intptr_t) n;
+  part->stride = itemsize;
+  part->owned = owned;
+  part->info.two = 2;
+  part->info.nd = 1;
+  part->info.typekind = typekind;
+  part->info.itemsize = itemsize;
+  part->info.flags = NPY_CONTIGUOUS | NPY_FORTRAN | NPY_ALIGNED | NPY_NOTSWAPPED;
+  if (owned || !self->readonly) part->info.flags |= NPY_WRITEABLE;
+  part->info.shape = &part->shape;
+  part->info.strides = &part->stride;
+  part->info.data = data;
+  part->info.descr = NULL;
+  PyObject *retval = PyCObject_FromVoidPtrAndDesc(part, self, sparse_part_destructor);
+  if (!retval) {
+    PyMem_Free(owned);
+    PyMem_Free(part);
+    return NULL;
+  }
+  Py_INCREF(self);
+  if (!owned) self->exports++;
+  return retval;
+}
+
+/* ir or jc, narrowed to int32 when asked to (and mwIndex is wider). */
+static PyObject *sparse_index_struct(mxArrayObject *self, mwIndex *index, size_t n, int width) {
+  if (width != 4 || sizeof(mwIndex) == 4)
+    return sparse_part_struct(self, index, NULL, n, 'i', sizeof(mwIndex));
+  int32_t *narrow = PyMem_New(int32_t, n ? n : 1);
+  if (!narrow) return PyErr_NoMemory();
+  Narrow_indices(narrow, index, n);
+  return sparse_part_struct(self, narrow, narrow, n, 'i', 4);
+}
+
+static PyObject *mxArray_sparse_parts(PyObject *self, PyObject *args, PyObject *kw) {
+  static char *kwlist[] = {"index_width", NULL};
+  mxArray *ptr = mxArrayPtr(self);
+  mxArrayObject *obj = (mxArrayObject *) self;
+  int width = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &width))
+    return NULL;
+  if (!ptr || !mxIsSparse(ptr))
+    return PyErr_Format(PyExc_TypeError, "Expected sparse array, got %s", 
+			ptr ? mxGetClassName(ptr) : "null pointer");
+  if (width != 0 && width != 4 && width != 8)
+    return PyErr_Format(PyExc_ValueError, "index_width must be 4 or 8");
+  /* As with the other exports, a borrowed view is copied first. */
+  if (!(ptr = mxArray_Writable(self))) return NULL;
+  mwSize m = mxGetM(ptr), n = mxGetN(ptr);
+  mwIndex *jc = mxGetJc(ptr);
+  size_t nnz = jc[n];
+  if (width == 4 && (m > INT32_MAX || nnz > INT32_MAX))
+    return PyErr_Format(PyExc_OverflowError, "Sparse array is too big for int32 indices");
+  PyObject *data = sparse_part_struct(obj, mxGetData(ptr), NULL, nnz,
+				      mxIsLogical(ptr) ? 'b' : 'f', (int) mxGetElementSize(ptr));
+  PyObject *imag = NULL;
+  if (mxIsComplex(ptr))
+    imag = sparse_part_struct(obj, mxGetPi(ptr), NULL, nnz, 'f', sizeof(double));
+  else {
+    Py_INCREF(Py_None);
+    imag = Py_None;
+  }
+  PyObject *indices = sparse_index_struct(obj, mxGetIr(ptr), nnz, width);
+  PyObject *indptr = sparse_index_struct(obj, jc, n+1, width);
+  if (!data || !imag || !indices || !indptr) {
+    Py_XDECREF(data);
+    Py_XDECREF(imag);
+    Py_XDECREF(indices);
+    Py_XDECREF(indptr);
+    return NULL;
+  }
+  return Py_BuildValue("(nnNNNN)", (Py_ssize_t) m, (Py_ssize_t) n, data, imag, indices, indptr);
+}
+
+/* New-style buffer export. The buffer keeps the wrapper alive, and the
+   wrapper keeps the data. */
+static int mxArray_getbuffer(mxArrayObject *self, Py_buffer *view, int flags) {
+  static char empty[1];
+  mxArray *ptr = mxArray_exportable(self, PyExc_BufferError);
+  if (!ptr) return -1;
+  if (self->readonly && (flags & PyBUF_WRITABLE)) {
+    PyErr_Format(PyExc_BufferError, "mxArray is read-only");
+    return -1;
+  }
+  Py_ssize_t *layout = mxArray_layout(self, ptr);
+  if (!layout) return -1;
+  int nd = (int) mxGetNumberOfDimensions(ptr);
+  int i, nonsingleton = 0;
+  for (i=0; i<nd; i++)
+    if (layout[i] > 1) nonsingleton++;
+  if (nonsingleton > 1 &&
+      ((flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS ||
+       ((flags & PyBUF_ND) && (flags & PyBUF_STRIDES) != PyBUF_STRIDES))) {
+    PyErr_Format(PyExc_BufferError, "mxArray data is Fortran-ordered");
+    return -1;
+  }
+  Py_ssize_t itemsize = (Py_ssize_t) mxGetElementSize(ptr);
+  view->buf = mxGetData(ptr);
+  if (!view->buf) view->buf = empty;
+  view->len = itemsize * (Py_ssize_t) mxGetNumberOfElements(ptr);
+  view->readonly = self->readonly;
+  view->format = (flags & PyBUF_FORMAT)
+    ? (char *) mxArray_buffer_format(mxGetClassID(ptr)) : NULL;
+  if (flags & PyBUF_ND) {
+    view->itemsize = itemsize;
+    view->ndim = nd;
+    view->shape = layout;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? layout + nd : NULL;
+  }
+  else {
+    view->itemsize = 1;
+    view->ndim = 1;
+    view->shape = NULL;
+    view->strides = NULL;
+  }
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  view->obj = (PyObject *) self;
+  Py_INCREF(self);
+  self->exports++;
+  return 0;
+}
+
+static void mxArray_releasebuffer(mxArrayObject *self, Py_buffer *view) {
+  self->exports--;
+}
+
+static PyBufferProcs mxArray_bufferprocs = {
+  0, /*readbufferproc bf_getreadbuffer;*/
+  0, /*writebufferproc bf_getwritebuffer;*/
+  0, /*segcountproc bf_getsegcount;*/
+  0, /*charbufferproc bf_getcharbuffer;*/
+  (getbufferproc) mxArray_getbuffer, /*getbufferproc bf_getbuffer;*/
+  (releasebufferproc) mxArray_releasebuffer, /*releasebufferproc bf_releasebuffer;*/
+};
+
 static PyGetSetDef mxArray_getseters[] = {
     {"__array_struct__", 
      (getter)mxArray_numpy_array_struct, NULL, 
@@ -631,6 +1093,31 @@ static PyMethodDef mxArray_methods[] = {
    "Set a cell array element"},
   {"_get_fields", (PyCFunction)mxArray_mxGetFields, METH_NOARGS,
    "Returns a tuple with the field names of the struct."},
+  {"_to_columns", (PyCFunction)mxArray_to_columns, METH_VARARGS | METH_KEYWORDS,
+   "Converts a whole struct array to a dict of field name -> column. "
+   "Fields holding numeric scalars of one class become 1-d NumPy arrays, "
+   "others lists. With structured=True, returns a NumPy record array instead."},
+  {"_to_strings", (PyCFunction)mxArray_to_strings, METH_VARARGS | METH_KEYWORDS,
+   "Returns the rows of a char matrix, or the contents of a cell array, as a "
+   "list of str. With strip=True, trailing spaces are dropped, as cellstr does."},
+  {"_to_tree", (PyCFunction)mxArray_to_tree, METH_VARARGS | METH_KEYWORDS,
+   "Converts a cell, and any cells inside it, to nested tuples. Other "
+   "arrays become wrappers (leaves='wrap'), read-only views lasting until "
+   "the end of the command (leaves='view') or NumPy arrays (leaves='numpy'). "
+   "An array MATLAB shares between cells is converted once."},
+  {"_map_items", (PyCFunction)mxArray_map_items, METH_NOARGS,
+   "Returns (keys, values) of a containers.Map as two lists, fetched in one "
+   "call. Strings and real scalars become str and Python numbers."},
+  {"_map_keys", (PyCFunction)mxArray_map_keys, METH_NOARGS,
+   "Returns (keys, cell) for a containers.Map: its keys as a list, and the "
+   "MATLAB cell of them to pass to _map_values."},
+  {"_map_values", (PyCFunction)mxArray_map_values, METH_VARARGS | METH_KEYWORDS,
+   "_map_values(cell, first=0, count=all): the values for a slice of the keys "
+   "from _map_keys, fetched in one call."},
+  {"_sparse_parts", (PyCFunction)mxArray_sparse_parts, METH_VARARGS | METH_KEYWORDS,
+   "Returns (m, n, data, imag, indices, indptr) for a sparse array: its size, "
+   "then pr, pi (or None), ir and jc as 1-d __array_struct__ objects onto "
+   "its storage. With index_width=4, ir and jc are int32 copies instead."},
   {"_get_number_of_elements", (PyCFunction)mxArray_mxGetNumberOfElements, METH_NOARGS,
    "Returns the number of elements in the array."},
   {"_get_number_of_dimensions", (PyCFunction)mxArray_mxGetNumberOfDimensions, METH_NOARGS,
@@ -651,6 +1138,12 @@ static PyMethodDef mxArray_methods[] = {
 static PyMemberDef mxArray_members[] = {
   {"_mxptr", T_OBJECT_EX, offsetof(mxArrayObject, mxptr), 0, 
    "CObject pointer to mxArray object"},
+  {"_readonly", T_BOOL, offsetof(mxArrayObject, readonly), READONLY,
+   "True if buffers exported from this array are read-only"},
+  {"_shared", T_BOOL, offsetof(mxArrayObject, shared), READONLY,
+   "True if this array stands for several cells of a tree, and is read-only"},
+  {"_exports", T_INT, offsetof(mxArrayObject, exports), READONLY,
+   "Number of buffers currently exported from this array"},
   {NULL}
 };
 
@@ -716,8 +1209,8 @@ static PyTypeObject mxArrayType = {
     mxArray_str,                         /*tp_str*/
     0,                         /*tp_getattro*/
     0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    &mxArray_bufferprocs,      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_NEWBUFFER,   /*tp_flags*/
     "mxArray objects",           /* tp_doc */
     0,		               /* tp_traverse */
     0,		               /* tp_clear */
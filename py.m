@@ -1,7 +1,11 @@
 function varargout = py(varargin)
+persistent OP
+if isempty(OP)
+    OP = pymexop('TO_PYOBJECT');
+end
 varargout = cell(size(varargin));
 for i=1:numel(varargin)
-    varargout{i} = pymex('TO_PYOBJECT', varargin{i});
+    varargout{i} = pymex(OP, varargin{i});
 end
 
 % Copyright (c) 2009 Ken Watford (kwatford@cise.ufl.edu)
@@ -33,19 +33,14 @@ void name##_pymexfun(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     plhs[0] = mxCreateString(doc);	       \
   }
 
-#define PYMEX_STRCMP(name, min, max, doc, body)		\
-  else if (!strcmp(#name, cmdstring)) {			\
-    mxFree(cmdstring);					\
-    name##_pymexfun(nlhs, plhs, nrhs-1, prhs+1);	\
-  }
+#define PYMEX_NAME(name, min, max, doc, body)	\
+  #name,
 
 #define PYMEX_ENUM(name, min, max, doc, body)	\
   PYMEX_CMD_##name,
   
-#define PYMEX_CASE(name, min, max, doc, body)		\
-  case PYMEX_CMD_##name:				\
-  name##_pymexfun(nlhs, plhs, nrhs-1, prhs+1);		\
-  break;
+#define PYMEX_FUNPTR(name, min, max, doc, body)	\
+  name##_pymexfun,
 
 /* Define pymex command enums via x-macro */
 #define PYMEX(name, min, max, doc, body) PYMEX_ENUM(name,min,max,doc,body)
@@ -55,11 +50,313 @@ enum PYMEX_COMMAND {
 };
 #undef PYMEX
 
+/*
+  String dispatch. Command names are looked up in a perfect hash table,
+  straight from the UTF-16 data of the char array, so nothing has to be
+  allocated or compared more than once. The table is built on load by
+  trying hash seeds until one puts every name in a slot of its own.
+*/
+#define PYMEX(name, min, max, doc, body) PYMEX_NAME(name,min,max,doc,body)
+static const char *command_names[] = {
+#include XMACRO_DEFS
+};
+#undef PYMEX
+
+#define COMMAND_TABLE_SIZE 1024 /* power of two, plenty bigger than the command count */
+static unsigned short command_table[COMMAND_TABLE_SIZE]; /* command + 1, or 0 */
+static unsigned int command_seed = 0; /* 0 until the table is built */
+
+/* FNV-1a over UTF-16 code units, salted with the seed. */
+#define COMMAND_HASH_STEP(h, c) (((h) ^ (c)) * 16777619u)
+static unsigned int command_hash(unsigned int seed, const mxChar *s, size_t n) {
+  unsigned int h = 2166136261u ^ seed;
+  size_t i;
+  for (i=0; i<n; i++) h = COMMAND_HASH_STEP(h, s[i]);
+  return (h ^ (h >> 15)) & (COMMAND_TABLE_SIZE-1);
+}
+static unsigned int command_hash_ascii(unsigned int seed, const char *s) {
+  unsigned int h = 2166136261u ^ seed;
+  for (; *s; s++) h = COMMAND_HASH_STEP(h, (unsigned char) *s);
+  return (h ^ (h >> 15)) & (COMMAND_TABLE_SIZE-1);
+}
+#undef COMMAND_HASH_STEP
+
+/*
+  Numeric opcodes are id * OPCODE_STRIDE + command, where the id is a
+  hash of the command's name. The command number makes decoding a single
+  check, and the id keeps a code good when a rebuild adds or moves
+  commands: the wrappers keep their codes in persistent variables, which
+  outlive the mex file. A code whose command moved is found by its id;
+  one whose command is gone is rejected rather than running whichever
+  command has its number now.
+*/
+#define OPCODE_STRIDE 256	/* more than there are commands */
+static unsigned int command_ids[NUMBER_OF_PYMEX_COMMANDS];
+
+static double encode_opcode(int cmd) {
+  return (double) command_ids[cmd] * OPCODE_STRIDE + cmd;
+}
+
+/* The command for an opcode, or -1 if no command has its name. */
+static int decode_opcode(double code) {
+  if (!(code >= 0 && code < 1e15) || code != (double) (long long) code) return -1;
+  long long c = (long long) code;
+  unsigned int id = (unsigned int) (c / OPCODE_STRIDE);
+  int cmd = (int) (c % OPCODE_STRIDE);
+  if (cmd < NUMBER_OF_PYMEX_COMMANDS && command_ids[cmd] == id) return cmd;
+  for (cmd=0; cmd<NUMBER_OF_PYMEX_COMMANDS; cmd++)
+    if (command_ids[cmd] == id) return cmd;
+  return -1;
+}
+
+static void build_command_table(void) {
+  unsigned int seed;
+  int i;
+  const char *c;
+  for (i=0; i<NUMBER_OF_PYMEX_COMMANDS; i++) {
+    unsigned int id = 2166136261u;
+    for (c=command_names[i]; *c; c++) id = (id ^ (unsigned char) *c) * 16777619u;
+    command_ids[i] = id;
+  }
+  for (seed=1; seed < (1 << 20); seed++) {
+    int cmd;
+    memset(command_table, 0, sizeof(command_table));
+    for (cmd=0; cmd<NUMBER_OF_PYMEX_COMMANDS; cmd++) {
+      unsigned int slot = command_hash_ascii(seed, command_names[cmd]);
+      if (command_table[slot]) break;
+      command_table[slot] = cmd + 1;
+    }
+    if (cmd == NUMBER_OF_PYMEX_COMMANDS) {
+      command_seed = seed;
+      return;
+    }
+  }
+  /* No luck; find_command falls back to a linear search. */
+}
+
+static bool command_matches(const char *name, const mxChar *s, size_t n) {
+  size_t i;
+  for (i=0; i<n; i++)
+    if (!name[i] || (unsigned char) name[i] != s[i]) return false;
+  return !name[n];
+}
+
+/* Returns the command named by the char array, or -1. */
+static int find_command(const mxArray *mxname) {
+  size_t n = mxGetNumberOfElements(mxname);
+  const mxChar *s = mxGetChars(mxname);
+  int cmd;
+  if (command_seed) {
+    cmd = (int) command_table[command_hash(command_seed, s, n)] - 1;
+    return cmd >= 0 && command_matches(command_names[cmd], s, n) ? cmd : -1;
+  }
+  for (cmd=0; cmd<NUMBER_OF_PYMEX_COMMANDS; cmd++)
+    if (command_matches(command_names[cmd], s, n)) return cmd;
+  return -1;
+}
+
+/* BATCH support. The operator families in commands.c are expanded a
+   second time to produce the operator cases of batch_op. */
+static PyObject *batch_arity(const char *name, int want, int got) {
+  return PyErr_Format(PyExc_ValueError, "BATCH: %s takes %d operands, got %d",
+		      name, want, got);
+}
+
+#define BATCH_ARGS(name, n) \
+  if (nargs != n) return batch_arity(#name, n, nargs)
+
+static PyObject *batch_bool(int result) {
+  if (result < 0) return NULL;
+  return PyBool_FromLong(result);
+}
+
+static PyObject *batch_none(int result) {
+  if (result < 0) return NULL;
+  Py_RETURN_NONE;
+}
+
+/* Runs one BATCH operation. Returns a new reference. */
+static PyObject *batch_op(int op, PyObject **a, int nargs) {
+  switch (op) {
+#define PYMEX_BATCH_EXPANSION
+#define PYMEX(name, min, max, doc, body)
+#define PYMEX_BIN_OP(name, pyfun)			\
+    case PYMEX_CMD_##name:				\
+      BATCH_ARGS(name, 2);				\
+      return pyfun(a[0], a[1]);
+#define PYMEX_UNARY_OP(name, pyfun)			\
+    case PYMEX_CMD_##name:				\
+      BATCH_ARGS(name, 1);				\
+      return pyfun(a[0]);
+#define PYMEX_CMP_OP(name)					\
+    case PYMEX_CMD_##name:					\
+      BATCH_ARGS(name, 2);					\
+      return PyObject_RichCompare(a[0], a[1], Py_##name);
+#include XMACRO_DEFS
+#undef PYMEX
+#undef PYMEX_BATCH_EXPANSION
+  case PYMEX_CMD_POWER:
+    if (nargs == 2) return PyNumber_Power(a[0], a[1], Py_None);
+    BATCH_ARGS(POWER, 3);
+    return PyNumber_Power(a[0], a[1], a[2]);
+  case PYMEX_CMD_GET_ATTR:
+    BATCH_ARGS(GET_ATTR, 2);
+    return PyObject_GetAttr(a[0], a[1]);
+  case PYMEX_CMD_SET_ATTR:
+    BATCH_ARGS(SET_ATTR, 3);
+    return batch_none(PyObject_SetAttr(a[0], a[1], a[2]));
+  case PYMEX_CMD_HAS_ATTR:
+    BATCH_ARGS(HAS_ATTR, 2);
+    return batch_bool(PyObject_HasAttr(a[0], a[1]));
+  case PYMEX_CMD_GET_ITEM:
+    BATCH_ARGS(GET_ITEM, 2);
+    return PyObject_GetItem(a[0], a[1]);
+  case PYMEX_CMD_SET_ITEM:
+    BATCH_ARGS(SET_ITEM, 3);
+    return batch_none(PyObject_SetItem(a[0], a[1], a[2]));
+  case PYMEX_CMD_CALL: {
+    if (nargs < 1) return batch_arity("CALL", 1, nargs);
+    PyObject *args = PyTuple_New(nargs-1);
+    if (!args) return NULL;
+    int i;
+    for (i=1; i<nargs; i++) {
+      Py_INCREF(a[i]);
+      PyTuple_SET_ITEM(args, i-1, a[i]);
+    }
+    PyObject *result = PyObject_Call(a[0], args, NULL);
+    Py_DECREF(args);
+    return result;
+  }
+  case PYMEX_CMD_IS:
+    BATCH_ARGS(IS, 2);
+    return batch_bool(a[0] == a[1]);
+  case PYMEX_CMD_TO_BOOL:
+    BATCH_ARGS(TO_BOOL, 1);
+    return batch_bool(PyObject_IsTrue(a[0]));
+  case PYMEX_CMD_GET_TYPE:
+    BATCH_ARGS(GET_TYPE, 1);
+    return PyObject_Type(a[0]);
+  case PYMEX_CMD_IS_CALLABLE:
+    BATCH_ARGS(IS_CALLABLE, 1);
+    return batch_bool(PyCallable_Check(a[0]));
+  case PYMEX_CMD_IS_INSTANCE:
+    BATCH_ARGS(IS_INSTANCE, 2);
+    return batch_bool(PyObject_IsInstance(a[0], a[1]));
+  case PYMEX_CMD_DIR:
+    BATCH_ARGS(DIR, 1);
+    return PyObject_Dir(a[0]);
+  case PYMEX_CMD_TO_STR:
+    BATCH_ARGS(TO_STR, 1);
+    return PyObject_Str(a[0]);
+  default:
+    return PyErr_Format(PyExc_ValueError, "BATCH: pymex command %d can't be batched", op);
+  }
+}
+#undef BATCH_ARGS
+
+/* Reads a register number out of a BATCH argument. */
+static bool batch_register(double value, mwSize nregs, mwSize *reg) {
+  if (value < 0 || value > nregs || value != (mwSize) value) {
+    PyErr_Format(PyExc_ValueError, "BATCH: bad register number %g (registers are 0..%d)",
+		 value, (int) nregs);
+    return false;
+  }
+  *reg = (mwSize) value;
+  return true;
+}
+
+/* The BATCH command proper. Everything is checked before the registers
+   are filled, and all errors are Python errors, since the registers
+   may hold borrowed arguments (see Release_views). */
+static void Batch_run(int nlhs, mxArray *plhs[], const mxArray *ops,
+		      const mxArray *regs, const mxArray *outs, bool convert) {
+  const double *code = mxGetPr(ops);
+  const double *outcode = mxGetPr(outs);
+  mwSize nops = mxGetM(ops);
+  mwSize width = mxGetN(ops);
+  mwSize nouts = mxGetNumberOfElements(outs);
+  mwSize ninit = mxGetNumberOfElements(regs);
+  /* Each op makes at most one new value, which bounds the register
+     numbers a sensible program can use. Register 0 is "none" and always
+     stays empty. */
+  mwSize nregs = ninit + nops;
+  mwSize i, k, r;
+  if (nops && width < 2) {
+    PyErr_Format(PyExc_ValueError, "BATCH: ops needs at least a command and a destination");
+    return;
+  }
+  for (i=0; i<nops; i++)
+    if (decode_opcode(code[i]) < 0) {
+      PyErr_Format(PyExc_ValueError, "BATCH: op %d has a bad opcode %g (see OPCODE)",
+		   (int) i+1, code[i]);
+      return;
+    }
+  for (i=nops; i<nops*width; i++)
+    if (!batch_register(code[i], nregs, &r)) return;
+  for (i=0; i<nouts; i++)
+    if (!batch_register(outcode[i], nregs, &r)) return;
+
+  PyObject **reg = PyMem_New(PyObject *, nregs+1);
+  PyObject *src[width+1];
+  if (!reg) {
+    PyErr_NoMemory();
+    return;
+  }
+  for (i=0; i<=nregs; i++) reg[i] = NULL;
+  for (i=0; i<ninit; i++) {
+    const mxArray *item = mxGetCell(regs, i);
+    if (item && !(reg[i+1] = unboxv(item))) goto done;
+  }
+  for (i=0; i<nops; i++) {
+    int op = decode_opcode(code[i]);
+    mwSize dst = (mwSize) code[i+nops];
+    int nargs = 0;
+    for (k=2; k<width; k++) {
+      r = (mwSize) code[i+k*nops];
+      if (!r) break;
+      if (!reg[r]) {
+	PyErr_Format(PyExc_ValueError, "BATCH: op %d reads empty register %d",
+		     (int) i+1, (int) r);
+	goto done;
+      }
+      src[nargs++] = reg[r];
+    }
+    PyObject *result = batch_op(op, src, nargs);
+    if (!result) goto done;
+    if (dst) {
+      Py_XDECREF(reg[dst]);
+      reg[dst] = result;
+    }
+    else {
+      Py_DECREF(result);
+    }
+  }
+  for (i=0; i<nouts && i<(nlhs ? nlhs : 1); i++) {
+    r = (mwSize) outcode[i];
+    if (!reg[r]) {
+      PyErr_Format(PyExc_ValueError, "BATCH: output register %d is empty", (int) r);
+      goto done;
+    }
+    plhs[i] = convert ? Any_PyObject_to_mxArray(reg[r]) : boxb(reg[r]);
+    if (!plhs[i]) goto done;
+  }
+ done:
+  for (i=0; i<=nregs; i++) Py_XDECREF(reg[i]);
+  PyMem_Free(reg);
+}
+
 /* Define pymex commands via x-macro */
 #define PYMEX(name, min, max, doc, body) PYMEX_DEFINE(name,min,max,doc,body)
 #include XMACRO_DEFS
 #undef PYMEX
 
+typedef void (*pymex_fun)(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+#define PYMEX(name, min, max, doc, body) PYMEX_FUNPTR(name,min,max,doc,body)
+static const pymex_fun command_funs[] = {
+#include XMACRO_DEFS
+};
+#undef PYMEX
+
 /* mex body and related functions */
 
 static void ExitFcn(void) {
@@ -92,7 +389,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     initengmodule();
     mexAtExit(ExitFcn);
     mexLock(); /* See Issue #3 */
+    build_command_table();
+    /* pymexop may have codes from before a rebuild, and not the new
+       commands. */
+    mexEvalStringWithTrap("clear('pymexop')");
   }
+  /* Arguments borrowed by this command are released before returning. */
+  Py_ssize_t views_mark = Views_mark();
+  int strcmd;
   if (nrhs < 1 || mxIsEmpty(prhs[0])) {
     if (nlhs == 1) {
       plhs[0] = mxCreateCellMatrix(1,NUMBER_OF_PYMEX_COMMANDS+1);
@@ -106,21 +410,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     }
   }
   else if (mxIsNumeric(prhs[0])) {
-    enum PYMEX_COMMAND cmd = (int) mxGetScalar(prhs[0]);
-    /* While the numeric command selector is no longer used
-       for various reasons, I have left it in since it is
-       faster than the string-based command selector and
-       could theoretically be useful in the future.
-     */
-    /* Switch body defined via x-macro expansion */
-    switch (cmd) {
-#define PYMEX(name,min,max,doc,body) PYMEX_CASE(name,min,max,doc,body)
-#include XMACRO_DEFS
-#undef PYMEX
-    default:
-      mexErrMsgIdAndTxt("pymex:NotImplemented", 
-			"pymex command %d not implemented", cmd);
-    }
+    /* The numeric selector skips even the hashing. The m-file wrappers
+       look their opcodes up once through pymexop.m and keep them. */
+    double code = mxGetScalar(prhs[0]);
+    int cmd = decode_opcode(code);
+    if (cmd < 0)
+      mexErrMsgIdAndTxt("pymex:staleOpcode",
+			"%g is not an opcode of any command of this build of pymex. "
+			"Look it up again with OPCODE.", code);
+    command_funs[cmd](nlhs, plhs, nrhs-1, prhs+1);
+  }
+  else if (mxIsChar(prhs[0]) && (strcmd = find_command(prhs[0])) >= 0) {
+    command_funs[strcmd](nlhs, plhs, nrhs-1, prhs+1);
   }
   else if (mxIsChar(prhs[0])) {
     char *cmdstring = mxArrayToString(prhs[0]);
@@ -152,10 +453,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
       }
       mxFree(cmdstring);      
     }
-/* a bunch of else-ifs are generated here */    
-#define PYMEX(name,min,max,doc,body) PYMEX_STRCMP(name,min,max,doc,body)
-#include XMACRO_DEFS
-#undef PYMEX
     else {
       mexErrMsgIdAndTxt("pymex:NotImplemented", 
 			"pymex command '%s' not implemented", cmdstring);
@@ -177,6 +474,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 		      mxGetClassName(prhs[0]));
   }
 
+  Release_views(views_mark);
+
   /* Detect and pass on python errors */
   PyObject *err = PyErr_Occurred();
   if (err) {
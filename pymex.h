@@ -38,19 +38,45 @@
 #define PYMEX_DEBUG(format, args...) /*nop*/
 #endif
 
+mxArray *box_by_type(PyObject *pyobj);
+void Flush_caches(void);
 mxArray *box(PyObject *pyobj);
 mxArray *boxb(PyObject *pyobj);
 PyObject *unbox (const mxArray *mxobj);
 PyObject *unboxn (const mxArray *mxobj);
+PyObject *unboxv (const mxArray *mxobj);
+PyObject *Handle_release(const mxArray *mxobj);
 bool mxIsPyNull (const mxArray *mxobj);
 bool mxIsPyObject(const mxArray *mxobj);
 mxArray *PyObject_to_mxLogical(PyObject *pyobj);
+mxArray *PyObject_to_mxScalar(PyObject *pyobj, mxClassID mxclass);
+mxClassID mxClassID_from_name(const char *name);
+PyObject *mxElement_to_PyObject(const mxArray *mxobj, mwIndex i);
+bool PyObject_to_mxElement(PyObject *pyobj, mxArray *mxobj, mwIndex i);
 PyObject *mxChar_to_PyBytes(const mxArray *mxchar);
+PyObject *mxChars_to_PyBytes(const mxChar *chars, size_t len);
+mxArray *PyUnicode_to_mxChar(PyObject *pystr);
+PyObject *mxArray_to_PyStrings(const mxArray *mxobj, bool strip);
+mxArray *PyStrings_to_cellstr(PyObject *seq);
+mxArray *PyStrings_to_mxChar(PyObject *seq);
+PyObject *Attr_name(const mxArray *mxname);
 PyObject *mxCell_to_PyTuple(const mxArray *mxobj);
-PyObject *mxCell_to_PyTuple_recursive(const mxArray *mxobj);
+PyObject *mxCell_to_PyTuple_views(const mxArray *mxobj);
+bool Is_kwargs_spec(const mxArray *spec);
+PyObject *Kwargs_from_mxArray(const mxArray *spec);
+bool Split_call_args(const mxArray *cell, PyObject **args, PyObject **kwargs);
+PyObject *Subsref_chain(PyObject *pyobj, const mxArray *S, mwSize count);
+bool Subsasgn_chain(PyObject *pyobj, const mxArray *S, PyObject *value);
+int Unpack_outputs(PyObject *result, int nout, mxArray *outs[], bool convert);
+mxArray *Box_outputs(PyObject *result, int nout);
+enum { CELL_LEAF_WRAP, CELL_LEAF_VIEW, CELL_LEAF_NUMPY };
+PyObject *mxCell_to_PyTree(const mxArray *root, int leaves);
 mxArray *PyBytes_to_mxChar(PyObject *pystr);
 mxArray *PyObject_to_mxChar(PyObject *pyobj);
 mxArray *PySequence_to_mxCell(PyObject *pyobj);
+mxArray *PySequence_to_mxArray(PyObject *pyobj);
+mxArray *Sequence_to_dense(PyObject *seq);
+mxArray *PyTree_to_mxArray(PyObject *root);
 mxArray *PyObject_to_mxDouble(PyObject *pyobj);
 mxArray *PyObject_to_mxLong(PyObject *pyobj);
 PyObject *Any_mxArray_to_PyObject(const mxArray *mxobj);
@@ -61,6 +87,35 @@ PyObject *Py_mxArray_New(mxArray *mxobj, bool duplicate);
 int Py_mxArray_Check(PyObject *pyobj);
 PyObject *mxArray_to_PyArray(const mxArray *mxobj, bool duplicate);
 mxArray *PyArray_to_mxArray(PyObject *pyobj);
+mxArray *Scipy_to_mxSparse(PyObject *pyobj);
+typedef void (*Parallel_fn)(void *ctx, size_t begin, size_t end);
+void Run_parallel(Parallel_fn fn, void *ctx, size_t count, size_t bytes);
+void Copy_strided_to_fortran(void *dst, const void *src, int ndim,
+			     const Py_ssize_t *shape, const Py_ssize_t *strides,
+			     size_t itemsize);
+void Deinterleave_complex(void *re, void *im, const void *z, size_t n, size_t realsize);
+void Interleave_complex(void *z, const void *re, const void *im, size_t n, size_t realsize);
+bool Narrow_ascii(char *dst, const mxChar *src, size_t n);
+bool Widen_ascii(mxChar *dst, const char *src, size_t n);
+void Char_rows(mxChar *dst, const mxChar *src, size_t m, size_t n);
+void Pad_char_rows(mxChar *dst, const char *const *rows, const size_t *lens,
+		   size_t m, size_t n);
+bool Copy_indices(mwIndex *dst, const void *src, int width, size_t n, mwIndex limit);
+void Narrow_indices(int32_t *dst, const mwIndex *src, size_t n);
+bool Expand_pointers(mwIndex *rows, const mwIndex *ptr, size_t n, size_t nnz);
+void Order_by_row(mwIndex *order, mwIndex *counts, const mwIndex *rows,
+		  size_t nnz, size_t nrows);
+enum { SPARSE_REAL, SPARSE_COMPLEX, SPARSE_LOGICAL };
+typedef struct {
+  size_t nnz, ncols;
+  const mwIndex *rows, *cols, *order;
+  const void *values;		/* double, interleaved complex or mxLogical */
+  int kind;
+} Sparse_entries;
+size_t Rows_to_columns(const Sparse_entries *in, mwIndex *jc, mwIndex *ir,
+		       void *pr, double *pi);
+size_t Drop_sparse_zeros(mwIndex *jc, mwIndex *ir, void *pr, double *pi,
+			 size_t ncols, int kind);
 PyMODINIT_FUNC initmatlabmodule(void);
 PyMODINIT_FUNC initmexmodule(void);
 PyMODINIT_FUNC initmxmodule(void);
@@ -68,9 +123,28 @@ PyMODINIT_FUNC initmatmodule(void);
 PyMODINIT_FUNC initengmodule(void);
 char mxClassID_to_Numpy_Typekind(mxClassID mxclass);
 mxArray *mxArrayPtr(PyObject *pyobj);
+mxArray *mxArray_Take(PyObject *pyobj);
+mxArray *mxArray_Writable(PyObject *pyobj);
+Py_ssize_t Views_mark(void);
+void Release_views(Py_ssize_t mark);
+bool Views_keep(PyObject *owner);
+mxArray *Stack_items(PyObject **items, Py_ssize_t n);
+PyObject *Struct_to_columns(const mxArray *st, bool structured);
+PyObject *Map_items(mxArray *map);
+PyObject *Map_keys(mxArray *map, mxArray **mxkeys);
+PyObject *Map_values(mxArray *map, const mxArray *mxkeys, mwSize first, mwSize count);
+mxArray *PyDict_to_Map(PyObject *dict);
+mxArray *Iter_next_n(PyObject *iter, mwSize n, bool convert, bool *done);
+mxArray *Map_array(PyObject *fn, const mxArray *input, mwSize axis,
+		   mxClassID outclass, bool yield);
+bool *Find_option(const char *name);
+extern bool Option_borrow_args;
+extern bool Option_dense_sequences;
+extern bool Option_dict_structs;
 PyObject *mxArrayPtr_New(mxArray *mxobj);
 int mxArrayPtr_Check(PyObject *obj);
 PyObject *Find_mltype_for(mxArray *mxobj);
+void Flush_mltype_cache(void);
 
 #ifndef MEXMODULE
 extern PyObject *mexmodule;
@@ -103,6 +177,13 @@ PyObject *engmodule = NULL;
 typedef struct {
     PyObject_HEAD
     PyObject *mxptr;
+    bool readonly;        /* exported buffers are read-only */
+    int exports;          /* buffers and array structs currently out */
+    int views;            /* borrowed views of its contents currently out */
+    bool shared;          /* stands for several cells (see mxCell_to_PyTree) */
+    mxArray *layout_of;   /* the array layout was worked out for */
+    Py_ssize_t *layout;   /* shape, then strides */
+    void *interface;      /* reused by __array_struct__ */
 } mxArrayObject;
 
 
@@ -0,0 +1,21 @@
+% op = pymexop(name)
+% Returns the numeric opcode for a pymex command. The codes for every
+% command are looked up with OPCODE in one go on first use and kept; the
+% wrappers keep the one they need in a persistent variable, so they
+% dispatch without pymex hashing the name each time.
+%
+% A code carries a hash of its command's name, so it stays good across
+% rebuilds of pymex for as long as that command exists. pymex clears
+% this cache when it loads, so commands added since are found, and
+% pymex('FLUSH_CACHES') (or clear pymexop) clears it too.
+function op = pymexop(name)
+persistent ops
+if isempty(ops)
+    names = pymex();
+    names = names(~strcmp(names, 'help'));
+    ops = cell2struct(num2cell(pymex('OPCODE', names)), names, 2);
+end
+op = ops.(name);
+
+% Copyright (c) 2009 Ken Watford (kwatford@cise.ufl.edu)
+% For full license details, see the LICENSE file.
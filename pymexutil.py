@@ -8,7 +8,6 @@ might want to have a look-see.
 # For full license details, see the LICENSE file.
 
 import mx
-import struct
 
 __unpy_registry = dict()
 def register_unpy(cls, func):
@@ -27,7 +26,12 @@ def unregister_unpy(cls):
 def unpy(obj):
     '''
     Converts the given object to an mxArray 
-    This is called by Any_PyObject_to_mxArray in the C sources.
+    This is called by Any_PyObject_to_mxArray in the C sources,
+    for anything it doesn't convert itself. The C side handles
+    exact instances of float, bool, int, long, str, tuple, list
+    and dict, NumPy arrays and scalars, and scipy.sparse matrices,
+    so registering converters
+    for those types only affects their subclasses.
 
     To make your types work with this, provide a
     __mxArray__() method. You may be able to inject
@@ -59,6 +63,9 @@ def seq_to_cell(self):
     Given an iterable of known length, produce a cell array.
     This is not done recursively. We would need to check for
     recursive structure in that case.
+    Exact lists and tuples don't come here; the C side turns
+    those into dense arrays when it can (see the dense_sequences
+    option), and into cells like this one otherwise.
     '''
     size = (1, len(self))
     cell = mx.create_cell_array(size, wrap=True)
@@ -71,24 +78,43 @@ def seq_to_cell(self):
 register_unpy(tuple, seq_to_cell)
 register_unpy(list, seq_to_cell)
 
-def _make_scalar_unpy(scalartype, fmt, mxclass):
+def _make_scalar_unpy(scalartype, mxclass):
+    '''
+    mxclass is either the class to use, or a function
+    picking one for the value at hand.
+    '''
     def _scalar_unpy(self):
-        byteval = struct.pack(fmt, self)
-        scalar = mx.create_numeric_array(dims=(1,1), mxclass=mxclass, wrap=True)
-        assert len(byteval) == scalar._get_element_size(), (
-            "Datatype size mismatch")
-        scalar._set_element(byteval)
-        return scalar
+        cls = mxclass(self) if callable(mxclass) else mxclass
+        return mx.create_scalar(self, mxclass=cls, wrap=True)
     register_unpy(scalartype, _scalar_unpy)
 
+def _long_mxclass(value):
+    '''
+    As the C side does for exact longs: int64 when it fits,
+    uint64 for the big positive ones that fit there, and
+    double for anything bigger still.
+    '''
+    bits = value.bit_length()
+    if bits < 64: return mx.INT64
+    if bits == 64 and value > 0: return mx.UINT64
+    return mx.DOUBLE
+
+def _int_mxclass(value):
+    '''
+    As the C side does for exact ints: int32, unless the
+    value needs more.
+    '''
+    if -2**31 <= value < 2**31: return mx.INT32
+    return mx.INT64
+
 try: 
-    _make_scalar_unpy(long, "q", mx.INT64)
-    _make_scalar_unpy(int, "i", mx.INT32)
+    _make_scalar_unpy(long, _long_mxclass)
+    _make_scalar_unpy(int, _int_mxclass)
 except: # Python 3 does not have longs. ints are long when necessary.
-    _make_scalar_unpy(int, "q", mx.INT64)
+    _make_scalar_unpy(int, _long_mxclass)
 
-_make_scalar_unpy(float, "d", mx.DOUBLE)
-_make_scalar_unpy(bool, "?", mx.LOGICAL)
+_make_scalar_unpy(float, mx.DOUBLE)
+_make_scalar_unpy(bool, mx.LOGICAL)
 
 
 ## Some sample unpy stuff for numpy 
@@ -99,13 +125,15 @@ try:
     def select_mxclass_by_dtype(dtype):
         '''
         Tries to select an appropriate mxclass.
-        Doesn't handle complex dtypes.
+        Complex dtypes get the class of their parts.
         '''
         global __dtype_map
         if __dtype_map is None:
             __dtype_map = {
                 np.float64 : mx.DOUBLE,
                 np.float32 : mx.SINGLE,
+                np.complex128 : mx.DOUBLE,
+                np.complex64 : mx.SINGLE,
                 np.int64 : mx.INT64,
                 np.uint64 : mx.UINT64,
                 np.int32 : mx.INT32,
@@ -121,7 +149,7 @@ try:
         try: return __dtype_map[dtype]
         except: pass
         # Make a vague attempt at providing something appropriate
-        if issubclass(dtype, np.floating): return mx.DOUBLE
+        if issubclass(dtype, (np.floating, np.complexfloating)): return mx.DOUBLE
         elif issubclass(dtype, np.unsignedinteger): return mx.UINT64
         elif issubclass(dtype, np.integer): return mx.INT64
         else: raise TypeError, ("Couldn't figure out an appropriate "
@@ -135,6 +163,12 @@ try:
         See Issue #5
         '''
         self = np.atleast_2d(self)
+        if np.iscomplexobj(self):
+            # Native complex arrays are split up on the C side; this
+            # is for the rest. MATLAB keeps the parts apart anyway.
+            import mex
+            return mex.call('complex', numpy_ndarray_unpy(self.real),
+                            numpy_ndarray_unpy(self.imag))
         mxclass = select_mxclass_by_dtype(self.dtype.type)    
         cobj = mx.create_numeric_array(mxclass = mxclass,
                                        dims = self.shape)
@@ -146,6 +180,38 @@ try:
     register_unpy(np.ndarray, numpy_ndarray_unpy)
     # Also register it for numpy scalars
     register_unpy(np.generic, numpy_ndarray_unpy)
+
+    class _array_holder(object):
+        '''
+        Hands NumPy an __array_struct__ made on the C side. The
+        array keeps the holder as its base, which keeps the struct
+        (and whatever it points into) alive.
+        '''
+        def __init__(self, array_struct):
+            self.__array_struct__ = array_struct
+
+    def sparse_to_scipy(self, index_dtype=None):
+        '''
+        Returns a scipy.sparse.csc_matrix whose data, indices and
+        indptr are views of the MATLAB sparse array's pr, ir and jc.
+        Indices are as wide as MATLAB's (int64 on 64-bit) unless
+        index_dtype=np.int32 asks for narrowed copies. Complex
+        data can't be viewed, since MATLAB keeps pi apart, so it's
+        combined into a new array.
+        '''
+        import scipy.sparse
+        width = np.dtype(index_dtype).itemsize if index_dtype else 0
+        m, n, data, imag, indices, indptr = self._sparse_parts(index_width=width)
+        data = np.asarray(_array_holder(data))
+        if imag is not None:
+            data = data + 1j * np.asarray(_array_holder(imag))
+        matrix = scipy.sparse.csc_matrix((m, n), dtype=data.dtype)
+        # Set rather than passed in, so scipy doesn't copy the
+        # indices to narrow them.
+        matrix.data = data
+        matrix.indices = np.asarray(_array_holder(indices))
+        matrix.indptr = np.asarray(_array_holder(indptr))
+        return matrix
 except: pass # No numpy for you, I guess
 
 def findtype(typelist):
@@ -3,6 +3,97 @@
 
 #include "pymex.h"
 #include <mex.h>
+#include <stdint.h>
+#include <string.h>
+
+/* 512 is probably a bit too generous. I believe MATLAB has a builtin limit - what is it? */
+#define MAX_MXTYPE_NAME_SIZE 512
+
+/*
+  Walking the mro costs a 'which' per entry plus the constructor call,
+  all of them trips through the MATLAB interpreter. The outcome only
+  depends on the type, so wrapper_cache maps each type object to the name
+  of the wrapper that worked for it (a PyBytes), or to None if nothing in
+  its mro had a wrapper and the default was used. Keeping the type as a
+  dict key also keeps it alive, so a recycled type pointer can't pick up
+  somebody else's entry.
+
+  MATLAB gives us no notification when its path changes or classes are
+  cleared, so stale entries are handled two ways: a cached wrapper whose
+  constructor fails is dropped and the mro is walked again, and the
+  FLUSH_CACHES command throws the whole thing away (needed when a new
+  wrapper class appears for a type that is cached as None).
+*/
+static PyObject *wrapper_cache = NULL;
+
+/* Tries each entry of the mro in turn. On success, *found is set to the
+   name of the wrapper class that was used. */
+static mxArray *box_by_mro(PyObject *pyobj, PyObject **found) {
+  static char mlname[MAX_MXTYPE_NAME_SIZE] = {0};
+  static char *package = "py.types.%s.%s";
+  mxArray *box = NULL;
+  mxArray *mxname;
+  mxArray *which;
+  mxArray *err = NULL;
+  PyObject *type = (PyObject *) pyobj->ob_type;
+  PyObject *mro;
+  *found = NULL;
+  if (PyType_Check(pyobj)) {
+    /* Calling type on a type gives us back type, and
+       calling mro on type doesn't work quite the same,
+       so we special case this one. We don't actually have
+       a wrapper type to wrap type, but if we did, it would.
+       Yo dawg.
+    */
+    PYMEX_DEBUG("Object is a type...\n");
+    mro = PyTuple_Pack(1, &PyType_Type);
+  }
+  else {
+    PYMEX_DEBUG("Object is not a type...\n");
+    mro = PyObject_CallMethod(type, "mro", "()");
+  }
+  Py_ssize_t len = PySequence_Length(mro);
+  Py_ssize_t i;
+  for (i=0; i<len; i++) {
+    PyObject *item = PySequence_GetItem(mro, i);
+    if (item == pyobj) {
+      PYMEX_DEBUG("Pointers match!?\n"); 
+    }
+    else if (!item) {
+      PYMEX_DEBUG("Item is null!?\n");
+    }
+    else {
+      PYMEX_DEBUG("Ok, getting name...\n");
+    }
+    PyObject *modname = PyObject_GetAttrString(item, "__module__");
+    PyObject *cleanmodname = PyObject_CallMethod(modname, "strip", "s", "_");
+    PyObject *name = PyObject_GetAttrString(item, "__name__");
+    snprintf(mlname, MAX_MXTYPE_NAME_SIZE, package, 
+	     PyBytes_AsString(cleanmodname), PyBytes_AsString(name));
+    PYMEX_DEBUG("Checking for %s...\n", mlname);
+    Py_DECREF(name);
+    Py_DECREF(cleanmodname);
+    Py_DECREF(modname);
+    Py_DECREF(item);
+    mxname = mxCreateString(mlname);
+    mxArray *werr = mexCallMATLABWithTrap(1,&which,1,&mxname,"which");
+    mxDestroyArray(mxname);
+    if (!werr && mxGetNumberOfElements(which) > 0) {
+      PYMEX_DEBUG("%s looks good, trying it...\n", mlname);
+      err = mexCallMATLABWithTrap(1,&box,0,NULL,mlname);
+      mxDestroyArray(which);
+      if (!err) {
+	*found = PyBytes_FromString(mlname);
+	break;
+      }
+    }
+    else {
+      mxDestroyArray(which);
+    }
+  }
+  Py_DECREF(mro);
+  return err ? NULL : box;
+}
 
 /*
   box_by_type - Given a python object, will arrange for a MATLAB object
@@ -31,77 +122,43 @@
   thing can be called with no arguments. So it may be a class, or it may be a
   simple m-function that returns a class instance. 
 
+  The mro walk only happens the first time a type is seen; after that the
+  answer comes out of wrapper_cache (see above).
+
   box_by_type doesn't actually insert the PyObject's pointer into the result,
   it just instantiates the MATLAB wrapper. 
 */
-/* 512 is probably a bit too generous. I believe MATLAB has a builtin limit - what is it? */
-#define MAX_MXTYPE_NAME_SIZE 512
 mxArray *box_by_type(PyObject *pyobj) {
-  static char mlname[MAX_MXTYPE_NAME_SIZE] = {0};
-  static char *package = "py.types.%s.%s";
   PYMEX_DEBUG("Trying to box %p\n", pyobj);
   mxArray *box = NULL;
-  mxArray *mxname;
-  mxArray *which;
   mxArray *err = NULL;
   if (!pyobj) {
     err = mexCallMATLABWithTrap(1,&box,0,NULL,PYMEX_MATLAB_VOIDPTR);
   }
   else {
-    PyObject *type = (PyObject *) pyobj->ob_type;
-    PyObject *mro;
-    if (PyType_Check(pyobj)) {
-      /* Calling type on a type gives us back type, and
-	 calling mro on type doesn't work quite the same,
-	 so we special case this one. We don't actually have
-	 a wrapper type to wrap type, but if we did, it would.
-	 Yo dawg.
-      */
-      PYMEX_DEBUG("Object is a type...\n");
-      mro = PyTuple_Pack(1, &PyType_Type);
-    }
-    else {
-      PYMEX_DEBUG("Object is not a type...\n");
-      mro = PyObject_CallMethod(type, "mro", "()");
-    }
-    Py_ssize_t len = PySequence_Length(mro);
-    Py_ssize_t i;
-    for (i=0; i<len; i++) {
-      PyObject *item = PySequence_GetItem(mro, i);
-      if (item == pyobj) {
-	PYMEX_DEBUG("Pointers match!?\n"); 
-      }
-      else if (!item) {
-	PYMEX_DEBUG("Item is null!?\n");
-      }
-      else {
-	PYMEX_DEBUG("Ok, getting name...\n");
-      }
-      PyObject *modname = PyObject_GetAttrString(item, "__module__");
-      PyObject *cleanmodname = PyObject_CallMethod(modname, "strip", "s", "_");
-      PyObject *name = PyObject_GetAttrString(item, "__name__");
-      snprintf(mlname, MAX_MXTYPE_NAME_SIZE, package, 
-	       PyBytes_AsString(cleanmodname), PyBytes_AsString(name));
-      PYMEX_DEBUG("Checking for %s...\n", mlname);
-      Py_DECREF(name);
-      Py_DECREF(cleanmodname);
-      Py_DECREF(modname);
-      Py_DECREF(item);
-      mxname = mxCreateString(mlname);
-      mxArray *werr = mexCallMATLABWithTrap(1,&which,1,&mxname,"which");
-      mxDestroyArray(mxname);
-      if (!werr && mxGetNumberOfElements(which) > 0) {
-	PYMEX_DEBUG("%s looks good, trying it...\n", mlname);
-	err = mexCallMATLABWithTrap(1,&box,0,NULL,mlname);
-	mxDestroyArray(which);
-	if (!err) break;
-      }
-      else {
-	mxDestroyArray(which);
+    /* All types share a single entry, since box_by_mro treats them alike. */
+    PyObject *key = PyType_Check(pyobj) 
+      ? (PyObject *) &PyType_Type : (PyObject *) pyobj->ob_type;
+    if (!wrapper_cache) wrapper_cache = PyDict_New();
+    PyObject *cached = PyDict_GetItem(wrapper_cache, key);
+    if (cached && PyBytes_Check(cached)) {
+      PYMEX_DEBUG("Cached wrapper %s\n", PyBytes_AsString(cached));
+      err = mexCallMATLABWithTrap(1,&box,0,NULL,PyBytes_AsString(cached));
+      if (err || !box) {
+	/* Wrapper went away since we cached it. Forget it and look again. */
+	PYMEX_DEBUG("Cached wrapper failed, walking the mro again.\n");
+	PyDict_DelItem(wrapper_cache, key);
+	cached = NULL;
+	box = NULL;
       }
     }
-    Py_DECREF(mro);
-    if (err || !box) { /* none found, use sane default */
+    if (!cached) {
+      PyObject *found = NULL;
+      box = box_by_mro(pyobj, &found);
+      PyDict_SetItem(wrapper_cache, key, found ? found : Py_None);
+      Py_XDECREF(found);
+    }
+    if (!box) { /* none found, use sane default */
       PYMEX_DEBUG("No reasonable box found, using default.\n");
       err = mexCallMATLABWithTrap(1,&box,0,NULL,PYMEX_MATLAB_PYOBJECT);
     }
@@ -115,19 +172,170 @@ mxArray *box_by_type(PyObject *pyobj) {
   return box;
 }
 
+/*
+  The handle registry. Boxed objects don't carry a raw PyObject pointer;
+  the "pointer" property of py.types.voidptr holds a handle id instead:
+
+    bits 63-48: PYMEX_HANDLE_TAG, so that stray numbers aren't mistaken
+                for handles
+    bits 47-32: generation of the slot
+    bits 31-0:  index of the slot in handle_table
+
+  A slot's generation is bumped whenever it is freed, so an id that
+  outlives its object (say, a voidptr saved and loaded by hand) is caught
+  as stale instead of being dereferenced. The id 0 is the null handle.
+  Looking an id up is a bounds check and an array access; the only libmx
+  call left in unboxing is the mxGetProperty that reads the id.
+*/
+#define PYMEX_HANDLE_TAG ((uint64_t) 0x5059)
+#define HANDLE_NO_SLOT ((uint32_t) 0xFFFFFFFF)
+#define HANDLE_MAKE(gen, index) \
+  ((PYMEX_HANDLE_TAG << 48) | ((uint64_t) ((gen) & 0xFFFF) << 32) | (uint64_t) (index))
+#define HANDLE_TAG(id) ((id) >> 48)
+#define HANDLE_GEN(id) ((uint32_t) (((id) >> 32) & 0xFFFF))
+#define HANDLE_INDEX(id) ((uint32_t) ((id) & 0xFFFFFFFF))
+
+typedef struct {
+  PyObject *obj;        /* NULL when the slot is free */
+  uint32_t generation;
+  uint32_t next_free;   /* free list link, only meaningful when obj is NULL */
+} handle_slot;
+
+static handle_slot *handle_table = NULL;
+static uint32_t handle_capacity = 0;
+static uint32_t handle_free = HANDLE_NO_SLOT;
+
+/* Files the object under a new handle, stealing the reference.
+   Returns 0 if the table couldn't grow. */
+static uint64_t Handle_register(PyObject *pyobj) {
+  if (handle_free == HANDLE_NO_SLOT) {
+    uint32_t newcap = handle_capacity ? 2*handle_capacity : 256;
+    handle_slot *table = PyMem_Resize(handle_table, handle_slot, newcap);
+    if (!table) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    uint32_t i;
+    for (i=handle_capacity; i<newcap; i++) {
+      table[i].obj = NULL;
+      table[i].generation = 0;
+      table[i].next_free = (i+1 < newcap) ? i+1 : HANDLE_NO_SLOT;
+    }
+    handle_table = table;
+    handle_free = handle_capacity;
+    handle_capacity = newcap;
+  }
+  uint32_t index = handle_free;
+  handle_slot *slot = &handle_table[index];
+  handle_free = slot->next_free;
+  slot->obj = pyobj;
+  return HANDLE_MAKE(slot->generation, index);
+}
+
+/* Returns the slot for a live handle, or NULL. */
+static handle_slot *Handle_slot(uint64_t id) {
+  if (HANDLE_TAG(id) != PYMEX_HANDLE_TAG) return NULL;
+  uint32_t index = HANDLE_INDEX(id);
+  if (index >= handle_capacity) return NULL;
+  handle_slot *slot = &handle_table[index];
+  if (!slot->obj || (slot->generation & 0xFFFF) != HANDLE_GEN(id)) return NULL;
+  return slot;
+}
+
+/* Reads the handle id out of a voidptr. Anything without a usable
+   pointer property reads as the null handle. */
+static uint64_t mxGetHandle(const mxArray *mxobj) {
+  uint64_t id = 0;
+  mxArray *ptr_field = mxGetProperty(mxobj, 0, "pointer");
+  if (!ptr_field) return 0;
+  if (mxGetClassID(ptr_field) == mxUINT64_CLASS 
+      && mxGetNumberOfElements(ptr_field) == 1)
+    id = *(uint64_t *) mxGetData(ptr_field);
+  mxDestroyArray(ptr_field);
+  return id;
+}
+
+/* Forgets the handle held by a voidptr, returning the object it held
+   (the registry's reference passes to the caller). Null and stale
+   handles give NULL without setting an error. */
+PyObject *Handle_release(const mxArray *mxobj) {
+  handle_slot *slot = Handle_slot(mxGetHandle(mxobj));
+  if (!slot) return NULL;
+  PyObject *pyobj = slot->obj;
+  slot->obj = NULL;
+  slot->generation++;
+  slot->next_free = handle_free;
+  handle_free = (uint32_t) (slot - handle_table);
+  return pyobj;
+}
+
+/*
+  Class names already known to be (or not to be) subclasses of a base
+  class - py.types.voidptr or kw - so that mxIsa only has to ask the
+  interpreter once per class. Every class box() instantiates goes in as
+  a voidptr.
+*/
+#define MAX_KNOWN_CLASSES 64
+#define MAX_KNOWN_CLASS_NAME 128
+static struct {
+  char name[MAX_KNOWN_CLASS_NAME];
+  const char *base;
+  bool isa;
+} known_classes[MAX_KNOWN_CLASSES];
+static int num_known_classes = 0;
+
+/* Returns 1 or 0 for a known class, -1 if we haven't seen it yet. */
+static int known_class_isa(const char *name, const char *base) {
+  int i;
+  for (i=0; i<num_known_classes; i++) {
+    if (!strcmp(known_classes[i].name, name) && !strcmp(known_classes[i].base, base))
+      return known_classes[i].isa;
+  }
+  return -1;
+}
+
+/* base must be a string constant. */
+static void known_class_add(const char *name, const char *base, bool isa) {
+  /* If the table is full or the name too long, we just keep asking. */
+  if (num_known_classes >= MAX_KNOWN_CLASSES
+      || strlen(name) >= MAX_KNOWN_CLASS_NAME
+      || known_class_isa(name, base) >= 0)
+    return;
+  strcpy(known_classes[num_known_classes].name, name);
+  known_classes[num_known_classes].base = base;
+  known_classes[num_known_classes].isa = isa;
+  num_known_classes++;
+}
+
+/* Throws away everything we've cached about MATLAB classes. */
+void Flush_caches(void) {
+  if (wrapper_cache) PyDict_Clear(wrapper_cache);
+  Flush_mltype_cache();
+  num_known_classes = 0;
+}
+
 /* boxes the object, stealing the reference */
 mxArray *box (PyObject *pyobj) {
   mxArray *boxed = NULL;
+  uint64_t id = 0;
   if (!pyobj) {
     PYMEX_DEBUG("Boxing null object.");
   }
   boxed = box_by_type(pyobj);
   if (!boxed) return NULL;
-  if (pyobj) mexLock();
-  mxArray *ptr_field = mxGetProperty(boxed, 0, "pointer");
-  void **ptr = mxGetData(ptr_field);
-  *ptr = (void*) pyobj;
+  known_class_add(mxGetClassName(boxed), PYMEX_MATLAB_VOIDPTR, true);
+  if (pyobj) {
+    id = Handle_register(pyobj);
+    if (!id) {
+      Py_DECREF(pyobj);
+      return NULL;
+    }
+    mexLock();
+  }
+  mxArray *ptr_field = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+  *(uint64_t *) mxGetData(ptr_field) = id;
   mxSetProperty(boxed, 0, "pointer", ptr_field);
+  mxDestroyArray(ptr_field);
   return boxed;
 }
 
@@ -140,16 +348,48 @@ mxArray *boxb (PyObject *pyobj) {
 /* Unboxes an object, returning a borrowed reference */
 PyObject *unbox (const mxArray *mxobj) {  
   if (!mxobj) return PyErr_Format(MATLABError, "Can't unbox from null pointer");
-  if (mxIsPyNull(mxobj)) {
+  uint64_t id = mxGetHandle(mxobj);
+  if (!id) {
     PYMEX_DEBUG("Unboxed a null object.");
     return PyErr_Format(MATLABError, "Unboxed pointer is null.");
   }
-  else {
-    void **ptr = mxGetData(mxGetProperty(mxobj, 0, "pointer"));
-    return (PyObject *) *ptr;
-  }
+  handle_slot *slot = Handle_slot(id);
+  if (!slot)
+    return PyErr_Format(MATLABError, "Stale or invalid Python object handle.");
+  return slot->obj;
 }
 
+/*
+  Conversion policy switches. The OPTION command reads and sets them by
+  name; C code just looks at the variables.
+*/
+bool Option_borrow_args = true;
+bool Option_dense_sequences = true;
+bool Option_dict_structs = true;
+
+static struct {
+  const char *name;
+  bool *value;
+} options[] = {
+  {"borrow_args", &Option_borrow_args},
+  {"dense_sequences", &Option_dense_sequences},
+  {"dict_structs", &Option_dict_structs},
+  {NULL, NULL}
+};
+
+/* Returns the named switch, or NULL if there isn't one. */
+bool *Find_option(const char *name) {
+  int i;
+  for (i=0; options[i].name; i++)
+    if (!strcmp(options[i].name, name)) return options[i].value;
+  return NULL;
+}
+
+/* Set while converting arguments that may be borrowed; see
+   Py_mxArray_View. */
+static bool make_views = false;
+static PyObject *Py_mxArray_View(const mxArray *mxobj);
+
 /* Unboxes an object, returning a new reference */
 PyObject *unboxn (const mxArray *mxobj) {
   PyObject *pyobj;
@@ -163,49 +403,373 @@ PyObject *unboxn (const mxArray *mxobj) {
   return pyobj;
 }
 
+/* Like unboxn, but arrays come through as read-only views of the
+   caller's data if borrow_args is on. Only for command arguments. */
+PyObject *unboxv (const mxArray *mxobj) {
+  make_views = Option_borrow_args;
+  PyObject *pyobj = unboxn(mxobj);
+  make_views = false;
+  return pyobj;
+}
+
 /* Returns true if the wrapper's pointer is NULL. 
-   Only pass it voidptr (and subclasses thereof), as
-   it does not check this before doing the mxGetProperty
+   Only pass it voidptr (and subclasses thereof); anything
+   else reads as null.
  */
 bool mxIsPyNull (const mxArray *mxobj) {
-  void **ptr = mxGetData(mxGetProperty(mxobj, 0, "pointer"));
-  return !*ptr;
+  return !mxGetHandle(mxobj);
 }
 
-/* Asks the MATLAB interpreter if the object isa subclass of voidptr.
-   This includes null pointers and things not descended from object.
- */
-bool mxIsPyObject(const mxArray *mxobj) {
-  mxArray *boolobj;
+/* Whether the object is of a builtin MATLAB type, which can't be a
+   subclass of anything. */
+static bool builtin_class(const mxArray *mxobj) {
+  switch (mxGetClassID(mxobj)) {
+  case mxCELL_CLASS:
+  case mxSTRUCT_CLASS:
+  case mxLOGICAL_CLASS:
+  case mxCHAR_CLASS:
+  case mxDOUBLE_CLASS:
+  case mxSINGLE_CLASS:
+  case mxINT8_CLASS:
+  case mxUINT8_CLASS:
+  case mxINT16_CLASS:
+  case mxUINT16_CLASS:
+  case mxINT32_CLASS:
+  case mxUINT32_CLASS:
+  case mxINT64_CLASS:
+  case mxUINT64_CLASS:
+  case mxFUNCTION_CLASS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Whether the object isa base (a string constant). The MATLAB
+   interpreter is asked once per class name, and the answer remembered
+   in known_classes. */
+static bool mxIsa(const mxArray *mxobj, const char *base) {
+  if (builtin_class(mxobj)) return false;
+  const char *classname = mxGetClassName(mxobj);
+  int known = known_class_isa(classname, base);
+  if (known >= 0) return known;
+  mxArray *boolobj = NULL;
   mxArray *args[2];
   args[0] = (mxArray *) mxobj;
-  args[1] = mxCreateString(PYMEX_MATLAB_VOIDPTR);
-  mexCallMATLABWithTrap(1,&boolobj,2,args,"isa");
+  args[1] = mxCreateString(base);
+  mxArray *err = mexCallMATLABWithTrap(1,&boolobj,2,args,"isa");
   mxDestroyArray(args[1]);
-  return mxIsLogicalScalarTrue(boolobj);
+  /* If isa itself failed, say no, but don't remember it. */
+  if (err || !boolobj) return false;
+  bool isa = mxIsLogicalScalarTrue(boolobj);
+  mxDestroyArray(boolobj);
+  known_class_add(classname, base, isa);
+  return isa;
+}
+
+/* Determines whether the object isa subclass of voidptr.
+   This includes null pointers and things not descended from object. */
+bool mxIsPyObject(const mxArray *mxobj) {
+  return mxIsa(mxobj, PYMEX_MATLAB_VOIDPTR);
+}
+
+/* Whether the object is a kw, or of a subclass of kw. */
+static bool mxIsKw(const mxArray *mxobj) {
+  return mxIsClass(mxobj, "kw") || mxIsa(mxobj, "kw");
+}
+
+static const union { uint16_t word; char first; } native_order = {1};
+
+/* UTF-16 to a str. ASCII is narrowed straight into the new string;
+   anything else is decoded and stored as UTF-8. */
+PyObject *mxChars_to_PyBytes(const mxChar *chars, size_t len) {
+  PyObject *pystr = PyBytes_FromStringAndSize(NULL, len);
+  if (!pystr || Narrow_ascii(PyBytes_AS_STRING(pystr), chars, len))
+    return pystr;
+  Py_DECREF(pystr);
+  int byteorder = native_order.first ? -1 : 1;
+  PyObject *text = PyUnicode_DecodeUTF16((const char *) chars, len * sizeof(mxChar),
+					 "replace", &byteorder);
+  if (!text) return NULL;
+  pystr = PyUnicode_AsUTF8String(text);
+  Py_DECREF(text);
+  return pystr;
 }
 
 PyObject *mxChar_to_PyBytes(const mxArray *mxchar) {
   if (!mxchar || !mxIsChar(mxchar))
     mexErrMsgTxt("Input isn't a mxChar");
-  char *tempstring = mxArrayToString(mxchar);
-  if (!tempstring)
-    mexErrMsgTxt("Couldn't stringify mxArray for some reason.");
-  PyObject *pystr = PyBytes_FromString(tempstring);
-  mxFree(tempstring);
+  PyObject *pystr = mxChars_to_PyBytes(mxGetChars(mxchar), mxGetNumberOfElements(mxchar));
   if (!pystr)
     mexErrMsgTxt("Couldn't convert from string to PyBytes");
   return pystr;
 }
 
+/*
+  Attribute names come over from MATLAB as char arrays, and it's the
+  same few hundred of them over and over. name_table maps their mxChar
+  contents to interned strings, so looking one up again costs a hash and
+  a memcmp of the UTF-16 data - no mxArrayToString, no new string, and
+  the interned result makes the attribute dict lookup a pointer compare.
+  Names are looked up by contents only, so nothing here goes stale and
+  FLUSH_CACHES leaves it alone. Once the table is full, new names are
+  just converted without being remembered.
+*/
+#define NAME_TABLE_SIZE 2048	/* power of two */
+#define NAME_TABLE_MAX_FILL (NAME_TABLE_SIZE / 4 * 3)
+#define NAME_MAX_LENGTH 63
+
+typedef struct {
+  PyObject *name;
+  uint32_t hash;
+  uint32_t length;
+  mxChar chars[NAME_MAX_LENGTH];
+} name_entry;
+
+static name_entry *name_table = NULL;
+static size_t name_count = 0;
+
+static uint32_t name_hash(const mxChar *chars, mwSize len) {
+  uint32_t h = 2166136261u;
+  mwSize i;
+  for (i=0; i<len; i++) {
+    h ^= chars[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+  Returns a new reference to the attribute name held in a MATLAB char
+  array, interned and cached (see above). Anything that isn't a char
+  array is unboxed as usual, so wrapped Python strings still work.
+*/
+PyObject *Attr_name(const mxArray *mxname) {
+  if (!mxname || !mxIsChar(mxname)) return unboxn(mxname);
+  mwSize len = mxGetNumberOfElements(mxname);
+  const mxChar *chars = mxGetChars(mxname);
+  if (len > NAME_MAX_LENGTH) return mxChar_to_PyBytes(mxname);
+  if (!name_table) {
+    name_table = PyMem_New(name_entry, NAME_TABLE_SIZE);
+    if (!name_table) return mxChar_to_PyBytes(mxname);
+    memset(name_table, 0, NAME_TABLE_SIZE * sizeof(name_entry));
+  }
+  uint32_t hash = name_hash(chars, len);
+  size_t slot = hash & (NAME_TABLE_SIZE - 1);
+  name_entry *entry;
+  for (;; slot = (slot + 1) & (NAME_TABLE_SIZE - 1)) {
+    entry = &name_table[slot];
+    if (!entry->name) break;
+    if (entry->hash == hash && entry->length == len
+	&& !memcmp(entry->chars, chars, len * sizeof(mxChar))) {
+      Py_INCREF(entry->name);
+      return entry->name;
+    }
+  }
+  PyObject *name = mxChars_to_PyBytes(chars, len);
+  if (!name) return NULL;
+  PyString_InternInPlace(&name);
+  if (name_count < NAME_TABLE_MAX_FILL) {
+    entry->hash = hash;
+    entry->length = len;
+    memcpy(entry->chars, chars, len * sizeof(mxChar));
+    Py_INCREF(name);
+    entry->name = name;
+    name_count++;
+  }
+  return name;
+}
+
+/* A 1 x n char array, or 0 x 0 for nothing, as mxCreateString does. */
+static mxArray *new_char_row(size_t n) {
+  mwSize dims[2] = {n ? 1 : 0, n};
+  return mxCreateCharArray(2, dims);
+}
+
+/* ASCII is widened straight into the new array. Other strings are taken
+   as UTF-8 if they decode, and left to mxCreateString if not. */
 mxArray *PyBytes_to_mxChar(PyObject *pystr) {
   if (!pystr || !PyBytes_Check(pystr))
     mexErrMsgTxt("Input isn't a PyBytes");
-  char *tempstring = PyBytes_AsString( pystr);
-  mxArray *mxchar = mxCreateString(tempstring);
+  Py_ssize_t len = PyBytes_GET_SIZE(pystr);
+  mxArray *mxchar = new_char_row(len);
+  if (Widen_ascii(mxGetChars(mxchar), PyBytes_AS_STRING(pystr), len))
+    return mxchar;
+  mxDestroyArray(mxchar);
+  PyObject *text = PyUnicode_DecodeUTF8(PyBytes_AS_STRING(pystr), len, NULL);
+  if (text) {
+    mxchar = PyUnicode_to_mxChar(text);
+    Py_DECREF(text);
+    if (mxchar) return mxchar;
+  }
+  PyErr_Clear();
+  return mxCreateString(PyBytes_AS_STRING(pystr));
+}
+
+mxArray *PyUnicode_to_mxChar(PyObject *pystr) {
+  PyObject *utf16 = PyUnicode_AsEncodedString(pystr, native_order.first ?
+					      "utf-16-le" : "utf-16-be", NULL);
+  if (!utf16) return NULL;
+  size_t len = PyBytes_GET_SIZE(utf16) / sizeof(mxChar);
+  mxArray *mxchar = new_char_row(len);
+  memcpy(mxGetChars(mxchar), PyBytes_AS_STRING(utf16), len * sizeof(mxChar));
+  Py_DECREF(utf16);
   return mxchar;
 }
 
+/*
+  Many strings at once. A char matrix goes to a list of its rows and a
+  cell array to a list of its contents, strings for the char arrays in
+  it (in storage order, as mxChar_to_PyBytes does) and the usual
+  conversions for anything else. With strip set, trailing spaces and
+  NULs are dropped from each string, as cellstr does. Nothing is asked
+  of MATLAB per element, so this is much quicker than going through
+  mxCell_to_PyTuple.
+*/
+static size_t strip_length(const mxChar *chars, size_t len) {
+  while (len && (chars[len-1] == ' ' || chars[len-1] == 0)) len--;
+  return len;
+}
+
+PyObject *mxArray_to_PyStrings(const mxArray *mxobj, bool strip) {
+  size_t i, numel = mxGetNumberOfElements(mxobj);
+  PyObject *list;
+  if (mxIsChar(mxobj)) {
+    size_t m = mxGetM(mxobj), n = m ? numel / m : 0;
+    mxChar *rows = PyMem_New(mxChar, numel ? numel : 1);
+    if (!rows) return PyErr_NoMemory();
+    Char_rows(rows, mxGetChars(mxobj), m, n);
+    list = PyList_New(m);
+    for (i=0; list && i<m; i++) {
+      const mxChar *row = rows + i * n;
+      PyObject *item = mxChars_to_PyBytes(row, strip ? strip_length(row, n) : n);
+      if (!item) Py_CLEAR(list);
+      else PyList_SET_ITEM(list, i, item);
+    }
+    PyMem_Free(rows);
+    return list;
+  }
+  if (!mxIsCell(mxobj))
+    return PyErr_Format(PyExc_TypeError, "Expected char or cell array, got %s",
+			mxGetClassName(mxobj));
+  if (!(list = PyList_New(numel))) return NULL;
+  for (i=0; i<numel; i++) {
+    const mxArray *cell = mxGetCell(mxobj, i);
+    PyObject *item;
+    if (!cell)
+      item = PyBytes_FromStringAndSize(NULL, 0);
+    else if (mxIsChar(cell)) {
+      const mxChar *chars = mxGetChars(cell);
+      size_t len = mxGetNumberOfElements(cell);
+      item = mxChars_to_PyBytes(chars, strip ? strip_length(chars, len) : len);
+    }
+    else
+      item = Any_mxArray_to_PyObject(cell);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+/* A sequence of str (or unicode) to a 1 x n cellstr. */
+mxArray *PyStrings_to_cellstr(PyObject *seq) {
+  PyObject *fast = PySequence_Fast(seq, "Expected a sequence of strings");
+  if (!fast) return NULL;
+  Py_ssize_t i, n = PySequence_Fast_GET_SIZE(fast);
+  mxArray *cell = mxCreateCellMatrix(1, n);
+  for (i=0; i<n; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+    mxArray *mxchar = NULL;
+    if (PyBytes_Check(item))
+      mxchar = PyBytes_to_mxChar(item);
+    else if (PyUnicode_Check(item))
+      mxchar = PyUnicode_to_mxChar(item);
+    else
+      PyErr_Format(PyExc_TypeError, "Expected a sequence of strings, found %s",
+		   item->ob_type->tp_name);
+    if (!mxchar) {
+      mxDestroyArray(cell);
+      Py_DECREF(fast);
+      return NULL;
+    }
+    mxSetCell(cell, i, mxchar);
+  }
+  Py_DECREF(fast);
+  return cell;
+}
+
+/* A sequence of str (or unicode) to the rows of a char matrix, padded
+   with spaces to the longest. ASCII rows are copied in one blocked pass
+   by Pad_char_rows; the rest are converted on their own and filled in
+   afterwards. */
+mxArray *PyStrings_to_mxChar(PyObject *seq) {
+  PyObject *fast = PySequence_Fast(seq, "Expected a sequence of strings");
+  if (!fast) return NULL;
+  Py_ssize_t i, m = PySequence_Fast_GET_SIZE(fast);
+  const char **rows = PyMem_New(const char *, m ? m : 1);
+  size_t *lens = PyMem_New(size_t, m ? m : 1);
+  mxArray **others = PyMem_New(mxArray *, m ? m : 1);
+  mxArray *retval = NULL;
+  size_t j, n = 0;
+  if (!rows || !lens || !others) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  memset(others, 0, m * sizeof(mxArray *));
+  for (i=0; i<m; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+    rows[i] = "";
+    lens[i] = 0;
+    if (PyBytes_Check(item)) {
+      const char *s = PyBytes_AS_STRING(item);
+      Py_ssize_t k, len = PyBytes_GET_SIZE(item);
+      for (k=0; k<len && !(s[k] & 0x80); k++);
+      if (k == len) {
+	rows[i] = s;
+	lens[i] = len;
+      }
+      else others[i] = PyBytes_to_mxChar(item);
+    }
+    else if (PyUnicode_Check(item)) {
+      if (!(others[i] = PyUnicode_to_mxChar(item))) goto done;
+    }
+    else {
+      PyErr_Format(PyExc_TypeError, "Expected a sequence of strings, found %s",
+		   item->ob_type->tp_name);
+      goto done;
+    }
+    size_t len = others[i] ? mxGetNumberOfElements(others[i]) : lens[i];
+    if (len > n) n = len;
+  }
+  mwSize dims[2] = {0, 0};
+  retval = mxCreateCharArray(2, dims);
+  dims[0] = m;
+  dims[1] = n;
+  mxSetDimensions(retval, dims, 2);
+  if (m && n) {
+    mxChar *chars = mxMalloc(m * n * sizeof(mxChar));
+    Pad_char_rows(chars, rows, lens, m, n);
+    for (i=0; i<m; i++) {
+      if (!others[i]) continue;
+      const mxChar *src = mxGetChars(others[i]);
+      size_t len = mxGetNumberOfElements(others[i]);
+      for (j=0; j<len; j++) chars[j*m + i] = src[j];
+    }
+    mxSetData(retval, chars);
+  }
+ done:
+  for (i=0; others && i<m; i++)
+    if (others[i]) mxDestroyArray(others[i]);
+  PyMem_Free(rows);
+  PyMem_Free(lens);
+  PyMem_Free(others);
+  Py_DECREF(fast);
+  return retval;
+}
+
 mxArray *PyObject_to_mxChar(PyObject *pyobj) {
   if (pyobj) {
     PyObject *pystr = PyObject_Str(pyobj);
@@ -224,179 +788,1849 @@ PyObject *mxCell_to_PyTuple(const mxArray *mxobj) {
   PyObject *pyobj = PyTuple_New(numel);
   mwSize i;
   for (i=0; i<numel; i++) {
-    PyTuple_SetItem(pyobj, i, Any_mxArray_to_PyObject(mxGetCell(mxobj, i)));
+    PyObject *item = Any_mxArray_to_PyObject(mxGetCell(mxobj, i));
+    if (!item) {
+      Py_DECREF(pyobj);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(pyobj, i, item);
   }
   return pyobj;
 }
 
-PyObject *mxCell_to_PyTuple_recursive(const mxArray *mxobj) {
-  mwSize numel = mxGetNumberOfElements(mxobj);
-  PyObject *pyobj = PyTuple_New(numel);
-  mwSize i;
-  for (i=0; i<numel; i++) {
-    mxArray *item = mxGetCell(mxobj, i);
-    PyObject *pyitem;
-    if (mxIsCell(item))
-      pyitem = mxCell_to_PyTuple_recursive(item);
-    else
-      pyitem = Any_mxArray_to_PyObject(item);
-    PyTuple_SetItem(pyobj, i, pyitem);
-  }
+/* mxCell_to_PyTuple for command arguments. See unboxv. */
+PyObject *mxCell_to_PyTuple_views(const mxArray *mxobj) {
+  make_views = Option_borrow_args;
+  PyObject *pyobj = mxCell_to_PyTuple(mxobj);
+  make_views = false;
   return pyobj;
 }
 
-mxArray *PySequence_to_mxCell(PyObject *pyobj) {
-  PyObject *item;
-  Py_ssize_t len = PySequence_Length(pyobj);
-  mxArray *mxcell = mxCreateCellMatrix(1,len);
-  PERSIST_ARRAY(mxcell);
-  mwIndex i;
-  for (i=0; i<len; i++) {
-    item = PySequence_GetItem(pyobj, i);
-    mxSetCell(mxcell, i, Any_PyObject_to_mxArray(item));
-    Py_DECREF(item);
-  }
-  return mxcell;
+/* Gets the value of a kw object's property as a new reference. The
+   property copy MATLAB hands back becomes Python's to keep. Keywords
+   go through the name table, like attribute names. */
+static PyObject *kw_property(const mxArray *kwobj, mwIndex i, const char *name) {
+  mxArray *prop = mxGetProperty(kwobj, i, name);
+  PyObject *pyobj;
+  if (!prop)
+    return PyErr_Format(PyExc_ValueError, "kw object has no %s", name);
+  if (mxIsChar(prop) && !strcmp(name, "keyword"))
+    pyobj = Attr_name(prop);
+  else if (mxIsPyObject(prop) || mxIsChar(prop))
+    pyobj = unboxn(prop);
+  else
+    return Py_mxArray_New(prop, false);
+  mxDestroyArray(prop);
+  return pyobj;
 }
 
-PyObject *Any_mxArray_to_PyObject(const mxArray *mxobj) {
-  if (mxIsPyObject(mxobj)) {
-    PyObject *pyobj = unbox(mxobj);
-    Py_XINCREF(pyobj);
-    return pyobj;
-  }
-  else if (mxIsChar(mxobj)) {
-    return mxChar_to_PyBytes(mxobj);
+/* Adds the keyword/value pairs of a kw object array to kwargs. */
+static bool kw_add(PyObject *kwargs, const mxArray *kwobj) {
+  mwSize i;
+  for (i=0; i<mxGetNumberOfElements(kwobj); i++) {
+    PyObject *key = kw_property(kwobj, i, "keyword");
+    PyObject *value = key ? kw_property(kwobj, i, "value") : NULL;
+    int status = value ? PyDict_SetItem(kwargs, key, value) : -1;
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    if (status < 0) return false;
   }
-  else {
-    return Py_mxArray_New((mxArray *) mxobj,1);
+  return true;
+}
+
+/* Whether Kwargs_from_mxArray will take this: a kw object array, or a
+   cell of name/value pairs with char names. Checked up front so that
+   callers can still mexErrMsg before any arguments are borrowed. */
+bool Is_kwargs_spec(const mxArray *spec) {
+  if (mxIsKw(spec)) return true;
+  if (!mxIsCell(spec) || mxGetNumberOfElements(spec) % 2) return false;
+  mwSize i;
+  for (i=0; i<mxGetNumberOfElements(spec); i+=2) {
+    const mxArray *key = mxGetCell(spec, i);
+    if (!key || !mxIsChar(key)) return false;
   }
+  return true;
 }
 
-mxArray *Any_PyObject_to_mxArray(PyObject *pyobj) {
-  if (!pyobj)
-    return box(pyobj); /* Null pointer */
-  if (Py_mxArray_Check(pyobj))
-    return mxArrayPtr(pyobj);
-  else {
-    PyObject *utils = PyImport_ImportModule("pymexutil");
-    PyObject *arg;
-    if (PyTuple_Check(pyobj)) arg = PyTuple_Pack(1, pyobj);
-    else {
-      arg = pyobj;
-      Py_INCREF(pyobj);
-    }
-    PyObject *unpyed = PyObject_CallMethod(utils, "unpy", "O", arg);
-    Py_DECREF(arg);
-    if (PyErr_Occurred()) {
-      if (PyErr_ExceptionMatches(PyExc_NotImplementedError))
-	return boxb(pyobj);
-      else return NULL;
-    }
-    if (Py_mxArray_Check(unpyed)) {
-      mxArray *retval = mxDuplicateArray(mxArrayPtr(unpyed));
-      PERSIST_ARRAY(retval);
-      Py_DECREF(unpyed);
-      return retval;
+/* Builds a dict of keyword arguments from a kw object array or a
+   name/value cell (see Is_kwargs_spec). Values are unboxed as by
+   unboxv. Returns a new reference. */
+PyObject *Kwargs_from_mxArray(const mxArray *spec) {
+  PyObject *kwargs = PyDict_New();
+  mwSize i;
+  if (!kwargs) return NULL;
+  if (mxIsKw(spec)) {
+    if (kw_add(kwargs, spec)) return kwargs;
+    Py_DECREF(kwargs);
+    return NULL;
+  }
+  for (i=0; i+1<mxGetNumberOfElements(spec); i+=2) {
+    const mxArray *item = mxGetCell(spec, i+1);
+    PyObject *key = Attr_name(mxGetCell(spec, i));
+    PyObject *value = !key ? NULL
+      : item ? unboxv(item) : Py_mxArray_New(mxCreateDoubleMatrix(0,0,mxREAL), false);
+    int status = value ? PyDict_SetItem(kwargs, key, value) : -1;
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    if (status < 0) {
+      Py_DECREF(kwargs);
+      return NULL;
     }
-    else return boxb(pyobj);
   }
+  return kwargs;
 }
 
-/* TODO: Low priority, but this depends on libmex. If we try to make an
-   external module later, this will need to function to some extent.
-   It could operate at low capability by using a hardcoded list for
-   the builtins and assuming that anything else has _object as a super.
- */
-PyObject *Calculate_matlab_mro(mxArray *mxobj) {
-  mxArray *argin[3];
-  argin[0] = mxobj;
-  argin[1] = mxCreateLogicalScalar(1); /* addvirtual=true */
-  argin[2] = mxCreateLogicalScalar(1); /* autosplit=true */
-  mxArray *argout[1] = {NULL};
-  mxArray *err = mexCallMATLABWithTrap(1, argout, 3, argin, "mro");
-  if (err) return PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
-  else {
-    PyObject *retval = mxCell_to_PyTuple_recursive(argout[0]);
-    mxDestroyArray(argout[0]);
-    mxDestroyArray(argin[1]);
-    mxDestroyArray(argin[2]);
-    return retval;
+/*
+  Splits a cell of call arguments into a positional tuple and a dict of
+  keyword arguments (NULL if there weren't any). Elements of class kw,
+  or a subclass of it, contribute their keyword/value pairs; everything else is passed
+  positionally, as by mxCell_to_PyTuple_views.
+*/
+bool Split_call_args(const mxArray *cell, PyObject **args, PyObject **kwargs) {
+  mwSize numel = mxGetNumberOfElements(cell);
+  mwSize i, npos = 0;
+  *args = NULL;
+  *kwargs = NULL;
+  for (i=0; i<numel; i++) {
+    const mxArray *item = mxGetCell(cell, i);
+    if (!item || !mxIsKw(item)) npos++;
+  }
+  if (npos == numel) {
+    *args = mxCell_to_PyTuple_views(cell);
+    return *args != NULL;
+  }
+  if (!(*args = PyTuple_New(npos))) return false;
+  if (!(*kwargs = PyDict_New())) goto fail;
+  npos = 0;
+  for (i=0; i<numel; i++) {
+    const mxArray *item = mxGetCell(cell, i);
+    if (item && mxIsKw(item)) {
+      if (!kw_add(*kwargs, item)) goto fail;
+    }
+    else {
+      PyObject *pyitem = item ? unboxv(item) : Py_mxArray_New(mxCreateDoubleMatrix(0,0,mxREAL), false);
+      if (!pyitem) goto fail;
+      PyTuple_SET_ITEM(*args, npos++, pyitem);
+    }
   }
+  return true;
+ fail:
+  Py_CLEAR(*args);
+  Py_CLEAR(*kwargs);
+  return false;
 }
 
-/* Attempts to locate an appropriate subclass of mx.Array 
-   using the mltypes package. If for some reason this fails, 
-   mx.Array is returned instead.
- */
-PyObject *Find_mltype_for(mxArray *mxobj) {
-  #define GET_MX_ARRAY_CLASS PyObject_GetAttrString(mxmodule, "Array")
-  PyObject *newclass, *mrolist, *util, *findtype;
-  newclass = mrolist = util = findtype = NULL;
-  mrolist = Calculate_matlab_mro(mxobj);
-  if (!mrolist) {
-    mexPrintf("failed to get mro list\n");
-    PyErr_Clear();
-    newclass = GET_MX_ARRAY_CLASS;
-    goto findtypes_error;
-  }
-  util = PyImport_ImportModule("pymexutil");
-  if (!util) {
-    mexPrintf("failed to import pymexutil\n");
-    PyErr_Clear();
-    newclass = GET_MX_ARRAY_CLASS;
-    goto findtypes_error;
+/* Reads one element of a subsref/subsasgn struct array. */
+static bool subs_element(const mxArray *S, mwIndex i, char *type, const mxArray **subs) {
+  const mxArray *mxtype = mxGetField(S, i, "type");
+  *subs = mxGetField(S, i, "subs");
+  if (!mxtype || !mxIsChar(mxtype) || !*subs) {
+    PyErr_Format(PyExc_ValueError, "Malformed substruct at element %d", (int) i+1);
+    return false;
   }
-  findtype = PyObject_GetAttrString(util, "findtype");
-  if (!findtype) {
-    mexPrintf("failed to find pymexutil.findtype\n");
-    PyErr_Clear();
-    newclass = GET_MX_ARRAY_CLASS;
-    goto findtypes_error;
+  mwSize len = mxGetNumberOfElements(mxtype);
+  const mxChar *chars = mxGetChars(mxtype);
+  *type = len == 1 && chars[0] == '.' ? '.'
+    : len == 2 && chars[0] == '(' && chars[1] == ')' ? '('
+    : len == 2 && chars[0] == '{' && chars[1] == '}' ? '{'
+    : 0;
+  if (!*type) {
+    PyErr_Format(PyExc_ValueError, "Unknown subscript type at element %d", (int) i+1);
+    return false;
   }
-  /* I'm not sure why we need *another* tuple around this, but apparently
-     CallFunction kills the outermost tuple here */
-  mrolist = PyTuple_Pack(1, mrolist);
-  newclass = PyObject_CallFunction(findtype, "O", mrolist);
-  if (!newclass) {
-    mexPrintf("failed to call _findtype\n");
-    PyErr_Clear();
-    newclass = GET_MX_ARRAY_CLASS;
-    goto findtypes_error;
+  if ((*type == '.' && !mxIsChar(*subs)) || (*type != '.' && !mxIsCell(*subs))) {
+    PyErr_Format(PyExc_ValueError, "Bad subs at element %d", (int) i+1);
+    return false;
   }
-  findtypes_error:
-  Py_XDECREF(findtype);
-  Py_XDECREF(mrolist);
-  Py_XDECREF(util);
-  return newclass;
+  return true;
 }
 
+/* The key for a {} subscript: the single subscript, a tuple of several,
+   or () for none. A lone ':' becomes slice(None). */
+static PyObject *subs_key(const mxArray *subs) {
+  mwSize n = mxGetNumberOfElements(subs);
+  PyObject *key = n == 1 ? NULL : PyTuple_New(n);
+  mwSize i;
+  if (n != 1 && !key) return NULL;
+  for (i=0; i<n; i++) {
+    const mxArray *item = mxGetCell(subs, i);
+    PyObject *pyitem;
+    if (item && mxIsChar(item) && mxGetNumberOfElements(item) == 1 && mxGetChars(item)[0] == ':')
+      pyitem = PySlice_New(NULL, NULL, NULL);
+    else if (item)
+      pyitem = unboxv(item);
+    else
+      pyitem = Py_mxArray_New(mxCreateDoubleMatrix(0,0,mxREAL), false);
+    if (!pyitem || n == 1) {
+      Py_XDECREF(key);
+      return pyitem;
+    }
+    PyTuple_SET_ITEM(key, i, pyitem);
+  }
+  return key;
+}
 
-PyObject *Py_mxArray_New(mxArray *mxobj, bool duplicate) {
-  mxArray *copy;
-  if (duplicate) {
-    copy = mxDuplicateArray(mxobj);
-    mexMakeArrayPersistent(copy);
+/*
+  Follows elements [0, count) of a MATLAB subsref struct array from
+  pyobj: '.' is getattr, '()' a call and '{}' getitem. Returns a new
+  reference to whatever is at the end of the chain, without boxing any
+  of the intermediate objects.
+*/
+PyObject *Subsref_chain(PyObject *pyobj, const mxArray *S, mwSize count) {
+  mwIndex i;
+  Py_INCREF(pyobj);
+  for (i=0; i<count && pyobj; i++) {
+    char type;
+    const mxArray *subs;
+    PyObject *next = NULL;
+    if (!subs_element(S, i, &type, &subs)) {
+      Py_DECREF(pyobj);
+      return NULL;
+    }
+    if (type == '.') {
+      PyObject *name = Attr_name(subs);
+      if (name) {
+	next = PyObject_GetAttr(pyobj, name);
+	Py_DECREF(name);
+      }
+    }
+    else if (type == '(') {
+      PyObject *args, *kwargs;
+      if (Split_call_args(subs, &args, &kwargs)) {
+	next = PyObject_Call(pyobj, args, kwargs);
+	Py_DECREF(args);
+	Py_XDECREF(kwargs);
+      }
+    }
+    else {
+      PyObject *key = subs_key(subs);
+      if (key) {
+	next = PyObject_GetItem(pyobj, key);
+	Py_DECREF(key);
+      }
+    }
+    Py_DECREF(pyobj);
+    pyobj = next;
+  }
+  return pyobj;
+}
+
+/*
+  Spreads the result of a call over nout outputs, stealing the
+  reference: with nout <= 1 the result itself is the one output,
+  otherwise it is unpacked as a sequence (tuples and lists directly,
+  anything else by iterating) and extra items are ignored. Each output
+  is boxed, or converted as by TO_MXARRAY if convert is set. Returns the
+  number of outputs filled, which is less than nout if the result ran
+  out early, or -1 on error with nothing left in outs.
+*/
+int Unpack_outputs(PyObject *result, int nout, mxArray *outs[], bool convert) {
+  int i, n = 0;
+  if (nout <= 1) {
+    outs[0] = convert ? Any_PyObject_to_mxArray(result) : boxb(result);
+    Py_DECREF(result);
+    return outs[0] ? 1 : -1;
+  }
+  if (PyTuple_Check(result) || PyList_Check(result)) {
+    Py_ssize_t len = PySequence_Fast_GET_SIZE(result);
+    for (n=0; n<nout && n<len; n++) {
+      PyObject *item = PySequence_Fast_GET_ITEM(result, n);
+      if (!(outs[n] = convert ? Any_PyObject_to_mxArray(item) : boxb(item))) break;
+    }
   }
   else {
-    copy = mxobj;
+    PyObject *iter = PyObject_GetIter(result);
+    PyObject *item = NULL;
+    if (iter) {
+      for (n=0; n<nout && (item = PyIter_Next(iter)); n++) {
+	outs[n] = convert ? Any_PyObject_to_mxArray(item) : boxb(item);
+	Py_DECREF(item);
+	if (!outs[n]) break;
+      }
+      Py_DECREF(iter);
+    }
   }
-  PyObject *mxptr = mxArrayPtr_New(copy);
+  Py_DECREF(result);
+  if (PyErr_Occurred()) {
+    for (i=0; i<n; i++) mxDestroyArray(outs[i]);
+    return -1;
+  }
+  return n;
+}
+
+/* Packs the result of a subsref into a cell of nout boxed outputs,
+   stealing the reference. With nout == 0 a None result gives an empty
+   cell (nothing to show), anything else a single output. With nout > 1
+   the cell ends early if the result runs out. */
+mxArray *Box_outputs(PyObject *result, int nout) {
+  if (nout == 0 && result == Py_None) {
+    Py_DECREF(result);
+    return mxCreateCellMatrix(1, 0);
+  }
+  mxArray *outs[nout > 1 ? nout : 1];
+  int i, n = Unpack_outputs(result, nout, outs, false);
+  if (n < 0) return NULL;
+  mxArray *cell = mxCreateCellMatrix(1, n);
+  for (i=0; i<n; i++) mxSetCell(cell, i, outs[i]);
+  return cell;
+}
+
+/* Assigns value at the end of the subsasgn chain S. The last element
+   must be '.' (setattr) or '{}' (setitem). */
+bool Subsasgn_chain(PyObject *pyobj, const mxArray *S, PyObject *value) {
+  mwSize n = mxGetNumberOfElements(S);
+  char type;
+  const mxArray *subs;
+  int status = -1;
+  if (!n) {
+    PyErr_Format(PyExc_ValueError, "Empty substruct");
+    return false;
+  }
+  if (!subs_element(S, n-1, &type, &subs)) return false;
+  if (type == '(') {
+    PyErr_Format(PyExc_TypeError, "Invalid lvalue. Can't assign to expression ending in ().");
+    return false;
+  }
+  PyObject *target = Subsref_chain(pyobj, S, n-1);
+  if (!target) return false;
+  if (type == '.') {
+    PyObject *name = Attr_name(subs);
+    if (name) {
+      status = PyObject_SetAttr(target, name, value);
+      Py_DECREF(name);
+    }
+  }
+  else {
+    PyObject *key = subs_key(subs);
+    if (key) {
+      status = PyObject_SetItem(target, key, value);
+      Py_DECREF(key);
+    }
+  }
+  Py_DECREF(target);
+  return status == 0;
+}
+
+/*
+  Lists and tuples of plain numbers - nested to any depth, as long as
+  they're rectangular - can be one dense array instead of a cell of
+  scalars. They're shaped the way numpy.array would shape them, fattened
+  out to 2d. The class follows the scalar conversions: all bools give a
+  logical array, ints int32 unless one of them needs int64 (as a long
+  always does), and anything with a float in it double.
+*/
+#define DENSE_MAX_DIMS 32
+enum { DENSE_BOOL, DENSE_INT32, DENSE_INT64, DENSE_FLOAT, DENSE_MIXED };
+
+/* Checks that seq has the given shape from depth on, and works out the
+   kind of numbers it holds. */
+static int dense_scan(PyObject *seq, int depth, int ndim, const Py_ssize_t *shape, int kind) {
+  Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+  PyObject **items = PySequence_Fast_ITEMS(seq);
+  if (n != shape[depth]) return DENSE_MIXED;
+  for (i=0; i<n && kind != DENSE_MIXED; i++) {
+    PyObject *item = items[i];
+    if (depth+1 < ndim)
+      kind = PyList_Check(item) || PyTuple_Check(item) ?
+	dense_scan(item, depth+1, ndim, shape, kind) : DENSE_MIXED;
+    else if (PyBool_Check(item))
+      continue;
+    else if (PyInt_Check(item) && PyInt_AS_LONG(item) <= INT32_MAX && PyInt_AS_LONG(item) >= INT32_MIN)
+      kind = kind < DENSE_INT32 ? DENSE_INT32 : kind;
+    else if (PyInt_Check(item) || (PyLong_Check(item) && _PyLong_NumBits(item) < 64))
+      kind = kind < DENSE_INT64 ? DENSE_INT64 : kind;
+    else if (PyFloat_Check(item) || PyLong_Check(item))
+      kind = DENSE_FLOAT;
+    else
+      kind = DENSE_MIXED;
+  }
+  return kind;
+}
+
+static void dense_fill(PyObject *seq, int depth, int ndim, const size_t *strides,
+		       mxClassID mxclass, void *data, size_t offset) {
+  Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+  PyObject **items = PySequence_Fast_ITEMS(seq);
+  for (i=0; i<n; i++, offset += strides[depth]) {
+    PyObject *item = items[i];
+    if (depth+1 < ndim)
+      dense_fill(item, depth+1, ndim, strides, mxclass, data, offset);
+    else if (mxclass == mxLOGICAL_CLASS)
+      ((mxLogical *) data)[offset] = item == Py_True;
+    else if (mxclass == mxINT32_CLASS)
+      ((int32_t *) data)[offset] = (int32_t) PyInt_AS_LONG(item);
+    else if (mxclass == mxINT64_CLASS)
+      ((int64_t *) data)[offset] = PyInt_Check(item) ? PyInt_AS_LONG(item) : PyLong_AsLongLong(item);
+    else if (PyFloat_Check(item))
+      ((double *) data)[offset] = PyFloat_AS_DOUBLE(item);
+    else
+      ((double *) data)[offset] = PyInt_Check(item) ? PyInt_AS_LONG(item) : PyLong_AsDouble(item);
+  }
+}
+
+/* Converts a list or tuple as described above, or with its outermost
+   dimension last instead of first if stacked is set. Returns NULL with
+   no error set if it holds anything else, is ragged, or is empty. */
+static mxArray *dense_array(PyObject *seq, bool stacked) {
+  Py_ssize_t shape[DENSE_MAX_DIMS];
+  size_t strides[DENSE_MAX_DIMS];
+  mwSize dims[DENSE_MAX_DIMS];
+  size_t numel = 1;
+  int k, ndim = 0;
+  PyObject *sub = seq;
+  while (ndim < DENSE_MAX_DIMS && (PyList_Check(sub) || PyTuple_Check(sub))) {
+    shape[ndim] = PySequence_Fast_GET_SIZE(sub);
+    if (!shape[ndim]) return NULL;
+    sub = PySequence_Fast_GET_ITEM(sub, 0);
+    ndim++;
+  }
+  int kind = dense_scan(seq, 0, ndim, shape, DENSE_BOOL);
+  if (kind == DENSE_MIXED) return NULL;
+  mxClassID mxclass = kind == DENSE_BOOL ? mxLOGICAL_CLASS
+    : kind == DENSE_INT32 ? mxINT32_CLASS
+    : kind == DENSE_INT64 ? mxINT64_CLASS : mxDOUBLE_CLASS;
+  /* dims[k] is the size of the k'th dimension of seq's nesting, rotated
+     by one when stacked; strides follow in the same order. */
+  int first = stacked && ndim > 1 ? 1 : 0;
+  for (k=0; k<ndim; k++) {
+    int d = (first + k) % ndim;
+    strides[d] = numel;
+    dims[k] = shape[d];
+    numel *= shape[d];
+  }
+  if (ndim == 1) {
+    dims[1] = dims[0];
+    dims[0] = 1;
+  }
+  mxArray *retval = mxclass == mxLOGICAL_CLASS ?
+    mxCreateLogicalArray(ndim < 2 ? 2 : ndim, dims) :
+    mxCreateNumericArray(ndim < 2 ? 2 : ndim, dims, mxclass, mxREAL);
+  PERSIST_ARRAY(retval);
+  dense_fill(seq, 0, ndim, strides, mxclass, mxGetData(retval), 0);
+  if (PyErr_Occurred()) {
+    mxDestroyArray(retval);
+    return NULL;
+  }
+  return retval;
+}
+
+mxArray *Sequence_to_dense(PyObject *seq) {
+  return dense_array(seq, false);
+}
+
+/* Lists and tuples: dense if possible (and the dense_sequences option
+   is on), otherwise a cell or struct array by PyTree_to_mxArray. */
+mxArray *PySequence_to_mxArray(PyObject *pyobj) {
+  if (Option_dense_sequences) {
+    mxArray *dense = Sequence_to_dense(pyobj);
+    if (dense || PyErr_Occurred()) return dense;
+  }
+  return PyTree_to_mxArray(pyobj);
+}
+
+mxArray *PySequence_to_mxCell(PyObject *pyobj) {
+  PyObject *item;
+  Py_ssize_t len = PySequence_Length(pyobj);
+  mxArray *mxcell = mxCreateCellMatrix(1,len);
+  PERSIST_ARRAY(mxcell);
+  mwIndex i;
+  for (i=0; i<len; i++) {
+    item = PySequence_GetItem(pyobj, i);
+    mxArray *mxitem = item ? Any_PyObject_to_mxArray(item) : NULL;
+    Py_XDECREF(item);
+    if (!mxitem) {
+      mxDestroyArray(mxcell);
+      return NULL;
+    }
+    mxSetCell(mxcell, i, mxitem);
+  }
+  return mxcell;
+}
+
+/*
+  Nested dicts, lists and tuples - settings, decoded JSON - convert in
+  one walk with an explicit stack, so deep trees don't recurse and
+  nothing goes back through pymexutil. A dict whose keys are all valid
+  field names (str, or unicode that's ASCII) becomes a 1x1 struct, and
+  a list or tuple of dicts with one key set a 1xn struct array. Other
+  lists and tuples become cells, unless Sequence_to_dense takes them. Anything else is a leaf for
+  Any_PyObject_to_mxArray, and dicts with other keys are boxed. A
+  container that holds itself raises ValueError; one that's merely
+  shared is converted each time it turns up.
+
+  Records mostly share their keys, so the field list for each key set
+  (the keys in order, and the names mxCreateStructMatrix wants) is
+  worked out once per walk and found again by a hash of the key set.
+*/
+#define TREE_FIELD_BUCKETS 64	/* power of two */
+
+typedef struct tree_fields {
+  struct tree_fields *next;
+  long hash;			/* xor of the key hashes, so order doesn't matter */
+  int count;
+  PyObject **keys;
+  PyObject **ascii;		/* the keys as str, for unicode ones */
+  const char **names;
+} tree_fields;
+
+typedef struct {
+  PyObject *obj;		/* the container, for cycle checks */
+  PyObject *seq;		/* tuple of its items; NULL for a dict */
+  tree_fields *fields;		/* NULL for a cell */
+  mxArray *out;
+  mwSize slots, next;
+} tree_frame;
+
+typedef struct {
+  tree_frame *stack;
+  int depth, size;
+  tree_fields *buckets[TREE_FIELD_BUCKETS];
+} tree_walk;
+
+static bool valid_field_name(PyObject *key) {
+  Py_ssize_t i, len = PyString_GET_SIZE(key);
+  const char *s = PyString_AS_STRING(key);
+  if (len < 1 || len > NAME_MAX_LENGTH) return false;
+  if (!((s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z'))) return false;
+  for (i=1; i<len; i++)
+    if (!((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') ||
+	  (s[i] >= '0' && s[i] <= '9') || s[i] == '_'))
+      return false;
+  return true;
+}
+
+static void tree_fields_free(tree_fields *fields, int count) {
+  int k;
+  for (k=0; k<count; k++) {
+    Py_DECREF(fields->keys[k]);
+    Py_DECREF(fields->ascii[k]);
+  }
+  PyMem_Free(fields);
+}
+
+/* The field list for the dict's key set, or NULL (with no error set) if
+   the keys can't be field names. Unicode keys can be, if they're ASCII. */
+static tree_fields *tree_fields_for(tree_walk *walk, PyObject *dict) {
+  Py_ssize_t pos = 0;
+  PyObject *key, *value;
+  long hash = 0;
+  int i, count = (int) PyDict_Size(dict);
+  while (PyDict_Next(dict, &pos, &key, &value)) {
+    if (!PyString_CheckExact(key) && !PyUnicode_CheckExact(key)) return NULL;
+    hash ^= PyObject_Hash(key);
+  }
+  tree_fields *fields = walk->buckets[hash & (TREE_FIELD_BUCKETS - 1)];
+  for (; fields; fields = fields->next) {
+    if (fields->hash != hash || fields->count != count) continue;
+    for (i=0; i<count && PyDict_GetItem(dict, fields->keys[i]); i++);
+    if (i == count) return fields;
+  }
+  fields = PyMem_Malloc(sizeof(tree_fields) + count * (2 * sizeof(PyObject *) + sizeof(char *)));
+  if (!fields) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  fields->hash = hash;
+  fields->count = count;
+  fields->keys = (PyObject **) (fields + 1);
+  fields->ascii = fields->keys + count;
+  fields->names = (const char **) (fields->ascii + count);
+  for (pos = 0, i = 0; PyDict_Next(dict, &pos, &key, &value); i++) {
+    PyObject *ascii = key;
+    if (PyUnicode_Check(key)) {
+      if (!(ascii = PyUnicode_AsASCIIString(key))) {
+	PyErr_Clear();
+	break;
+      }
+    }
+    else
+      Py_INCREF(ascii);
+    if (!valid_field_name(ascii)) {
+      Py_DECREF(ascii);
+      break;
+    }
+    Py_INCREF(key);
+    fields->keys[i] = key;
+    fields->ascii[i] = ascii;
+    fields->names[i] = PyString_AS_STRING(ascii);
+  }
+  if (i < count) {
+    tree_fields_free(fields, i);
+    return NULL;
+  }
+  fields->next = walk->buckets[hash & (TREE_FIELD_BUCKETS - 1)];
+  walk->buckets[hash & (TREE_FIELD_BUCKETS - 1)] = fields;
+  return fields;
+}
+
+/* Starts on a dict, list or tuple. Returns 1 if it pushed a frame, 0 if
+   the container came out as a single value instead, -1 on error. */
+static int tree_push(tree_walk *walk, PyObject *obj, mxArray **value) {
+  int i;
+  for (i=0; i<walk->depth; i++)
+    if (walk->stack[i].obj == obj) {
+      PyErr_Format(PyExc_ValueError, "Can't convert a %s that contains itself",
+		   obj->ob_type->tp_name);
+      return -1;
+    }
+  tree_frame frame = {NULL, NULL, NULL, NULL, 0, 0};
+  if (PyDict_Check(obj)) {
+    frame.fields = tree_fields_for(walk, obj);
+    if (!frame.fields) {
+      *value = PyErr_Occurred() ? NULL : boxb(obj);
+      return *value ? 0 : -1;
+    }
+    frame.slots = frame.fields->count;
+    frame.out = mxCreateStructMatrix(1, 1, frame.fields->count, frame.fields->names);
+    PERSIST_ARRAY(frame.out);
+  }
+  else {
+    if (!(frame.seq = PySequence_Tuple(obj))) return -1;
+    Py_ssize_t k, n = PyTuple_GET_SIZE(frame.seq);
+    for (k=0; k<n && Option_dict_structs; k++) {
+      PyObject *item = PyTuple_GET_ITEM(frame.seq, k);
+      tree_fields *fields = PyDict_CheckExact(item) ? tree_fields_for(walk, item) : NULL;
+      if (!fields || (k && fields != frame.fields)) break;
+      frame.fields = fields;
+    }
+    if (PyErr_Occurred()) {
+      Py_DECREF(frame.seq);
+      return -1;
+    }
+    if (n && k == n) {
+      frame.slots = n * frame.fields->count;
+      frame.out = mxCreateStructMatrix(1, n, frame.fields->count, frame.fields->names);
+    }
+    else {
+      frame.fields = NULL;
+      frame.slots = n;
+      frame.out = mxCreateCellMatrix(1, n);
+    }
+    PERSIST_ARRAY(frame.out);
+  }
+  if (walk->depth == walk->size) {
+    int size = walk->size ? 2 * walk->size : 16;
+    tree_frame *stack = PyMem_Resize(walk->stack, tree_frame, size);
+    if (!stack) {
+      mxDestroyArray(frame.out);
+      Py_XDECREF(frame.seq);
+      PyErr_NoMemory();
+      return -1;
+    }
+    walk->stack = stack;
+    walk->size = size;
+  }
+  Py_INCREF(obj);
+  frame.obj = obj;
+  walk->stack[walk->depth++] = frame;
+  return 1;
+}
+
+/* The item for the frame's next slot, as a new reference. */
+static PyObject *tree_item(tree_frame *frame) {
+  PyObject *item;
+  if (!frame->fields)
+    item = PyTuple_GET_ITEM(frame->seq, frame->next);
+  else {
+    int count = frame->fields->count;
+    PyObject *dict = frame->seq ? PyTuple_GET_ITEM(frame->seq, frame->next / count) : frame->obj;
+    item = PyDict_GetItem(dict, frame->fields->keys[frame->next % count]);
+    if (!item)
+      return PyErr_Format(PyExc_RuntimeError, "dict changed during conversion");
+  }
+  Py_INCREF(item);
+  return item;
+}
+
+static void tree_store(tree_frame *frame, mxArray *value) {
+  if (!frame->fields)
+    mxSetCell(frame->out, frame->next, value);
+  else {
+    int count = frame->fields->count;
+    mxSetFieldByNumber(frame->out, frame->next / count, frame->next % count, value);
+  }
+  frame->next++;
+}
+
+/* Converts a dict, list or tuple and everything in it, as above. */
+mxArray *PyTree_to_mxArray(PyObject *root) {
+  tree_walk walk;
+  memset(&walk, 0, sizeof(walk));
+  mxArray *value = NULL;
+  int i, status = tree_push(&walk, root, &value);
+  while (status > 0 && walk.depth) {
+    tree_frame *top = &walk.stack[walk.depth-1];
+    if (top->next == top->slots) {
+      value = top->out;
+      Py_DECREF(top->obj);
+      Py_XDECREF(top->seq);
+      if (--walk.depth) tree_store(&walk.stack[walk.depth-1], value);
+      continue;
+    }
+    PyObject *item = tree_item(top);
+    if (!item) {
+      status = -1;
+      break;
+    }
+    mxArray *leaf = NULL;
+    if (PyList_CheckExact(item) || PyTuple_CheckExact(item)) {
+      if (Option_dense_sequences) leaf = Sequence_to_dense(item);
+      status = leaf ? 0 : PyErr_Occurred() ? -1 : tree_push(&walk, item, &leaf);
+    }
+    else if (PyDict_CheckExact(item) && Option_dict_structs)
+      status = tree_push(&walk, item, &leaf);
+    else {
+      leaf = Any_PyObject_to_mxArray(item);
+      status = leaf ? 0 : -1;
+    }
+    Py_DECREF(item);
+    /* tree_push may have moved the stack. */
+    if (status == 0) tree_store(&walk.stack[walk.depth-1], leaf);
+    if (status >= 0) status = 1;
+  }
+  if (status < 0) {
+    value = NULL;
+    for (i=0; i<walk.depth; i++) {
+      mxDestroyArray(walk.stack[i].out);
+      Py_DECREF(walk.stack[i].obj);
+      Py_XDECREF(walk.stack[i].seq);
+    }
+  }
+  PyMem_Free(walk.stack);
+  for (i=0; i<TREE_FIELD_BUCKETS; i++) {
+    tree_fields *fields = walk.buckets[i];
+    while (fields) {
+      tree_fields *next = fields->next;
+      tree_fields_free(fields, fields->count);
+      fields = next;
+    }
+  }
+  return value;
+}
+
+/* Exact dicts, unless the dict_structs option is off. */
+static mxArray *PyDict_to_mxArray(PyObject *pyobj) {
+  return Option_dict_structs ? PyTree_to_mxArray(pyobj) : boxb(pyobj);
+}
+
+PyObject *Any_mxArray_to_PyObject(const mxArray *mxobj) {
+  /* mxIsChar first: it's cheap, and mxIsPyObject asks MATLAB. */
+  if (mxIsChar(mxobj)) {
+    return mxChar_to_PyBytes(mxobj);
+  }
+  else if (mxIsPyObject(mxobj)) {
+    PyObject *pyobj = unbox(mxobj);
+    Py_XINCREF(pyobj);
+    return pyobj;
+  }
+  else if (make_views) {
+    return Py_mxArray_View(mxobj);
+  }
+  else {
+    return Py_mxArray_New((mxArray *) mxobj,1);
+  }
+}
+
+#if PY_MAJOR_VERSION < 3
+/* int32, unless the value needs the rest of a 64 bit long. */
+static mxArray *PyInt_to_mxInt32(PyObject *pyobj) {
+  long val = PyInt_AS_LONG(pyobj);
+  if (val > INT32_MAX || val < INT32_MIN) {
+    mxArray *mxval = mxCreateNumericMatrix(1, 1, mxINT64_CLASS, mxREAL);
+    *(int64_t *) mxGetData(mxval) = val;
+    return mxval;
+  }
+  mxArray *mxval = mxCreateNumericMatrix(1, 1, mxINT32_CLASS, mxREAL);
+  *(int32_t *) mxGetData(mxval) = (int32_t) val;
+  return mxval;
+}
+#endif
+
+/* NumPy's types, found the first time we're asked to convert something
+   after NumPy has been imported. We never import it ourselves: if it
+   isn't loaded, nothing we're given can be an ndarray. */
+static PyObject *numpy_ndarray = NULL;
+static PyObject *numpy_generic = NULL;
+
+static bool find_numpy_types(void) {
+  if (numpy_ndarray) return true;
+  PyObject *numpy = PyDict_GetItemString(PyImport_GetModuleDict(), "numpy");
+  if (!numpy) return false;
+  numpy_ndarray = PyObject_GetAttrString(numpy, "ndarray");
+  numpy_generic = PyObject_GetAttrString(numpy, "generic");
+  if (!numpy_ndarray || !numpy_generic) {
+    PyErr_Clear();
+    Py_CLEAR(numpy_ndarray);
+    Py_CLEAR(numpy_generic);
+    return false;
+  }
+  return true;
+}
+
+/* The pymexutil module, imported once. Borrowed reference. */
+static PyObject *pymexutil(void) {
+  static PyObject *utils = NULL;
+  if (!utils) utils = PyImport_ImportModule("pymexutil");
+  return utils;
+}
+
+/* Maps a buffer's struct-style format to the MATLAB class that holds
+   the same bits. Only single native-order items of the plain C types
+   are understood; anything else gets mxUNKNOWN_CLASS. */
+static mxClassID Buffer_format_to_mxClassID(const char *format, Py_ssize_t itemsize) {
+  static const union { uint16_t word; char first; } byteorder = {1};
+  static const mxClassID sized[2][4] = {
+    {mxINT8_CLASS, mxINT16_CLASS, mxINT32_CLASS, mxINT64_CLASS},
+    {mxUINT8_CLASS, mxUINT16_CLASS, mxUINT32_CLASS, mxUINT64_CLASS}};
+  int width;
+  if (!format) format = "B";
+  if (*format == '@' || *format == '=' || (*format == '<' && byteorder.first))
+    format++;
+  if (!format[0] || format[1]) return mxUNKNOWN_CLASS;
+  switch (itemsize) {
+  case 1: width = 0; break;
+  case 2: width = 1; break;
+  case 4: width = 2; break;
+  case 8: width = 3; break;
+  default: return mxUNKNOWN_CLASS;
+  }
+  switch (*format) {
+  case '?': return itemsize == 1 ? mxLOGICAL_CLASS : mxUNKNOWN_CLASS;
+  case 'f': return itemsize == 4 ? mxSINGLE_CLASS : mxUNKNOWN_CLASS;
+  case 'd': return itemsize == 8 ? mxDOUBLE_CLASS : mxUNKNOWN_CLASS;
+  case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+    return sized[0][width];
+  case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+    return sized[1][width];
+  default: return mxUNKNOWN_CLASS;
+  }
+}
+
+/* The same for complex buffers ("Zd" and "Zf"), giving the class of
+   their real and imaginary parts. */
+static mxClassID Buffer_complex_mxClassID(const char *format, Py_ssize_t itemsize) {
+  static const union { uint16_t word; char first; } byteorder = {1};
+  if (!format) return mxUNKNOWN_CLASS;
+  if (*format == '@' || *format == '=' || (*format == '<' && byteorder.first))
+    format++;
+  if (!strcmp(format, "Zd") && itemsize == 16) return mxDOUBLE_CLASS;
+  if (!strcmp(format, "Zf") && itemsize == 8) return mxSINGLE_CLASS;
+  return mxUNKNOWN_CLASS;
+}
+
+/* Copies anything exporting a plain numeric buffer straight into a new
+   mxArray, fattened out to 2d the way np.atleast_2d would. The data is
+   allocated uninitialized and written exactly once, except that complex
+   data that isn't already in Fortran order is gathered first and then
+   split into its real and imaginary parts. Returns NULL with no error
+   set if the object can't be handled this way. */
+static mxArray *Buffer_to_mxArray(PyObject *pyobj) {
+  Py_buffer view;
+  if (!PyObject_CheckBuffer(pyobj) ||
+      PyObject_GetBuffer(pyobj, &view, PyBUF_STRIDES | PyBUF_FORMAT) < 0) {
+    PyErr_Clear();
+    return NULL;
+  }
+  mxClassID mxclass = Buffer_format_to_mxClassID(view.format, view.itemsize);
+  bool complex = false;
+  if (mxclass == mxUNKNOWN_CLASS) {
+    mxclass = Buffer_complex_mxClassID(view.format, view.itemsize);
+    complex = mxclass != mxUNKNOWN_CLASS;
+  }
+  if (mxclass == mxUNKNOWN_CLASS) {
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+  int ndim = view.ndim < 2 ? 2 : view.ndim;
+  int lead = ndim - view.ndim;
+  mwSize dims[ndim];
+  Py_ssize_t shape[ndim], strides[ndim];
+  Py_ssize_t stride = view.itemsize;
+  size_t numel = 1;
+  bool fortran = true;
+  int k;
+  for (k=ndim-1; k>=0; k--) {
+    shape[k] = k < lead ? 1 : view.shape[k-lead];
+    if (k < lead) strides[k] = 0;
+    else if (view.strides) strides[k] = view.strides[k-lead];
+    else strides[k] = stride; /* C-contiguous */
+    stride *= shape[k];
+    dims[k] = shape[k];
+    numel *= shape[k];
+  }
+  for (k=0, stride=view.itemsize; k<ndim; stride *= shape[k], k++)
+    if (shape[k] > 1 && strides[k] != stride) fortran = false;
+  mxArray *retval;
+  if (mxclass == mxLOGICAL_CLASS)
+    retval = mxCreateLogicalMatrix(0, 0);
+  else
+    retval = mxCreateNumericMatrix(0, 0, mxclass, complex ? mxCOMPLEX : mxREAL);
+  mxSetDimensions(retval, dims, ndim);
+  if (numel && complex) {
+    size_t realsize = view.itemsize / 2;
+    void *re = mxMalloc(numel * realsize), *im = mxMalloc(numel * realsize);
+    void *data = fortran ? view.buf : mxMalloc(numel * view.itemsize);
+    if (!fortran)
+      Copy_strided_to_fortran(data, view.buf, ndim, shape, strides, view.itemsize);
+    Deinterleave_complex(re, im, data, numel, realsize);
+    if (!fortran) mxFree(data);
+    mxSetData(retval, re);
+    mxSetImagData(retval, im);
+  }
+  else if (numel) {
+    void *data = mxMalloc(numel * view.itemsize);
+    Copy_strided_to_fortran(data, view.buf, ndim, shape, strides, view.itemsize);
+    mxSetData(retval, data);
+  }
+  PyBuffer_Release(&view);
+  return retval;
+}
+
+/* Converts NumPy arrays and scalars. Plain numeric dtypes are copied
+   directly; the rest are left to pymexutil. */
+mxArray *PyArray_to_mxArray(PyObject *pyobj) {
+  mxArray *retval = Buffer_to_mxArray(pyobj);
+  if (retval) return retval;
+  if (numpy_generic && PyObject_TypeCheck(pyobj, (PyTypeObject *) numpy_generic)) {
+    /* Not all scalars export buffers, but their 0-d arrays do. */
+    PyObject *array = PyObject_CallMethod(pyobj, "__array__", NULL);
+    if (!array) return NULL;
+    retval = Buffer_to_mxArray(array);
+    Py_DECREF(array);
+    if (retval) return retval;
+  }
+  PyObject *utils = pymexutil();
+  if (!utils) return NULL;
+  PyObject *wrapper = PyObject_CallMethod(utils, "numpy_ndarray_unpy", "O", pyobj);
+  if (!wrapper) return NULL;
+  return mxArray_Take(wrapper);
+}
+
+/*
+  scipy.sparse matrices to MATLAB sparse arrays, built straight into one
+  mxCreateSparse allocation whatever the input format. A canonical CSC
+  matrix (sorted rows, no repeats) is MATLAB's own layout, so it only
+  has its indices widened to mwIndex. CSR and COO entries are put in
+  row order and sorted into columns by Rows_to_columns, which also adds
+  up repeated entries; anything else goes through tocsr() first. Stored
+  zeros, and repeats that add up to zero, are dropped. Values
+  become double (or logical, or complex double); the indices are checked
+  against the shape, since MATLAB trusts them.
+*/
+#define SPARSE_FORMATS 7
+static PyTypeObject *scipy_sparse_types[SPARSE_FORMATS];
+
+/* Exactly one of the scipy.sparse formats, looked up the first time
+   it's asked after scipy.sparse has been imported. Subclasses are left
+   to pymexutil, like those of the other exact types. */
+static bool Is_scipy_sparse(PyObject *pyobj) {
+  static const char *names[SPARSE_FORMATS] = {"csc_matrix", "csr_matrix", "coo_matrix",
+					      "lil_matrix", "dok_matrix", "dia_matrix",
+					      "bsr_matrix"};
+  int i;
+  if (!scipy_sparse_types[0]) {
+    PyObject *sparse = PyDict_GetItemString(PyImport_GetModuleDict(), "scipy.sparse");
+    if (!sparse) return false;
+    for (i=0; i<SPARSE_FORMATS; i++) {
+      PyObject *type = PyObject_GetAttrString(sparse, names[i]);
+      if (type && PyType_Check(type))
+	scipy_sparse_types[i] = (PyTypeObject *) type;
+      else {
+	Py_XDECREF(type);
+	PyErr_Clear();
+      }
+    }
+  }
+  for (i=0; i<SPARSE_FORMATS; i++)
+    if (pyobj->ob_type == scipy_sparse_types[i]) return true;
+  return false;
+}
+
+/* obj.name as a C-contiguous array of the given dtype (NULL for int32
+   or int64, whichever is nearer), with its buffer in view. */
+static PyObject *sparse_part_buffer(PyObject *obj, const char *name,
+				    const char *dtype, Py_buffer *view) {
+  PyObject *numpy = PyImport_ImportModule("numpy");
+  PyObject *part = numpy ? PyObject_GetAttrString(obj, name) : NULL;
+  PyObject *array = NULL;
+  if (part && !dtype) {
+    PyObject *itemsize = PyObject_GetAttrString(part, "itemsize");
+    dtype = itemsize && PyInt_Check(itemsize) && PyInt_AS_LONG(itemsize) <= 4 ? "int32" : "int64";
+    Py_XDECREF(itemsize);
+    PyErr_Clear();
+  }
+  if (part)
+    array = PyObject_CallMethod(numpy, "ascontiguousarray", "(Os)", part, dtype);
+  Py_XDECREF(numpy);
+  Py_XDECREF(part);
+  if (array && PyObject_GetBuffer(array, view, PyBUF_C_CONTIGUOUS) < 0)
+    Py_CLEAR(array);
+  return array;
+}
+
+mxArray *Scipy_to_mxSparse(PyObject *pyobj) {
+  Py_ssize_t m, n;
+  mxArray *retval = NULL;
+  PyObject *matrix = NULL, *parts[3] = {NULL, NULL, NULL};
+  Py_buffer views[3];
+  mwIndex *rows = NULL, *cols = NULL, *order = NULL;
+  int i, kind = SPARSE_REAL;
+  bool ok = false;
+  PyObject *format = PyObject_GetAttrString(pyobj, "format");
+  PyObject *canonical = PyObject_GetAttrString(pyobj, "has_canonical_format");
+  PyErr_Clear();
+  const char *fmt = format && PyString_Check(format) ? PyString_AS_STRING(format) : "";
+  if (!strcmp(fmt, "coo") || !strcmp(fmt, "csr") ||
+      (!strcmp(fmt, "csc") && canonical && PyObject_IsTrue(canonical) > 0)) {
+    Py_INCREF(pyobj);
+    matrix = pyobj;
+  }
+  else {
+    matrix = PyObject_CallMethod(pyobj, "tocsr", NULL);
+    fmt = "csr";
+  }
+  Py_XDECREF(canonical);
+  PyObject *shape = matrix ? PyObject_GetAttrString(matrix, "shape") : NULL;
+  PyObject *dtype = shape ? PyObject_GetAttrString(matrix, "dtype") : NULL;
+  PyObject *dkind = dtype ? PyObject_GetAttrString(dtype, "kind") : NULL;
+  Py_XDECREF(dtype);
+  if (!dkind || !PyArg_ParseTuple(shape, "nn", &m, &n)) goto done;
+  if (PyString_Check(dkind) && PyString_AS_STRING(dkind)[0] == 'b') kind = SPARSE_LOGICAL;
+  if (PyString_Check(dkind) && PyString_AS_STRING(dkind)[0] == 'c') kind = SPARSE_COMPLEX;
+  bool coo = !strcmp(fmt, "coo");
+  const char *names[3] = {"data", coo ? "row" : "indices", coo ? "col" : "indptr"};
+  const char *dtypes[3] = {kind == SPARSE_LOGICAL ? "bool" : kind == SPARSE_COMPLEX ? "complex128" : "float64",
+			   NULL, NULL};
+  for (i=0; i<3; i++)
+    if (!(parts[i] = sparse_part_buffer(matrix, names[i], dtypes[i], &views[i]))) goto done;
+  size_t nnz = views[0].len / views[0].itemsize;
+  int width[3] = {0, views[1].itemsize, views[2].itemsize};
+  if (views[1].len / width[1] != nnz ||
+      (coo ? views[2].len / width[2] != nnz
+       : views[2].len / width[2] != (Py_ssize_t) (strcmp(fmt, "csc") ? m : n) + 1)) {
+    PyErr_Format(PyExc_ValueError, "Inconsistent sparse matrix: %s has the wrong length",
+		 names[views[1].len / width[1] != nnz ? 1 : 2]);
+    goto done;
+  }
+  retval = kind == SPARSE_LOGICAL ? mxCreateSparseLogicalMatrix(m, n, nnz ? nnz : 1)
+    : mxCreateSparse(m, n, nnz ? nnz : 1, kind == SPARSE_COMPLEX ? mxCOMPLEX : mxREAL);
+  mwIndex *jc = mxGetJc(retval), *ir = mxGetIr(retval);
+  if (!strcmp(fmt, "csc")) {
+    ok = Copy_indices(ir, views[1].buf, width[1], nnz, m) &&
+      Copy_indices(jc, views[2].buf, width[2], n+1, nnz+1) && jc[0] == 0 && jc[n] == nnz;
+    for (i=0; ok && i<n; i++) ok = jc[i] <= jc[i+1];
+    if (ok && kind == SPARSE_COMPLEX) {
+      const double *src = (const double *) views[0].buf;
+      double *pr = mxGetPr(retval), *pi = mxGetPi(retval);
+      size_t k;
+      for (k=0; k<nnz; k++) {
+	pr[k] = src[2*k];
+	pi[k] = src[2*k+1];
+      }
+    }
+    else if (ok)
+      memcpy(mxGetData(retval), views[0].buf, nnz * mxGetElementSize(retval));
+    if (ok)
+      Drop_sparse_zeros(jc, ir, mxGetData(retval),
+			kind == SPARSE_COMPLEX ? mxGetPi(retval) : NULL, n, kind);
+  }
+  else {
+    size_t nptr = coo ? 0 : m+1;
+    rows = PyMem_New(mwIndex, nnz + nptr);
+    cols = PyMem_New(mwIndex, nnz);
+    order = coo ? PyMem_New(mwIndex, nnz + m + 1) : NULL;
+    if (!rows || !cols || (coo && !order)) {
+      PyErr_NoMemory();
+      goto done;
+    }
+    if (coo)
+      ok = Copy_indices(rows, views[1].buf, width[1], nnz, m) &&
+	Copy_indices(cols, views[2].buf, width[2], nnz, n);
+    else
+      ok = Copy_indices(cols, views[1].buf, width[1], nnz, n) &&
+	Copy_indices(rows + nnz, views[2].buf, width[2], m+1, nnz+1) &&
+	Expand_pointers(rows, rows + nnz, m, nnz);
+    if (ok) {
+      if (coo) Order_by_row(order, order + nnz, rows, nnz, m);
+      Sparse_entries entries = {nnz, n, rows, cols, order, views[0].buf, kind};
+      Rows_to_columns(&entries, jc, ir, mxGetData(retval),
+		      kind == SPARSE_COMPLEX ? mxGetPi(retval) : NULL);
+    }
+  }
+  if (!ok)
+    PyErr_Format(PyExc_ValueError, "Inconsistent sparse matrix: indices out of range or out of order");
+ done:
+  if (PyErr_Occurred() && retval) {
+    mxDestroyArray(retval);
+    retval = NULL;
+  }
+  for (i=0; i<3; i++)
+    if (parts[i]) {
+      PyBuffer_Release(&views[i]);
+      Py_DECREF(parts[i]);
+    }
+  PyMem_Free(rows);
+  PyMem_Free(cols);
+  PyMem_Free(order);
+  Py_XDECREF(dkind);
+  Py_XDECREF(shape);
+  Py_XDECREF(matrix);
+  Py_XDECREF(format);
+  return retval;
+}
+
+/* A MATLAB value as a plain Python one where that's easy: str for char
+   arrays, a number for real numeric and logical scalars, None for other
+   empties. Anything else is converted as usual. */
+static PyObject *plain_PyObject(const mxArray *item) {
+  if (item && mxIsChar(item))
+    return mxChar_to_PyBytes(item);
+  if (!item || mxIsEmpty(item)) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (mxGetNumberOfElements(item) == 1 && !mxIsComplex(item) && !mxIsSparse(item)
+      && (mxIsNumeric(item) || mxIsLogical(item)))
+    return mxElement_to_PyObject(item, 0);
+  return Any_mxArray_to_PyObject(item);
+}
+
+/*
+  One field of a struct array as a column: if every element holds a real
+  scalar of the same numeric or logical class, their values are gathered
+  into a single N x 1 array of that class (a 1-d NumPy array, if NumPy
+  is around). Otherwise it's a list of plain_PyObject values. Either
+  way there's no wrapper object per element unless the element really
+  needs one.
+*/
+static PyObject *struct_column(const mxArray *st, int field) {
+  mwSize i, numel = mxGetNumberOfElements(st);
+  mxClassID mxclass = mxUNKNOWN_CLASS;
+  for (i=0; i<numel; i++) {
+    const mxArray *item = mxGetFieldByNumber(st, i, field);
+    if (!item || mxGetNumberOfElements(item) != 1 || mxIsComplex(item) || mxIsSparse(item)
+	|| !(mxIsNumeric(item) || mxIsLogical(item))
+	|| (i && mxGetClassID(item) != mxclass)) {
+      mxclass = mxUNKNOWN_CLASS;
+      break;
+    }
+    mxclass = mxGetClassID(item);
+  }
+  if (numel && mxclass != mxUNKNOWN_CLASS) {
+    mxArray *column = mxclass == mxLOGICAL_CLASS ? mxCreateLogicalMatrix(numel, 1)
+      : mxCreateNumericMatrix(numel, 1, mxclass, mxREAL);
+    size_t elsize = mxGetElementSize(column);
+    char *data = (char *) mxGetData(column);
+    for (i=0; i<numel; i++)
+      memcpy(data + i * elsize, mxGetData(mxGetFieldByNumber(st, i, field)), elsize);
+    PyObject *wrapped = Py_mxArray_New(column, false);
+    if (!wrapped || !find_numpy_types()) return wrapped;
+    /* A view of the column's data, flattened to 1-d. */
+    PyObject *numpy = PyDict_GetItemString(PyImport_GetModuleDict(), "numpy");
+    PyObject *array = PyObject_CallMethod(numpy, "reshape", "(Oi)", wrapped, -1);
+    Py_DECREF(wrapped);
+    return array;
+  }
+  PyObject *list = PyList_New(numel);
+  if (!list) return NULL;
+  for (i=0; i<numel; i++) {
+    PyObject *pyitem = plain_PyObject(mxGetFieldByNumber(st, i, field));
+    if (!pyitem) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, pyitem);
+  }
+  return list;
+}
+
+/*
+  Converts a whole struct array at once into a dict mapping each field
+  name to a column (see struct_column). With structured set, the
+  columns are instead combined into a NumPy record array with one
+  record per element.
+*/
+PyObject *Struct_to_columns(const mxArray *st, bool structured) {
+  int field, nfields = mxGetNumberOfFields(st);
+  PyObject *columns = structured ? PyList_New(nfields) : PyDict_New();
+  PyObject *names = PyList_New(nfields);
+  if (!columns || !names) goto fail;
+  for (field=0; field<nfields; field++) {
+    PyObject *name = PyBytes_FromString(mxGetFieldNameByNumber(st, field));
+    if (!name) goto fail;
+    PyList_SET_ITEM(names, field, name);
+    PyObject *column = struct_column(st, field);
+    if (!column) goto fail;
+    if (structured)
+      PyList_SET_ITEM(columns, field, column);
+    else {
+      int status = PyDict_SetItem(columns, name, column);
+      Py_DECREF(column);
+      if (status < 0) goto fail;
+    }
+  }
+  if (structured) {
+    PyObject *rec = PyImport_ImportModule("numpy.core.records");
+    PyObject *fromarrays = rec ? PyObject_GetAttrString(rec, "fromarrays") : NULL;
+    PyObject *args = fromarrays ? PyTuple_Pack(1, columns) : NULL;
+    PyObject *kwargs = args ? Py_BuildValue("{sO}", "names", names) : NULL;
+    PyObject *array = kwargs ? PyObject_Call(fromarrays, args, kwargs) : NULL;
+    Py_XDECREF(rec);
+    Py_XDECREF(fromarrays);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    Py_DECREF(columns);
+    columns = array;
+  }
+  Py_DECREF(names);
+  return columns;
+ fail:
+  Py_XDECREF(columns);
+  Py_XDECREF(names);
+  return NULL;
+}
+
+/*
+  Nested cells - a cell of cells of matrices, say - become nested tuples
+  in one walk with an explicit stack, so deep nesting doesn't recurse.
+  Each tuple is allocated at its final size. Char arrays become str and
+  boxed Python objects are unboxed; other leaves follow the policy:
+  CELL_LEAF_WRAP duplicates them into wrappers as usual, CELL_LEAF_VIEW
+  makes read-only views (see Py_mxArray_View), and CELL_LEAF_NUMPY turns
+  numeric and logical arrays into NumPy arrays.
+
+  An array MATLAB shares between several cells (the same variable put in
+  many places, copy-on-write) has the same data everywhere, so it's
+  converted the first time and the same Python object used after that.
+  They're found in a dict keyed by the data pointers, class and dims.
+  A NumPy array used more than once is made read-only, so that writing
+  to it in one place can't show up in the others.
+*/
+typedef struct {
+  const mxArray *cell;
+  PyObject *tuple;
+  PyObject *key;		/* where the tuple goes in seen, or NULL */
+  mwSize next, numel;
+} cell_frame;
+
+typedef struct {
+  cell_frame *stack;
+  int depth, size;
+} cell_walk;
+
+/* The reuse key for an array, or NULL (with no error set) if it has no
+   data of its own to go by. */
+static PyObject *cell_reuse_key(const mxArray *item) {
+  struct {
+    const void *data, *imag;
+    mxClassID mxclass;
+    mwSize ndim;
+  } head;
+  if (!item || mxIsEmpty(item) || mxIsSparse(item) || !mxGetData(item)) return NULL;
+  if (!(mxIsNumeric(item) || mxIsLogical(item) || mxIsChar(item) || mxIsCell(item)))
+    return NULL;
+  memset(&head, 0, sizeof(head));
+  head.data = mxGetData(item);
+  head.imag = mxGetImagData(item);
+  head.mxclass = mxGetClassID(item);
+  head.ndim = mxGetNumberOfDimensions(item);
+  size_t dimsize = head.ndim * sizeof(mwSize);
+  PyObject *key = PyString_FromStringAndSize(NULL, sizeof(head) + dimsize);
+  if (!key) return NULL;
+  memcpy(PyString_AS_STRING(key), &head, sizeof(head));
+  memcpy(PyString_AS_STRING(key) + sizeof(head), mxGetDimensions(item), dimsize);
+  return key;
+}
+
+static PyObject *cell_leaf(const mxArray *item, int leaves) {
+  if (!item)			/* an unset cell is [] */
+    return Py_mxArray_New(mxCreateDoubleMatrix(0, 0, mxREAL), false);
+  if (mxIsChar(item) || mxIsPyObject(item))
+    return Any_mxArray_to_PyObject(item);
+  if (leaves == CELL_LEAF_VIEW)
+    return Py_mxArray_View(item);
+  if (leaves == CELL_LEAF_NUMPY && !mxIsSparse(item)
+      && (mxIsNumeric(item) || mxIsLogical(item)) && find_numpy_types()) {
+    PyObject *wrapped = Py_mxArray_New((mxArray *) item, true);
+    if (!wrapped) return NULL;
+    PyObject *numpy = PyDict_GetItemString(PyImport_GetModuleDict(), "numpy");
+    PyObject *array = PyObject_CallMethod(numpy, "asarray", "(O)", wrapped);
+    Py_DECREF(wrapped);
+    return array;
+  }
+  return Py_mxArray_New((mxArray *) item, true);
+}
+
+/* Takes over key. */
+static bool cell_push(cell_walk *walk, const mxArray *cell, PyObject *key) {
+  if (walk->depth == walk->size) {
+    int size = walk->size ? 2 * walk->size : 16;
+    cell_frame *stack = PyMem_Resize(walk->stack, cell_frame, size);
+    if (!stack) {
+      Py_XDECREF(key);
+      PyErr_NoMemory();
+      return false;
+    }
+    walk->stack = stack;
+    walk->size = size;
+  }
+  mwSize numel = mxGetNumberOfElements(cell);
+  cell_frame frame = {cell, PyTuple_New(numel), key, 0, numel};
+  if (!frame.tuple) {
+    Py_XDECREF(key);
+    return false;
+  }
+  walk->stack[walk->depth++] = frame;
+  return true;
+}
+
+/* Converts a cell and every cell in it, as above. */
+PyObject *mxCell_to_PyTree(const mxArray *root, int leaves) {
+  if (!mxIsCell(root)) return cell_leaf(root, leaves);
+  cell_walk walk = {NULL, 0, 0};
+  PyObject *seen = PyDict_New(), *result = NULL;
+  bool ok = seen && cell_push(&walk, root, NULL);
+  while (ok && walk.depth) {
+    cell_frame *top = &walk.stack[walk.depth-1];
+    PyObject *pyitem;
+    if (top->next == top->numel) {
+      pyitem = top->tuple;
+      if (top->key) {
+	ok = PyDict_SetItem(seen, top->key, pyitem) == 0;
+	Py_DECREF(top->key);
+      }
+      if (--walk.depth) {
+	top = &walk.stack[walk.depth-1];
+	PyTuple_SET_ITEM(top->tuple, top->next++, pyitem);
+      }
+      else
+	result = pyitem;
+      continue;
+    }
+    const mxArray *item = mxGetCell(top->cell, top->next);
+    PyObject *key = cell_reuse_key(item);
+    if (!key && PyErr_Occurred()) {
+      ok = false;
+      break;
+    }
+    if (key && (pyitem = PyDict_GetItem(seen, key))) {
+      Py_DECREF(key);
+      /* Writing through one place would change all the others. */
+      if (Py_mxArray_Check(pyitem)) {
+	((mxArrayObject *) pyitem)->shared = true;
+	((mxArrayObject *) pyitem)->readonly = true;
+      }
+      else if (numpy_ndarray && PyObject_TypeCheck(pyitem, (PyTypeObject *) numpy_ndarray)) {
+	PyObject *flags = PyObject_GetAttrString(pyitem, "flags");
+	ok = flags && PyObject_SetAttrString(flags, "writeable", Py_False) == 0;
+	Py_XDECREF(flags);
+	if (!ok) break;
+      }
+      Py_INCREF(pyitem);
+    }
+    else if (item && mxIsCell(item)) {
+      ok = cell_push(&walk, item, key);
+      continue;
+    }
+    else {
+      pyitem = cell_leaf(item, leaves);
+      if (pyitem && key) ok = PyDict_SetItem(seen, key, pyitem) == 0;
+      Py_XDECREF(key);
+      if (!pyitem) {
+	ok = false;
+	break;
+      }
+    }
+    PyTuple_SET_ITEM(top->tuple, top->next++, pyitem);
+  }
+  if (!ok) {
+    int i;
+    for (i=0; i<walk.depth; i++) {
+      Py_DECREF(walk.stack[i].tuple);
+      Py_XDECREF(walk.stack[i].key);
+    }
+    Py_CLEAR(result);
+  }
+  PyMem_Free(walk.stack);
+  Py_XDECREF(seen);
+  return result;
+}
+
+/*
+  containers.Map in bulk. map_items.m hands over all the keys and values
+  in one call, and they're converted here by plain_PyObject, with no
+  wrapper or MATLAB call per entry. For going through a big Map a piece
+  at a time, Map_keys gets the keys and Map_values the values for a
+  slice of them. The other way, PyDict_to_Map builds the key and value
+  arrays here and calls the constructor once.
+*/
+static PyObject *plain_list(const mxArray *cell, mwSize first, mwSize count) {
+  PyObject *list = PyList_New(count);
+  mwSize i;
+  for (i=0; list && i<count; i++) {
+    PyObject *item = plain_PyObject(mxGetCell(cell, first + i));
+    if (!item) Py_CLEAR(list);
+    else PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+/* Returns (keys, values) as two lists, in the same order. */
+PyObject *Map_items(mxArray *map) {
+  mxArray *out[2] = {NULL, NULL};
+  if (mexCallMATLABWithTrap(2, out, 1, &map, "map_items"))
+    return PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+  PyObject *keys = plain_list(out[0], 0, mxGetNumberOfElements(out[0]));
+  PyObject *values = keys ? plain_list(out[1], 0, mxGetNumberOfElements(out[1])) : NULL;
+  mxDestroyArray(out[0]);
+  mxDestroyArray(out[1]);
+  PyObject *retval = values ? PyTuple_Pack(2, keys, values) : NULL;
+  Py_XDECREF(keys);
+  Py_XDECREF(values);
+  return retval;
+}
+
+/* Returns the keys as a list, and sets *mxkeys to MATLAB's cell of them
+   (which belongs to the caller) to hand back to Map_values. */
+PyObject *Map_keys(mxArray *map, mxArray **mxkeys) {
+  if (mexCallMATLABWithTrap(1, mxkeys, 1, &map, "keys"))
+    return PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+  PyObject *keys = plain_list(*mxkeys, 0, mxGetNumberOfElements(*mxkeys));
+  if (!keys) {
+    mxDestroyArray(*mxkeys);
+    *mxkeys = NULL;
+  }
+  return keys;
+}
+
+/* The values for up to count of the keys in mxkeys, starting at first. */
+PyObject *Map_values(mxArray *map, const mxArray *mxkeys, mwSize first, mwSize count) {
+  mwSize i, numel = mxGetNumberOfElements(mxkeys);
+  if (first >= numel) return PyList_New(0);
+  if (count > numel - first) count = numel - first;
+  /* The slice gets copies of its keys: a cell can't share its elements
+     with another. Keys are short, so that's cheap next to values(). */
+  mxArray *in[2] = {map, mxCreateCellMatrix(1, count)};
+  mxArray *out = NULL;
+  for (i=0; i<count; i++) mxSetCell(in[1], i, mxDuplicateArray(mxGetCell(mxkeys, first + i)));
+  mxArray *err = mexCallMATLABWithTrap(1, &out, 2, in, "values");
+  mxDestroyArray(in[1]);
+  if (err) return PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+  PyObject *values = plain_list(out, 0, count);
+  mxDestroyArray(out);
+  return values;
+}
+
+/* A dict with all str (or unicode) keys or all numeric keys to a new
+   containers.Map holding its values, converted as usual. */
+mxArray *PyDict_to_Map(PyObject *dict) {
+  Py_ssize_t pos = 0, i = 0, n = PyDict_Size(dict);
+  PyObject *key, *value;
+  bool strings = true, numbers = true;
+  while (PyDict_Next(dict, &pos, &key, &value)) {
+    strings = strings && (PyBytes_Check(key) || PyUnicode_Check(key));
+    numbers = numbers && !PyBool_Check(key) &&
+      (PyInt_Check(key) || PyLong_Check(key) || PyFloat_Check(key));
+  }
+  if (!strings && !numbers) {
+    PyErr_Format(PyExc_TypeError, "Map keys must be all strings or all numbers");
+    return NULL;
+  }
+  mxArray *map = NULL;
+  if (!n) {
+    if (mexCallMATLABWithTrap(1, &map, 0, NULL, "containers.Map"))
+      PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+    return map;
+  }
+  mxArray *in[4] = {NULL, mxCreateCellMatrix(1, n), mxCreateString("UniformValues"),
+		    mxCreateLogicalScalar(false)};
+  PyObject *keys = PyList_New(n);
+  in[0] = strings ? NULL : mxCreateDoubleMatrix(1, n, mxREAL);
+  for (pos = 0; keys && PyDict_Next(dict, &pos, &key, &value); i++) {
+    Py_INCREF(key);
+    PyList_SET_ITEM(keys, i, key);
+    if (!strings) mxGetPr(in[0])[i] = PyFloat_AsDouble(key);
+    mxArray *mxvalue = Any_PyObject_to_mxArray(value);
+    if (!mxvalue) break;
+    mxSetCell(in[1], i, mxvalue);
+  }
+  if (keys && strings && !PyErr_Occurred()) in[0] = PyStrings_to_cellstr(keys);
+  Py_XDECREF(keys);
+  if (in[0] && !PyErr_Occurred() &&
+      mexCallMATLABWithTrap(1, &map, 4, in, "containers.Map")) {
+    map = NULL;
+    PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+  }
+  for (i=0; i<4; i++)
+    if (in[i]) mxDestroyArray(in[i]);
+  return PyErr_Occurred() ? NULL : map;
+}
+
+/* Copies n buffers of identical format and shape, one after another,
+   into a new array with one more dimension than they have. */
+static mxArray *stack_buffers(PyObject **items, Py_ssize_t n) {
+  Py_buffer first, view;
+  mxArray *retval = NULL;
+  char *data = NULL;
+  Py_ssize_t j;
+  int k;
+  if (PyObject_GetBuffer(items[0], &first, PyBUF_STRIDES | PyBUF_FORMAT) < 0) {
+    PyErr_Clear();
+    return NULL;
+  }
+  mxClassID mxclass = Buffer_format_to_mxClassID(first.format, first.itemsize);
+  int ndim = first.ndim < 2 ? 2 : first.ndim + 1;
+  mwSize dims[ndim];
+  size_t numel = 1;
+  for (k=0; k<first.ndim; k++) {
+    dims[k] = first.shape[k];
+    numel *= first.shape[k];
+  }
+  if (first.ndim == 0) dims[0] = 1;
+  dims[ndim-1] = n;
+  if (mxclass == mxUNKNOWN_CLASS) goto done;
+  if (numel && !(data = mxMalloc(numel * n * first.itemsize))) goto done;
+  for (j=0; j<n; j++) {
+    if (j && (!PyObject_CheckBuffer(items[j]) ||
+	      PyObject_GetBuffer(items[j], &view, PyBUF_STRIDES | PyBUF_FORMAT) < 0)) {
+      PyErr_Clear();
+      goto done;
+    }
+    Py_buffer *b = j ? &view : &first;
+    bool same = b->ndim == first.ndim && b->itemsize == first.itemsize &&
+      !strcmp(b->format ? b->format : "B", first.format ? first.format : "B");
+    for (k=0; same && k<first.ndim; k++)
+      same = b->shape[k] == first.shape[k];
+    if (same && numel) {
+      char *dst = data + j * numel * first.itemsize;
+      if (!first.ndim) {
+	memcpy(dst, b->buf, first.itemsize);
+      }
+      else {
+	Py_ssize_t strides[first.ndim];
+	Py_ssize_t stride = first.itemsize;
+	for (k=first.ndim-1; k>=0; k--) {
+	  strides[k] = b->strides ? b->strides[k] : stride;
+	  stride *= first.shape[k];
+	}
+	Copy_strided_to_fortran(dst, b->buf, first.ndim, first.shape, strides, first.itemsize);
+      }
+    }
+    if (j) PyBuffer_Release(&view);
+    if (!same) goto done;
+  }
+  if (mxclass == mxLOGICAL_CLASS)
+    retval = mxCreateLogicalMatrix(0, 0);
+  else
+    retval = mxCreateNumericMatrix(0, 0, mxclass, mxREAL);
+  mxSetDimensions(retval, dims, ndim);
+  mxSetData(retval, data);
+  data = NULL;
+ done:
+  if (data) mxFree(data);
+  PyBuffer_Release(&first);
+  return retval;
+}
+
+/*
+  Packs n Python objects into one dense array, if they're alike enough:
+  buffers of the same numeric format and shape are stacked along a new
+  last dimension (so 1-d ones become the columns of a matrix), and so
+  are lists of numbers of the same shape, if the dense_sequences option
+  is on. Plain numbers become a 1 x n row. Numbers get their class as
+  by Sequence_to_dense.
+  Returns NULL with no error set if they aren't alike.
+*/
+mxArray *Stack_items(PyObject **items, Py_ssize_t n) {
+  Py_ssize_t j;
+  bool numbers = true, buffers = true, sequences = true;
+  for (j=0; j<n && (numbers || buffers || sequences); j++) {
+    PyObject *item = items[j];
+    numbers = numbers && (PyInt_Check(item) || PyLong_Check(item) || PyFloat_Check(item));
+    buffers = buffers && PyObject_CheckBuffer(item) && !PyBytes_Check(item);
+    sequences = sequences && (PyList_Check(item) || PyTuple_Check(item));
+  }
+  sequences = sequences && Option_dense_sequences;
+  if (!n || (!numbers && !buffers && !sequences)) return NULL;
+  if (buffers) return stack_buffers(items, n);
+  /* Let dense_array have them all at once, outermost level last. */
+  PyObject *all = PyTuple_New(n);
+  if (!all) return NULL;
+  for (j=0; j<n; j++) {
+    Py_INCREF(items[j]);
+    PyTuple_SET_ITEM(all, j, items[j]);
+  }
+  mxArray *retval = dense_array(all, true);
+  Py_DECREF(all);
+  return retval;
+}
+
+/*
+  Takes up to n items from an iterator into a 1 x k cell, boxed or, if
+  convert is set, converted as by TO_MXARRAY - or stacked into one dense
+  array by Stack_items when they allow it. *done is set once the
+  iterator has run dry, rather than raising StopIteration.
+*/
+mxArray *Iter_next_n(PyObject *iter, mwSize n, bool convert, bool *done) {
+  PyObject **items = PyMem_New(PyObject *, n ? n : 1);
+  mxArray *out = NULL;
+  mwSize i, k = 0;
+  if (!items) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  while (k < n && (items[k] = PyIter_Next(iter))) k++;
+  *done = k < n;
+  if (PyErr_Occurred()) goto done;
+  if (convert) out = Stack_items(items, k);
+  if (!out && !PyErr_Occurred()) {
+    out = mxCreateCellMatrix(1, k);
+    for (i=0; i<k; i++) {
+      mxArray *item = convert ? Any_PyObject_to_mxArray(items[i]) : boxb(items[i]);
+      if (!item) {
+	mxDestroyArray(out);
+	out = NULL;
+	break;
+      }
+      mxSetCell(out, i, item);
+    }
+  }
+ done:
+  for (i=0; i<k; i++) Py_DECREF(items[i]);
+  PyMem_Free(items);
+  return out;
+}
+
+typedef mxArray *(*PyObject_converter)(PyObject *pyobj);
+
+/*
+  Converters for the common types, tried before the Python-level
+  registry in pymexutil. These match on the exact type, so subclasses
+  (and anything registered with pymexutil.register_unpy) still go
+  through pymexutil.unpy.
+*/
+static struct {
+  PyTypeObject *type;
+  PyObject_converter convert;
+} exact_converters[] = {
+  {&PyFloat_Type, PyObject_to_mxDouble},
+  {&PyBool_Type, PyObject_to_mxLogical},
+#if PY_MAJOR_VERSION < 3
+  {&PyInt_Type, PyInt_to_mxInt32},
+#endif
+  {&PyLong_Type, PyObject_to_mxLong},
+  {&PyBytes_Type, PyBytes_to_mxChar},
+  {&PyUnicode_Type, PyUnicode_to_mxChar},
+  {&PyTuple_Type, PySequence_to_mxArray},
+  {&PyList_Type, PySequence_to_mxArray},
+  {&PyDict_Type, PyDict_to_mxArray},
+  {NULL, NULL}
+};
+
+/* Returns the converter for the object, or NULL if it has to go
+   through pymexutil.unpy. */
+static PyObject_converter find_converter(PyObject *pyobj) {
+  int i;
+  for (i=0; exact_converters[i].type; i++) {
+    if (pyobj->ob_type == exact_converters[i].type)
+      return exact_converters[i].convert;
+  }
+  /* Exactly ndarray, or one of NumPy's own scalar types. Subclasses
+     (matrix, masked arrays, anything with its own unpy) go through
+     pymexutil. */
+  if (find_numpy_types() &&
+      (pyobj->ob_type == (PyTypeObject *) numpy_ndarray ||
+       (PyObject_TypeCheck(pyobj, (PyTypeObject *) numpy_generic) &&
+	!strncmp(pyobj->ob_type->tp_name, "numpy.", 6))))
+    return PyArray_to_mxArray;
+  if (Is_scipy_sparse(pyobj))
+    return Scipy_to_mxSparse;
+  return NULL;
+}
+
+/* Converts the object to a new (persistent) mxArray, which belongs to the
+   caller. Anything we don't know how to convert gets boxed. */
+mxArray *Any_PyObject_to_mxArray(PyObject *pyobj) {
+  if (!pyobj)
+    return box(pyobj); /* Null pointer */
+  if (Py_mxArray_Check(pyobj) || mxArrayPtr_Check(pyobj)) {
+    mxArray *retval = mxArrayPtr(pyobj);
+    if (!retval) return NULL;
+    retval = mxDuplicateArray(retval);
+    PERSIST_ARRAY(retval);
+    return retval;
+  }
+  PyObject_converter convert = find_converter(pyobj);
+  if (convert) {
+    mxArray *retval = convert(pyobj);
+    if (retval) PERSIST_ARRAY(retval);
+    return retval;
+  }
+  else {
+    PyObject *utils = pymexutil();
+    if (!utils) return NULL;
+    PyObject *unpyed = PyObject_CallMethod(utils, "unpy", "(O)", pyobj);
+    if (!unpyed) {
+      if (PyErr_ExceptionMatches(PyExc_NotImplementedError)) {
+	PyErr_Clear();
+	return boxb(pyobj);
+      }
+      else return NULL;
+    }
+    if (Py_mxArray_Check(unpyed))
+      return mxArray_Take(unpyed);
+    Py_DECREF(unpyed);
+    return boxb(pyobj);
+  }
+}
+
+/* TODO: Low priority, but this depends on libmex. If we try to make an
+   external module later, this will need to function to some extent.
+   It could operate at low capability by using a hardcoded list for
+   the builtins and assuming that anything else has _object as a super.
+ */
+PyObject *Calculate_matlab_mro(mxArray *mxobj) {
+  mxArray *argin[3];
+  argin[0] = mxobj;
+  argin[1] = mxCreateLogicalScalar(1); /* addvirtual=true */
+  argin[2] = mxCreateLogicalScalar(1); /* autosplit=true */
+  mxArray *argout[1] = {NULL};
+  mxArray *err = mexCallMATLABWithTrap(1, argout, 3, argin, "mro");
+  if (err) return PyObject_CallMethod(mexmodule, "__raiselasterror", "()");
+  else {
+    PyObject *retval = mxCell_to_PyTree(argout[0], CELL_LEAF_WRAP);
+    mxDestroyArray(argout[0]);
+    mxDestroyArray(argin[1]);
+    mxDestroyArray(argin[2]);
+    return retval;
+  }
+}
+
+/* The mro that mro.m would compute for the builtin classes, none of which
+   have superclasses. Returns NULL (without an error) for anything else. */
+static PyObject *Builtin_matlab_mro(const mxArray *mxobj) {
+  const char *classname = mxGetClassName(mxobj);
+  switch (mxGetClassID(mxobj)) {
+  case mxLOGICAL_CLASS:
+  case mxCHAR_CLASS:
+  case mxDOUBLE_CLASS:
+  case mxSINGLE_CLASS:
+  case mxINT8_CLASS:
+  case mxUINT8_CLASS:
+  case mxINT16_CLASS:
+  case mxUINT16_CLASS:
+  case mxINT32_CLASS:
+  case mxUINT32_CLASS:
+  case mxINT64_CLASS:
+  case mxUINT64_CLASS:
+    return Py_BuildValue("((ss)(ss))", "", classname, "", "_numeric");
+  case mxCELL_CLASS:
+  case mxSTRUCT_CLASS:
+  case mxFUNCTION_CLASS:
+    return Py_BuildValue("((ss))", "", classname);
+  default:
+    return NULL;
+  }
+}
+
+/*
+  Resolving a wrapper means running mro.m and then letting
+  pymexutil.findtype __import__ its way down the list, and the answer
+  only depends on the MATLAB class. So mltype_cache maps class names to
+  the class findtype picked, including plain mx.Array when it found
+  nothing better. Builtin classes skip mro.m entirely. FLUSH_CACHES
+  empties this along with the other caches.
+*/
+static PyObject *mltype_cache = NULL;
+
+void Flush_mltype_cache(void) {
+  if (mltype_cache) PyDict_Clear(mltype_cache);
+}
+
+/* Attempts to locate an appropriate subclass of mx.Array 
+   using the mltypes package. If for some reason this fails, 
+   mx.Array is returned instead.
+ */
+PyObject *Find_mltype_for(mxArray *mxobj) {
+  #define GET_MX_ARRAY_CLASS PyObject_GetAttrString(mxmodule, "Array")
+  static PyObject *findtype = NULL;
+  PyObject *newclass, *mrolist, *util;
+  const char *classname = mxGetClassName(mxobj);
+  if (!mltype_cache) mltype_cache = PyDict_New();
+  newclass = PyDict_GetItemString(mltype_cache, classname);
+  if (newclass) {
+    Py_INCREF(newclass);
+    return newclass;
+  }
+  newclass = mrolist = NULL;
+  if (!findtype) {
+    util = PyImport_ImportModule("pymexutil");
+    if (!util) {
+      mexPrintf("failed to import pymexutil\n");
+      PyErr_Clear();
+      return GET_MX_ARRAY_CLASS;
+    }
+    findtype = PyObject_GetAttrString(util, "findtype");
+    Py_DECREF(util);
+    if (!findtype) {
+      mexPrintf("failed to find pymexutil.findtype\n");
+      PyErr_Clear();
+      return GET_MX_ARRAY_CLASS;
+    }
+  }
+  mrolist = Builtin_matlab_mro(mxobj);
+  if (!mrolist) mrolist = Calculate_matlab_mro(mxobj);
+  if (!mrolist) {
+    mexPrintf("failed to get mro list\n");
+    PyErr_Clear();
+    return GET_MX_ARRAY_CLASS;
+  }
+  newclass = PyObject_CallFunctionObjArgs(findtype, mrolist, NULL);
+  Py_DECREF(mrolist);
+  if (!newclass) {
+    mexPrintf("failed to call _findtype\n");
+    PyErr_Clear();
+    return GET_MX_ARRAY_CLASS;
+  }
+  PyDict_SetItemString(mltype_cache, classname, newclass);
+  return newclass;
+}
+
+/* Builds the mltypes wrapper around an mxArrayPtr. */
+static PyObject *Py_mxArray_Wrap(PyObject *mxptr, mxArray *mxobj) {
+  PyObject *arraycls = Find_mltype_for(mxobj);
+  if (!arraycls) return NULL;
   PyObject *args = PyTuple_New(0);
   PyObject *kwargs = PyDict_New();
   PyDict_SetItemString(kwargs, "mxpointer", mxptr);
-  PyObject *arraycls = Find_mltype_for(copy);
   /* TODO: There is probably a better way to do this... */
   PyObject *ret = PyObject_Call(arraycls, args, kwargs);
   Py_DECREF(args);
   Py_DECREF(kwargs);
-  Py_DECREF(mxptr);
   Py_DECREF(arraycls);
   return ret;
 }
 
+PyObject *Py_mxArray_New(mxArray *mxobj, bool duplicate) {
+  mxArray *copy;
+  if (duplicate) {
+    copy = mxDuplicateArray(mxobj);
+    mexMakeArrayPersistent(copy);
+  }
+  else {
+    copy = mxobj;
+  }
+  PyObject *mxptr = mxArrayPtr_New(copy);
+  if (!mxptr) return NULL;
+  PyObject *ret = Py_mxArray_Wrap(mxptr, copy);
+  Py_DECREF(mxptr);
+  return ret;
+}
+
 int Py_mxArray_Check(PyObject *pyobj) {
-  return PyObject_IsInstance(pyobj, PyObject_GetAttrString(mxmodule, "Array"));
+  static PyObject *arraycls = NULL;
+  if (!arraycls) arraycls = PyObject_GetAttrString(mxmodule, "Array");
+  return PyObject_TypeCheck(pyobj, (PyTypeObject *) arraycls);
 }
 
 mxArray *PyObject_to_mxDouble(PyObject *pyobj) {
@@ -407,25 +2641,191 @@ mxArray *PyObject_to_mxDouble(PyObject *pyobj) {
   return mxval;
 }
 
+/* int64 when it fits, uint64 for the big positive ones that fit there,
+   and double for anything bigger still. */
 mxArray *PyObject_to_mxLong(PyObject *pyobj) {
-  long val = PyLong_AsLong(pyobj);
-  if (PyErr_Occurred()) return NULL;
-  /* there is no mxCreateNumericScalar */
-  mxArray *mxval = mxCreateNumericMatrix(1, 1, mxINT64_CLASS, mxREAL);
-  PERSIST_ARRAY(mxval);
-  long* ptr = (long*) mxGetData(mxval);
-  ptr[0] = val;
+  size_t bits = _PyLong_NumBits(pyobj);
+  if (bits == (size_t) -1 && PyErr_Occurred()) return NULL;
+  mxClassID mxclass = bits < 64 ? mxINT64_CLASS
+    : bits == 64 && _PyLong_Sign(pyobj) > 0 ? mxUINT64_CLASS
+    : mxDOUBLE_CLASS;
+  mxArray *mxval = PyObject_to_mxScalar(pyobj, mxclass);
+  if (mxval) PERSIST_ARRAY(mxval);
   return mxval;
 }
 
+/* A 1x1 array of any numeric class, logical or char, holding exactly
+   what PyObject_to_mxElement makes of pyobj. */
+mxArray *PyObject_to_mxScalar(PyObject *pyobj, mxClassID mxclass) {
+  mwSize one[2] = {1, 1};
+  mxArray *scalar;
+  if (mxclass == mxLOGICAL_CLASS)
+    scalar = mxCreateLogicalArray(2, one);
+  else if (mxclass == mxCHAR_CLASS)
+    scalar = mxCreateCharArray(2, one);
+  else if (mxClassID_to_Numpy_Typekind(mxclass) != 'V')
+    scalar = mxCreateNumericArray(2, one, mxclass, mxREAL);
+  else {
+    PyErr_Format(PyExc_TypeError, "Can't make a scalar of class %d", (int) mxclass);
+    return NULL;
+  }
+  if (!PyObject_to_mxElement(pyobj, scalar, 0)) {
+    mxDestroyArray(scalar);
+    return NULL;
+  }
+  return scalar;
+}
+
 mxArray *PyObject_to_mxLogical(PyObject *pyobj) {
   return mxCreateLogicalScalar(PyObject_IsTrue(pyobj));
 }
 
+/* The class called name ('double', 'cell', ...), or mxUNKNOWN_CLASS. */
+mxClassID mxClassID_from_name(const char *name) {
+  static const struct {
+    const char *name;
+    mxClassID id;
+  } classes[] = {
+    {"double", mxDOUBLE_CLASS}, {"single", mxSINGLE_CLASS},
+    {"logical", mxLOGICAL_CLASS}, {"char", mxCHAR_CLASS},
+    {"int8", mxINT8_CLASS}, {"uint8", mxUINT8_CLASS},
+    {"int16", mxINT16_CLASS}, {"uint16", mxUINT16_CLASS},
+    {"int32", mxINT32_CLASS}, {"uint32", mxUINT32_CLASS},
+    {"int64", mxINT64_CLASS}, {"uint64", mxUINT64_CLASS},
+    {"cell", mxCELL_CLASS}, {"struct", mxSTRUCT_CLASS},
+    {NULL, mxUNKNOWN_CLASS}
+  };
+  int i;
+  for (i=0; classes[i].name; i++)
+    if (!strcmp(classes[i].name, name)) break;
+  return classes[i].id;
+}
+
+/* Element i of a real numeric, logical or char array, as a Python
+   scalar of the matching kind. */
+PyObject *mxElement_to_PyObject(const mxArray *mxobj, mwIndex i) {
+  const void *data = mxGetData(mxobj);
+  switch (mxGetClassID(mxobj)) {
+  case mxDOUBLE_CLASS: return PyFloat_FromDouble(((const double *) data)[i]);
+  case mxSINGLE_CLASS: return PyFloat_FromDouble(((const float *) data)[i]);
+  case mxLOGICAL_CLASS: return PyBool_FromLong(((const mxLogical *) data)[i]);
+  case mxINT8_CLASS: return PyInt_FromLong(((const int8_t *) data)[i]);
+  case mxUINT8_CLASS: return PyInt_FromLong(((const uint8_t *) data)[i]);
+  case mxINT16_CLASS: return PyInt_FromLong(((const int16_t *) data)[i]);
+  case mxUINT16_CLASS: return PyInt_FromLong(((const uint16_t *) data)[i]);
+  case mxINT32_CLASS: return PyInt_FromLong(((const int32_t *) data)[i]);
+  case mxUINT32_CLASS: return PyLong_FromUnsignedLong(((const uint32_t *) data)[i]);
+  case mxINT64_CLASS: return PyLong_FromLongLong(((const int64_t *) data)[i]);
+  case mxUINT64_CLASS: return PyLong_FromUnsignedLongLong(((const uint64_t *) data)[i]);
+  case mxCHAR_CLASS: {
+    mxChar c = ((const mxChar *) data)[i];
+    if (c < 128) {
+      char narrow = (char) c;
+      return PyBytes_FromStringAndSize(&narrow, 1);
+    }
+    Py_UNICODE wide = c;
+    return PyUnicode_FromUnicode(&wide, 1);
+  }
+  default:
+    return PyErr_Format(PyExc_TypeError, "Can't take elements of a %s array",
+			mxGetClassName(mxobj));
+  }
+}
+
+#define STORE_INTEGER(type, lo, hi)					\
+  do {									\
+    PY_LONG_LONG v = PyLong_AsLongLong(num);				\
+    if (v == -1 && PyErr_Occurred()) break;				\
+    ((type *) data)[i] = v < (lo) ? (lo) : v > (hi) ? (hi) : (type) v;	\
+    ok = true;								\
+  } while (0)
+
+/*
+  Stores pyobj as element i of a real numeric, logical or char array.
+  Integer classes round and saturate like MATLAB's own conversions do
+  (except that 64 bit overflow is an OverflowError), and a char element
+  takes either a one-character string or a code point. Other strings
+  aren't numbers, and raise TypeError.
+*/
+bool PyObject_to_mxElement(PyObject *pyobj, mxArray *mxobj, mwIndex i) {
+  void *data = mxGetData(mxobj);
+  mxClassID mxclass = mxGetClassID(mxobj);
+  PyObject *num = NULL;
+  bool ok = false;
+  double d;
+  switch (mxclass) {
+  case mxDOUBLE_CLASS:
+  case mxSINGLE_CLASS:
+    d = PyFloat_AsDouble(pyobj);
+    if (d == -1 && PyErr_Occurred()) return false;
+    if (mxclass == mxDOUBLE_CLASS) ((double *) data)[i] = d;
+    else ((float *) data)[i] = (float) d;
+    return true;
+  case mxLOGICAL_CLASS: {
+    int truth = PyObject_IsTrue(pyobj);
+    if (truth < 0) return false;
+    ((mxLogical *) data)[i] = truth;
+    return true;
+  }
+  case mxCHAR_CLASS:
+    if (PyBytes_Check(pyobj) && PyBytes_GET_SIZE(pyobj) == 1) {
+      ((mxChar *) data)[i] = (unsigned char) PyBytes_AS_STRING(pyobj)[0];
+      return true;
+    }
+    if (PyUnicode_Check(pyobj) && PyUnicode_GET_SIZE(pyobj) == 1) {
+      ((mxChar *) data)[i] = (mxChar) PyUnicode_AS_UNICODE(pyobj)[0];
+      return true;
+    }
+    break;
+  default:
+    break;
+  }
+  if (PyBytes_Check(pyobj) || PyUnicode_Check(pyobj)) {
+    PyErr_Format(PyExc_TypeError, "Can't store a string in a %s array",
+		 mxGetClassName(mxobj));
+    return false;
+  }
+  if (PyFloat_Check(pyobj)) {
+    /* As MATLAB does it: round half away from zero, NaN is 0, and the
+       infinities saturate. */
+    d = PyFloat_AS_DOUBLE(pyobj);
+    if (d != d) d = 0;
+    else if (d > 1e19 || d < -1e19) d = d > 0 ? 1e19 : -1e19;
+    num = PyLong_FromDouble(d < 0 ? d - 0.5 : d + 0.5); /* which truncates */
+  }
+  else
+    num = PyNumber_Long(pyobj);
+  if (!num) return false;
+  switch (mxclass) {
+  case mxINT8_CLASS: STORE_INTEGER(int8_t, INT8_MIN, INT8_MAX); break;
+  case mxUINT8_CLASS: STORE_INTEGER(uint8_t, 0, UINT8_MAX); break;
+  case mxINT16_CLASS: STORE_INTEGER(int16_t, INT16_MIN, INT16_MAX); break;
+  case mxUINT16_CLASS: STORE_INTEGER(uint16_t, 0, UINT16_MAX); break;
+  case mxCHAR_CLASS: STORE_INTEGER(mxChar, 0, UINT16_MAX); break;
+  case mxINT32_CLASS: STORE_INTEGER(int32_t, INT32_MIN, INT32_MAX); break;
+  case mxUINT32_CLASS: STORE_INTEGER(uint32_t, 0, UINT32_MAX); break;
+  case mxINT64_CLASS: STORE_INTEGER(int64_t, INT64_MIN, INT64_MAX); break;
+  case mxUINT64_CLASS: {
+    unsigned PY_LONG_LONG v = _PyLong_Sign(num) < 0 ? 0 : PyLong_AsUnsignedLongLong(num);
+    if (v != (unsigned PY_LONG_LONG) -1 || !PyErr_Occurred()) {
+      ((uint64_t *) data)[i] = v;
+      ok = true;
+    }
+    break;
+  }
+  default:
+    PyErr_Format(PyExc_TypeError, "Can't store elements in a %s array",
+		 mxGetClassName(mxobj));
+  }
+  Py_DECREF(num);
+  return ok;
+}
+#undef STORE_INTEGER
+
 char mxClassID_to_Numpy_Typekind(mxClassID mxclass) {
   switch (mxclass) {
   case mxLOGICAL_CLASS: return 'b';
-  case mxCHAR_CLASS: return 'S';
+  case mxCHAR_CLASS: return 'u'; /* UTF-16 code units */
   case mxINT8_CLASS: 
   case mxINT16_CLASS: 
   case mxINT32_CLASS: 
@@ -440,7 +2840,18 @@ char mxClassID_to_Numpy_Typekind(mxClassID mxclass) {
   }
 }
 
-mxArray *mxArrayPtr(PyObject *pyobj) {
+/*
+  An mxArrayPtr is a PyCObject whose description is mxmodule. Its void
+  pointer doesn't point at the mxArray itself but at an mxArrayRef, so
+  that the array can later be detached (handed over to MATLAB without a
+  copy) while the CObject lives on.
+*/
+typedef struct {
+  mxArray *array;
+  bool borrowed; /* array belongs to the caller of the current command */
+} mxArrayRef;
+
+static mxArrayRef *mxArrayPtr_Ref(PyObject *pyobj) {
   PyObject *ptr;
   if (PyCObject_Check(pyobj)) {
     ptr = pyobj;
@@ -453,22 +2864,285 @@ mxArray *mxArrayPtr(PyObject *pyobj) {
     PyErr_Format(PyExc_RuntimeError, "mxptr desc does not match mxmodule");
     return NULL;
   }
-  return (mxArray *) PyCObject_AsVoidPtr(ptr);
+  return (mxArrayRef *) PyCObject_AsVoidPtr(ptr);
+}
+
+/* The array, or NULL with an error set if there isn't one any more. */
+mxArray *mxArrayPtr(PyObject *pyobj) {
+  mxArrayRef *ref = mxArrayPtr_Ref(pyobj);
+  if (ref && !ref->array)
+    PyErr_Format(PyExc_ValueError, "mxArray has already been handed over");
+  return ref ? ref->array : NULL;
 }
 
-static void _mxArrayPtr_destructor(void *mxobj, void *desc) {
+static void _mxArrayPtr_destructor(void *ref, void *desc) {
   Py_XDECREF((PyObject *) desc);  
-  if (mxobj) mxDestroyArray((mxArray *) mxobj);
+  mxArray *mxobj = ((mxArrayRef *) ref)->array;
+  if (mxobj && !((mxArrayRef *) ref)->borrowed) mxDestroyArray(mxobj);
+  PyMem_Free(ref);
 }
 
 PyObject *mxArrayPtr_New(mxArray *mxobj) {
   if (!mxmodule)
     return PyErr_Format(PyExc_RuntimeError, "mxmodule not yet initialized");
+  mxArrayRef *ref = PyMem_New(mxArrayRef, 1);
+  if (!ref) return PyErr_NoMemory();
+  ref->array = mxobj;
+  ref->borrowed = false;
   PERSIST_ARRAY(mxobj);
   Py_INCREF(mxmodule);
-  return PyCObject_FromVoidPtrAndDesc(mxobj, mxmodule, _mxArrayPtr_destructor);
+  return PyCObject_FromVoidPtrAndDesc(ref, mxmodule, _mxArrayPtr_destructor);
 }
 
 int mxArrayPtr_Check(PyObject *obj) {
   return (obj && PyCObject_Check(obj) && PyCObject_GetDesc(obj) == mxmodule);
 }
+
+/* Gets the mxArray out of an mx.Array (or bare mxArrayPtr) that we're
+   done with, stealing the reference. If nothing else can see the wrapper
+   or its mxptr, the array is detached and returned as is; otherwise it
+   has to be copied. Either way the result belongs to the caller. */
+mxArray *mxArray_Take(PyObject *pyobj) {
+  PyObject *cobj = mxArrayPtr_Check(pyobj) ? pyobj : ((mxArrayObject *) pyobj)->mxptr;
+  mxArrayRef *ref = mxArrayPtr_Ref(pyobj);
+  mxArray *retval = NULL;
+  if (ref && ref->array) {
+    bool shared = ref->borrowed || (cobj != pyobj
+      ? (pyobj->ob_refcnt > 1 || cobj->ob_refcnt > 1)
+      : cobj->ob_refcnt > 1);
+    if (shared) {
+      retval = mxDuplicateArray(ref->array);
+      PERSIST_ARRAY(retval);
+    }
+    else {
+      retval = ref->array;
+      ref->array = NULL;
+    }
+  }
+  else if (ref) {
+    PyErr_Format(PyExc_ValueError, "mxArray has already been handed over");
+  }
+  Py_DECREF(pyobj);
+  return retval;
+}
+
+/*
+  Borrowed views. Copying every array argument before Python sees it
+  costs as much as the data is big, and most of the time Python only
+  reads it and lets go. So command arguments (see unboxv) can instead be
+  wrapped as they are: the wrapper points at the caller's mxArray, is
+  read-only, and is listed in borrowed_views. When the command is done,
+  Release_views looks at each one. If Python let go of it, nothing was
+  ever copied. If Python kept it, it gets a persistent copy of its own
+  and carries on as a normal array. Modifying a view through the mx.Array
+  methods copies it then and there (see mxArray_Writable), and so does
+  exporting its data as a buffer or __array_struct__, since those can
+  outlive the command.
+
+  A view is only good while the caller's array is. Nothing between
+  making views and Release_views may mexErrMsg out of the command.
+*/
+static PyObject *borrowed_views = NULL;
+
+static PyObject *Py_mxArray_View(const mxArray *mxobj) {
+  PyObject *view = NULL;
+  mxArrayRef *ref = NULL;
+  if (!borrowed_views && !(borrowed_views = PyList_New(0))) goto fail;
+  if (!(ref = PyMem_New(mxArrayRef, 1))) {
+    PyErr_NoMemory();
+    goto fail;
+  }
+  ref->array = (mxArray *) mxobj;
+  ref->borrowed = true;
+  Py_INCREF(mxmodule);
+  PyObject *mxptr = PyCObject_FromVoidPtrAndDesc(ref, mxmodule, _mxArrayPtr_destructor);
+  if (!mxptr) {
+    Py_DECREF(mxmodule);
+    PyMem_Free(ref);
+    goto fail;
+  }
+  view = Py_mxArray_Wrap(mxptr, ref->array);
+  Py_DECREF(mxptr);
+  if (view && !Py_mxArray_Check(view)) {
+    /* Can't keep track of it, so it can't keep the caller's array. */
+    Py_DECREF(view);
+    return Py_mxArray_New((mxArray *) mxobj, 1);
+  }
+  /* ref is borrowed, so dropping the view leaves mxobj alone. */
+  if (!view || PyList_Append(borrowed_views, view) < 0) {
+    Py_CLEAR(view);
+    goto fail;
+  }
+  ((mxArrayObject *) view)->readonly = true;
+  return view;
+ fail:
+  return NULL;
+}
+
+/* Where borrowed_views stands at the start of a command. */
+Py_ssize_t Views_mark(void) {
+  return borrowed_views ? PyList_GET_SIZE(borrowed_views) : 0;
+}
+
+/* Keeps owner alive, and read-only, until the views made after it are
+   released, for views of arrays that owner holds: changing it could
+   destroy them. It's listed in a 1-tuple so Release_views can tell it
+   from the views. */
+bool Views_keep(PyObject *owner) {
+  if (!borrowed_views && !(borrowed_views = PyList_New(0))) return false;
+  PyObject *entry = PyTuple_Pack(1, owner);
+  if (!entry || PyList_Append(borrowed_views, entry) < 0) {
+    Py_XDECREF(entry);
+    return false;
+  }
+  Py_DECREF(entry);
+  ((mxArrayObject *) owner)->views++;
+  return true;
+}
+
+/* Ends the borrowing for views made since mark. */
+void Release_views(Py_ssize_t mark) {
+  if (!borrowed_views) return;
+  Py_ssize_t i, n = PyList_GET_SIZE(borrowed_views);
+  for (i=mark; i<n; i++) {
+    PyObject *entry = PyList_GET_ITEM(borrowed_views, i);
+    if (PyTuple_Check(entry)) {	/* an owner, from Views_keep */
+      ((mxArrayObject *) PyTuple_GET_ITEM(entry, 0))->views--;
+      continue;
+    }
+    mxArrayObject *view = (mxArrayObject *) entry;
+    mxArrayRef *ref = (mxArrayRef *) PyCObject_AsVoidPtr(view->mxptr);
+    if (!ref->borrowed) continue; /* already copied on write */
+    if (view->ob_refcnt > 1 || view->mxptr->ob_refcnt > 1) {
+      mxArray *copy = mxDuplicateArray(ref->array);
+      PERSIST_ARRAY(copy);
+      ref->array = copy;
+      view->readonly = view->shared;
+    }
+    else
+      ref->array = NULL;
+    ref->borrowed = false;
+  }
+  if (n > mark) PyList_SetSlice(borrowed_views, mark, n, NULL);
+}
+
+/* Returns an array that's safe to modify in place. A borrowed view gets
+   its own copy first, which can't be done while buffers of the caller's
+   data are out. An array with views of its contents out (see Views_keep)
+   can't be modified at all until they're released, and one that stands
+   for several cells of a tree can't be modified ever. */
+mxArray *mxArray_Writable(PyObject *pyobj) {
+  mxArrayRef *ref = mxArrayPtr_Ref(pyobj);
+  if (!ref) return NULL;
+  mxArrayObject *view = mxArrayPtr_Check(pyobj) ? NULL : (mxArrayObject *) pyobj;
+  if (!ref->array) {
+    PyErr_Format(PyExc_ValueError, "mxArray has already been handed over");
+    return NULL;
+  }
+  if (view && view->shared) {
+    PyErr_Format(PyExc_ValueError, "mxArray is read-only: it stands for several cells of a tree");
+    return NULL;
+  }
+  if (view && view->views) {
+    PyErr_Format(PyExc_ValueError, "mxArray is read-only while views of its contents are in use");
+    return NULL;
+  }
+  if (ref->borrowed) {
+    if (view && view->exports) {
+      PyErr_Format(PyExc_ValueError, "Borrowed mxArray is read-only while its buffers are in use");
+      return NULL;
+    }
+    mxArray *copy = mxDuplicateArray(ref->array);
+    PERSIST_ARRAY(copy);
+    ref->array = copy;
+    ref->borrowed = false;
+    if (view) view->readonly = false;
+  }
+  return ref->array;
+}
+
+/*
+  The guts of MAP: calls fn on every element of input (axis 0) or on
+  every slice along dimension axis, and collects the results in an
+  array of class outclass, or a cell of boxed objects for mxCELL_CLASS.
+  Elements of numeric arrays go over as Python scalars and cell contents
+  as by unboxv. Each slice is copied into an array of its own, since fn
+  may keep it (or a NumPy view of it); cell contents borrowed by unboxv
+  are released after every call. With yield set, other Python threads
+  get a chance to run between items. Returns NULL with a Python error
+  set on failure.
+*/
+mxArray *Map_array(PyObject *fn, const mxArray *input, mwSize axis,
+		   mxClassID outclass, bool yield) {
+  mwSize nd = mxGetNumberOfDimensions(input);
+  const mwSize *dims = mxGetDimensions(input);
+  mwSize ndout = axis > nd ? axis : nd;
+  mwSize outdims[ndout], slicedims[ndout];
+  mwSize k, i, o, count, inner = 1, outer = 1;
+  size_t elsize = mxGetElementSize(input);
+  for (k=0; k<ndout; k++) {
+    mwSize dim = k < nd ? dims[k] : 1;
+    outdims[k] = axis == 0 || k == axis-1 ? dim : 1;
+    slicedims[k] = k == axis-1 ? 1 : dim;
+    if (axis && k < axis-1) inner *= dim;
+    if (axis && k > axis-1) outer *= dim;
+  }
+  count = axis ? outdims[axis-1] : mxGetNumberOfElements(input);
+  mxArray *out;
+  if (outclass == mxCELL_CLASS)
+    out = mxCreateCellArray(ndout, outdims);
+  else if (outclass == mxLOGICAL_CLASS)
+    out = mxCreateLogicalArray(ndout, outdims);
+  else if (outclass == mxCHAR_CLASS)
+    out = mxCreateCharArray(ndout, outdims);
+  else
+    out = mxCreateNumericArray(ndout, outdims, outclass, mxREAL);
+  const char *src = (const char *) mxGetData(input);
+  for (i=0; i<count; i++) {
+    Py_ssize_t mark = Views_mark();
+    PyObject *item;
+    if (mxIsCell(input)) {
+      const mxArray *cell = mxGetCell(input, i);
+      item = cell ? unboxv(cell) : Py_mxArray_New(mxCreateDoubleMatrix(0,0,mxREAL), false);
+    }
+    else if (!axis) {
+      item = mxElement_to_PyObject(input, i);
+    }
+    else {
+      size_t run = inner * elsize;
+      mxArray *slice;
+      if (mxIsLogical(input))
+	slice = mxCreateLogicalArray(ndout, slicedims);
+      else if (mxIsChar(input))
+	slice = mxCreateCharArray(ndout, slicedims);
+      else
+	slice = mxCreateNumericArray(ndout, slicedims, mxGetClassID(input), mxREAL);
+      char *dst = (char *) mxGetData(slice);
+      for (o=0; o<outer; o++)
+	memcpy(dst + o * run, src + (o * count + i) * run, run);
+      item = Py_mxArray_New(slice, false);
+    }
+    PyObject *result = item ? PyObject_CallFunctionObjArgs(fn, item, NULL) : NULL;
+    Py_XDECREF(item);
+    Release_views(mark);
+    if (!result) goto fail;
+    if (outclass == mxCELL_CLASS) {
+      mxArray *boxed = box(result);
+      if (!boxed) goto fail;
+      mxSetCell(out, i, boxed);
+    }
+    else {
+      bool stored = PyObject_to_mxElement(result, out, i);
+      Py_DECREF(result);
+      if (!stored) goto fail;
+    }
+    if (yield && PyEval_ThreadsInitialized()) {
+      Py_BEGIN_ALLOW_THREADS
+      Py_END_ALLOW_THREADS
+    }
+  }
+  return out;
+ fail:
+  mxDestroyArray(out);
+  return NULL;
+}
@@ -62,6 +62,69 @@ def test_negative_array():
     '''
     bare_array((-1,))
 
+def scalar_roundtrip(value, mxclass):
+    scalar = mx.create_scalar(value, mxclass, wrap=True)
+    assert_equal(long(scalar), value)
+
+def test_scalar_roundtrip():
+    '''
+    Test that integer scalars keep every bit of their value
+    '''
+    yield scalar_roundtrip, -2**63, mx.INT64
+    yield scalar_roundtrip, 2**63 - 1, mx.INT64
+    yield scalar_roundtrip, 2**64 - 1, mx.UINT64
+    yield scalar_roundtrip, -128, mx.INT8
+    yield scalar_roundtrip, 65535, mx.UINT16
+    yield scalar_roundtrip, 1, mx.LOGICAL
+
+@raises(OverflowError)
+def test_scalar_overflow():
+    '''
+    Test that uint64 doesn't silently wrap
+    '''
+    mx.create_scalar(2**64, mx.UINT64)
+
+def test_int_subclass_widens():
+    '''
+    Test that int and long subclasses get the class exact ones would
+    '''
+    import pymexutil
+    class myint(int): pass
+    class mylong(long): pass
+    for value, mxclass in [(myint(7), mx.INT32), (myint(2**40), mx.INT64),
+                           (mylong(7), mx.INT64), (mylong(2**64 - 1), mx.UINT64),
+                           (mylong(2**70), mx.DOUBLE)]:
+        scalar = pymexutil.unpy(value)
+        eq_(scalar._get_class_id(), mxclass)
+        eq_(long(scalar), value)
+
+def test_strings_roundtrip():
+    '''
+    Test that lists of strings go to cellstrs and char matrices and back
+    '''
+    strings = ['alpha', '', 'a somewhat longer label', 'caf\xc3\xa9']
+    cell = mx.create_cellstr(strings, wrap=True)
+    eq_(cell.tostrings(), strings)
+    chars = mx.create_char_matrix(strings, wrap=True)
+    eq_(chars._get_dimensions(), (4, 23))
+    eq_(chars.tostrings(strip=True), strings)
+    eq_(len(chars.tostrings()[0]), 23)
+
+def test_map_roundtrip():
+    '''
+    Test that dicts go to containers.Map and back in bulk
+    '''
+    from mltypes.containers import Map
+    d = dict(('key%d' % i, float(i)) for i in range(10))
+    d['label'] = 'text'
+    m = Map.fromdict(d)
+    eq_(len(m), 11)
+    eq_(m.todict(), d)
+    eq_(dict(m.iteritems(chunk=3)), d)
+    n = Map.fromdict({1: 'one', 2.5: 'two and a half'})
+    eq_(n.todict(), {1.0: 'one', 2.5: 'two and a half'})
+    eq_(Map.fromdict({}).todict(), {})
+
 def bare_struct(dims):
     return mx.create_struct_array(dims, wrap=False)
 
@@ -259,6 +322,41 @@ class Test_Struct(Test_mxArray):
         val = self.obj._get_field(fieldname='foo',
                                      index=1)
         eq_(val._get_number_of_elements(),0)
+    def test_setfield_tree(self):
+        '''
+        _set_field converts nested dicts and lists to structs and cells
+        '''
+        tree = {'name': 'cfg', 'items': [{'x': 'p'}, {'x': 'q'}],
+                'misc': ['a', {1: 2}]}
+        self.obj._set_field(fieldname='foo', value=tree, index=0)
+        val = self.obj._get_field(fieldname='foo', index=0)
+        eq_(val._get_field(fieldname='name', index=0), 'cfg')
+        items = val._get_field(fieldname='items', index=0)
+        eq_(items._get_number_of_elements(), 2)
+        eq_(items._get_field(fieldname='x', index=1), 'q')
+        misc = val._get_field(fieldname='misc', index=0)
+        eq_(misc._get_number_of_elements(), 2)
+    def test_setfield_unicode_keys(self):
+        '''
+        _set_field takes ASCII unicode keys as field names, and boxes others
+        '''
+        tree = {u'name': 'cfg', 'items': [{u'x': 1}, {'x': 2}]}
+        self.obj._set_field(fieldname='foo', value=tree, index=0)
+        val = self.obj._get_field(fieldname='foo', index=0)
+        eq_(val._get_field(fieldname='name', index=0), 'cfg')
+        items = val._get_field(fieldname='items', index=0)
+        eq_(items._get_number_of_elements(), 2)
+        self.obj._set_field(fieldname='foo', value={u'caf\xe9': 1}, index=0)
+        val = self.obj._get_field(fieldname='foo', index=0)
+        eq_(val, {u'caf\xe9': 1})
+    @raises(ValueError)
+    def test_setfield_cycle(self):
+        '''
+        _set_field rejects dicts that contain themselves
+        '''
+        tree = {'a': []}
+        tree['a'].append(tree)
+        self.obj._set_field(fieldname='foo', value=tree, index=0)
     @raises(KeyError)
     def test_missingfield(self):
         '''
@@ -441,3 +539,225 @@ class Test_CVPartition(Test_mxArray):
         raise SkipTest, "No way to determine property set failure"
         self.obj._set_property('N', 42)
 
+
+# pymex commands, called back into through mex.call.
+
+def pymex(*args, **kwargs):
+    import mex
+    return mex.call('pymex', *args, **kwargs)
+
+def opcode(name):
+    return float(pymex('OPCODE', name))
+
+def matlab_error_id(func, *args, **kwargs):
+    try:
+        func(*args, **kwargs)
+    except mx.MATLABError, e:
+        return e.args[0]
+    raise AssertionError('no MATLAB error raised')
+
+def test_batch():
+    '''
+    Test that BATCH runs its ops over the registers and returns outputs
+    '''
+    ops = [[opcode('GET_ATTR'), 3, 1, 2],
+           [opcode('CALL'), 4, 3, 0]]
+    eq_(pymex('BATCH', ops, ['abc', 'upper'], [4.], True), 'ABC')
+    upper, lower = pymex('BATCH', ops, ['abc', 'upper'], [4., 1.], True, nargout=2)
+    eq_((upper, lower), ('ABC', 'abc'))
+
+def test_batch_errors():
+    '''
+    Test that BATCH reports bad programs and stops at Python errors
+    '''
+    get_attr = opcode('GET_ATTR')
+    eq_(matlab_error_id(pymex, 'BATCH', [[get_attr, 2, 1, 1]], ['abc'], [2.]),
+        'Python:AttributeError')
+    eq_(matlab_error_id(pymex, 'BATCH', [[get_attr, 2, 1, 3]], ['abc'], [2.]),
+        'Python:ValueError')
+    eq_(matlab_error_id(pymex, 'BATCH', [[get_attr, 2, 1, 2]], ['abc'], [2.]),
+        'Python:ValueError')
+    eq_(matlab_error_id(pymex, 'BATCH', [[5., 2, 1, 1]], ['abc'], [2.]),
+        'Python:ValueError')
+    eq_(matlab_error_id(pymex, 'BATCH', [[get_attr, 2, 1, 1]], 'abc', [2.]),
+        'pymex:BATCH:badregs')
+    eq_(matlab_error_id(pymex, 'BATCH', [[get_attr, 2, 1, 1]], ['abc'], [2.], nargout=2),
+        'pymex:BATCH:nargout')
+
+class _Thing(object):
+    def __init__(self):
+        self.items = {'a': [10, 20, 30]}
+    def pair(self, x, y='why'):
+        return (x, y)
+
+def test_subsref_chain():
+    '''
+    Test that SUBSREF follows a whole chain and unpacks for nargout
+    '''
+    from matlab import substruct
+    thing = _Thing()
+    out = pymex('SUBSREF', thing, substruct('.', 'items', '{}', ['a']))
+    assert_true(out[0] is thing.items['a'])
+    out = pymex('SUBSREF', thing, substruct('.', 'pair', '()', ['x', 'y']), 2.)
+    eq_(len(out), 2)
+    eq_((out[0], out[1]), ('x', 'y'))
+    out = pymex('SUBSREF', thing, substruct('.', 'items', '.', 'clear', '()', []), 0.)
+    eq_(len(out), 0)
+    eq_(thing.items, {})
+
+def test_subsasgn_chain():
+    '''
+    Test that SUBSASGN sets attributes and items at the end of a chain
+    '''
+    from matlab import substruct
+    thing = _Thing()
+    pymex('SUBSASGN', thing, substruct('.', 'name'), 'bob')
+    eq_(thing.name, 'bob')
+    pymex('SUBSASGN', thing, substruct('.', 'items', '{}', ['b']), 'bee')
+    eq_(thing.items['b'], 'bee')
+
+def test_subs_errors():
+    '''
+    Test that bad subsref and subsasgn chains raise the right errors
+    '''
+    from matlab import substruct
+    thing = _Thing()
+    eq_(matlab_error_id(pymex, 'SUBSREF', thing, substruct('.', 'nothing')),
+        'Python:AttributeError')
+    eq_(matlab_error_id(pymex, 'SUBSREF', thing, substruct('.', 'items', '{}', ['z'])),
+        'Python:KeyError')
+    eq_(matlab_error_id(pymex, 'SUBSASGN', thing, substruct('.', 'pair', '()', []), 1.),
+        'Python:TypeError')
+    eq_(matlab_error_id(pymex, 'SUBSREF', thing, 'items'),
+        'pymex:SUBSREF:badS')
+
+def test_call_kwargs():
+    '''
+    Test that CALL takes keyword arguments from kw objects and cells
+    '''
+    from matlab import kw
+    thing = _Thing()
+    args = mx.create_cell_array((1, 2), wrap=True)
+    args[0] = 'x'
+    args[1] = kw('y', 'kw')
+    eq_(pymex('CALL', thing.pair, args), ('x', 'kw'))
+    eq_(pymex('CALL', thing.pair, ['x'], ['y', 'cell']), ('x', 'cell'))
+    eq_(pymex('CALL', thing.pair, ['x'], kw('y', 'array')), ('x', 'array'))
+    eq_(pymex('CALL', thing.pair, ['x'], []), ('x', 'why'))
+    eq_(pymex('CALL', thing.pair, ['x'], [], nargout=2), ('x', 'why'))
+    eq_(pymex('CALL', thing.pair, ['x'], [], True).tostrings(), ['x', 'why'])
+
+def test_call_kept_arguments():
+    '''
+    Test that array arguments Python keeps outlive the CALL
+    '''
+    import mex
+    thing = _Thing()
+    args = mx.create_cell_array((1, 1), wrap=True)
+    args[0] = 2.5
+    kept, _ = pymex('CALL', thing.pair, args)
+    eq_(float(kept), 2.5)
+    eq_(float(mex.call('plus', kept, 1.)), 3.5)
+
+def test_call_kwargs_errors():
+    '''
+    Test that CALL rejects bad keyword specs and passes on TypeErrors
+    '''
+    thing = _Thing()
+    eq_(matlab_error_id(pymex, 'CALL', thing.pair, ['x'], ['y']),
+        'python:NoKWargs')
+    eq_(matlab_error_id(pymex, 'CALL', thing.pair, ['x'], ['z', 1.]),
+        'Python:TypeError')
+
+def isequal(a, b):
+    import mex
+    return float(mex.call('isequal', a, b)) == 1
+
+def test_map():
+    '''
+    Test that MAP collects results over elements, slices and cells
+    '''
+    import mex
+    doubled = pymex('MAP', lambda x: x * 2, [1., 2., 3.], 0., 'double')
+    assert_true(isequal(doubled, [2., 4., 6.]))
+    sums = pymex('MAP', lambda s: float(mex.call('sum', s)), [[1., 2.], [3., 4.]], 1., 'int32')
+    eq_(mex.call('class', sums), 'int32')
+    assert_true(isequal(sums, [[3.], [7.]]))
+    boxed = pymex('MAP', lambda x: str(x), ['ab', 'cd'], 0., 'cell')
+    eq_((boxed[0], boxed[1]), ('ab', 'cd'))
+
+def test_map_kept_items():
+    '''
+    Test that slices and cell contents MAP hands out can be kept
+    '''
+    kept = []
+    keep = lambda x: kept.append(x) or 0
+    pymex('MAP', keep, [[1., 2.], [3., 4.]], 2., 'double')
+    cells = mx.create_cell_array((1, 2), wrap=True)
+    cells[0] = 1.5
+    cells[1] = 2.5
+    pymex('MAP', keep, cells, 0., 'double')
+    eq_(len(kept), 4)
+    assert_true(isequal(kept[0], [[1.], [3.]]))
+    assert_true(isequal(kept[1], [[2.], [4.]]))
+    eq_((float(kept[2]), float(kept[3])), (1.5, 2.5))
+
+def test_map_errors():
+    '''
+    Test that MAP checks its arguments and what fn gives back
+    '''
+    eq_(matlab_error_id(pymex, 'MAP', lambda x: x, [1., 2.], -1., 'double'),
+        'pymex:MAP:badaxis')
+    eq_(matlab_error_id(pymex, 'MAP', lambda x: x, ['a', 'b'], 1., 'double'),
+        'pymex:MAP:badaxis')
+    eq_(matlab_error_id(pymex, 'MAP', lambda x: 'x', [1., 2.], 0., 'int32'),
+        'Python:TypeError')
+    eq_(matlab_error_id(pymex, 'MAP', lambda x: 1 / 0, [1., 2.], 0., 'double'),
+        'Python:ZeroDivisionError')
+
+def test_iter_next_n():
+    '''
+    Test that ITER_NEXT_N takes items in bunches and says when it's done
+    '''
+    import mex
+    it = iter(range(5))
+    items, done = pymex('ITER_NEXT_N', it, 3., nargout=2)
+    eq_((len(items), items[0], items[2]), (3, 0, 2))
+    eq_(float(done), 0)
+    items, done = pymex('ITER_NEXT_N', it, 3., True, nargout=2)
+    eq_(mex.call('class', items), 'int32')
+    assert_true(isequal(items, [3., 4.]))
+    eq_(float(done), 1)
+    items, done = pymex('ITER_NEXT_N', it, 3., nargout=2)
+    eq_((len(items), float(done)), (0, 1))
+
+def test_iter_next_n_stacking():
+    '''
+    Test that converted lists are stacked as columns, or left in a cell
+    when dense_sequences is off
+    '''
+    import mex
+    rows = [[1., 2.], [3., 4.], [5., 6.]]
+    items = pymex('ITER_NEXT_N', iter(rows), 3., True)
+    assert_true(isequal(items, [[1., 3., 5.], [2., 4., 6.]]))
+    old = pymex('OPTION', 'dense_sequences', False)
+    try:
+        items = pymex('ITER_NEXT_N', iter(rows), 3., True)
+    finally:
+        pymex('OPTION', 'dense_sequences', old)
+    eq_(mex.call('class', items), 'cell')
+    eq_(len(items), 3)
+
+def test_iter_next_n_errors():
+    '''
+    Test that ITER_NEXT_N wants an iterator and a sensible count
+    '''
+    eq_(matlab_error_id(pymex, 'ITER_NEXT_N', _Thing(), 1.),
+        'pymex:ITER_NEXT_N:notiter')
+    eq_(matlab_error_id(pymex, 'ITER_NEXT_N', iter([]), -1.),
+        'pymex:ITER_NEXT_N:badcount')
+    def broken():
+        yield 1
+        raise RuntimeError('broken')
+    eq_(matlab_error_id(pymex, 'ITER_NEXT_N', broken(), 5.),
+        'Python:RuntimeError')
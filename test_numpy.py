@@ -3,3 +3,197 @@ from nose.plugins.skip import SkipTest
 
 def test_import():
     import numpy
+
+def test_strided_to_matlab():
+    '''
+    Test that non-contiguous arrays keep their layout on the way over
+    '''
+    import numpy as np
+    import mex
+    a = np.arange(24, dtype=np.int16).reshape(2,3,4)[:, ::-1, 1:]
+    b = np.asarray(mex.call('squeeze', a))
+    assert_equal(b.dtype, a.dtype)
+    assert_true((b == a).all())
+    c = np.asarray(mex.call('squeeze', np.float32(2.5)))
+    assert_equal(c.shape, (1,1))
+
+def test_array_shares_data():
+    '''
+    Test that asarray and memoryview on MATLAB data don't copy
+    '''
+    import numpy as np
+    import mx
+    x = mx.create_numeric_array(mxclass=mx.INT32, dims=(2,3), wrap=True)
+    a = np.asarray(x)
+    assert_true(a.flags.f_contiguous)
+    a[1,2] = 7
+    m = memoryview(x)
+    assert_equal(m.format, 'i')
+    assert_equal(m.shape, (2,3))
+    assert_equal(m.strides, (4,8))
+    assert_equal(np.asarray(x)[1,2], 7)
+
+def test_dense_lists_to_matlab():
+    '''
+    Test that rectangular lists of numbers become one array
+    '''
+    import numpy as np
+    import mex
+    a = np.asarray(mex.call('squeeze', [[1, 2, 3], [4, 5.5, 6]]))
+    assert_equal(a.dtype, np.float64)
+    assert_true((a == np.array([[1, 2, 3], [4, 5.5, 6]])).all())
+    b = np.asarray(mex.call('squeeze', (1, 2, 3)))
+    assert_equal(b.dtype, np.int32)
+    assert_equal(b.shape, (1, 3))
+    assert_equal(np.asarray(mex.call('squeeze', [1, 2**40])).dtype, np.int64)
+    assert_equal(np.asarray(mex.call('squeeze', [1L, 2L])).dtype, np.int64)
+    c = np.asarray(mex.call('squeeze', [True, False]))
+    assert_equal(c.dtype, np.bool_)
+
+def test_struct_columns():
+    '''
+    Test that struct arrays convert one field at a time
+    '''
+    import numpy as np
+    import mx
+    s = mx.create_struct_array((1,3), wrap=True)
+    for i in range(3):
+        s._set_field(fieldname='x', value=mx.create_scalar(i, mx.INT32), index=i)
+        s._set_field(fieldname='name', value='s%d' % i, index=i)
+    cols = s.columns()
+    assert_equal(cols['x'].dtype, np.int32)
+    assert_equal(list(cols['x']), [0, 1, 2])
+    assert_equal(cols['name'], ['s0', 's1', 's2'])
+    rec = s.columns(structured=True)
+    assert_equal(rec.dtype.names, ('x', 'name'))
+    assert_equal(rec[2].x, 2)
+
+def test_sparse_roundtrip():
+    '''
+    Test that sparse matrices cross over without going dense
+    '''
+    try: import scipy.sparse
+    except ImportError: raise SkipTest
+    import numpy as np
+    import mex
+    a = scipy.sparse.coo_matrix(([1., 2., 3., 4.], ([2, 0, 2, 1], [0, 1, 0, 3])),
+                                shape=(3, 5))
+    b = mex.call('sparse', a)
+    assert_equal(float(mex.call('nnz', b)), 3)
+    c = b.tocsc()
+    assert_equal(c.shape, (3, 5))
+    assert_true((c.toarray() == a.toarray()).all())
+    d = b.tocsc(index_dtype=np.int32)
+    assert_equal(d.indices.dtype, np.int32)
+    assert_true((d.toarray() == a.toarray()).all())
+    # Stored zeros, and repeats that cancel, don't become entries.
+    z = scipy.sparse.csc_matrix(([0., 1.], [0, 1], [0, 1, 2]), shape=(3, 2))
+    assert_equal(mex.call('sparse', z).tocsc().nnz, 1)
+    z = scipy.sparse.coo_matrix(([1., 2., -2.], ([1, 2, 2], [1, 0, 0])), shape=(3, 2))
+    assert_equal(mex.call('sparse', z).tocsc().nnz, 1)
+
+def test_complex_roundtrip():
+    '''
+    Test that complex arrays keep both parts both ways
+    '''
+    import numpy as np
+    import mex
+    for dtype in (np.complex128, np.complex64):
+        a = (np.arange(15) + 1j * np.arange(15, 0, -1)).astype(dtype).reshape(3, 5)
+        b = mex.call('transpose', a[:, ::2])
+        assert_equal(float(mex.call('isreal', b)), 0)
+        c = np.asarray(b)
+        assert_equal(c.dtype, dtype)
+        assert_true((c == a[:, ::2].T).all())
+
+def test_cell_tree():
+    '''
+    Test that nested cells become nested tuples of NumPy arrays
+    '''
+    import numpy as np
+    import mex
+    import mx
+    inner = mx.create_cell_array((1, 2), wrap=True)
+    inner[0] = 'label'
+    inner[1] = np.arange(6.).reshape(2, 3)
+    outer = mex.call('repmat', inner, 1, 3)
+    nested = mx.create_cell_array((1, 2), wrap=True)
+    nested[0] = outer
+    tree = nested.totree(leaves='numpy')
+    assert_equal(len(tree), 2)
+    assert_equal(len(tree[0]), 6)
+    assert_equal(tree[0][0], 'label')
+    assert_true(isinstance(tree[0][1], np.ndarray))
+    assert_true((tree[0][5] == np.arange(6.).reshape(2, 3)).all())
+    assert_equal(tree[1]._get_number_of_elements(), 0)
+    if tree[0][1] is tree[0][3]:
+        assert_false(tree[0][1].flags.writeable)
+
+def test_cell_tree_views():
+    '''
+    Test that a cell can't change under the views totree made of it
+    '''
+    import numpy as np
+    import mx
+    c = mx.create_cell_array((1, 2), wrap=True)
+    c[0] = np.arange(3.)
+    tree = c.totree(leaves='view')
+    assert_raises(ValueError, c.__setitem__, 0, 1)
+    assert_equal(list(np.asarray(tree[0])), [0., 1., 2.])
+
+def test_cell_tree_shared():
+    '''
+    Test that an array totree puts in several places can't be written
+    '''
+    import numpy as np
+    import mex
+    import mx
+    inner = mx.create_cell_array((1, 1), wrap=True)
+    inner[0] = np.arange(3.)
+    tree = mex.call('repmat', inner, 1, 3).totree()
+    if tree[0] is not tree[1]:
+        return
+    assert_true(tree[0]._shared)
+    assert_raises(ValueError, tree[0]._set_element, np.float64(5.).tostring(), 0)
+    assert_false(np.asarray(tree[1]).flags.writeable)
+    assert_equal(list(np.asarray(tree[2]).ravel()), [0., 1., 2.])
+
+def test_prepared_call():
+    '''
+    Test that a prepared call reuses its arguments and returns raw outputs
+    '''
+    import numpy as np
+    import mex
+    f = mex.prepare('sum', 1, 1, ['float'])
+    x = np.arange(4.)
+    assert_equal(f(x), 6.)
+    x[0] = 10.
+    assert_equal(f(x), 16.)
+    assert_equal(f(np.arange(6.)), 15.)
+    g = mex.prepare('minus', 2, 1)
+    a = g(np.ones(3), 0.5)
+    assert_true(isinstance(a, np.ndarray))
+    assert_true((a.ravel() == 0.5).all())
+    b = g(np.ones(3), 1.5)
+    assert_true((a.ravel() == 0.5).all())
+    assert_true((b.ravel() == -0.5).all())
+    assert_raises(TypeError, f)
+
+def test_prepared_call_conversions():
+    '''
+    Test that prepared calls convert arguments as mex.call would
+    '''
+    import numpy as np
+    import mex
+    import mx
+    isa = mex.prepare('isa', 2, 1, ['float'])
+    assert_equal(isa(1.0, 'double'), 1.)
+    assert_equal(isa(1, 'int32'), 1.)
+    size = mex.prepare('size', 1, 1)
+    assert_equal(list(size(np.ones((3, 1))).ravel()), [3, 1])
+    assert_equal(list(size(np.ones(3)).ravel()), [1, 3])
+    s = mex.prepare('struct', 2, 1, ['mxarray'])
+    first = mx.Array(mxpointer=s('a', np.ones(3)))
+    s('a', np.zeros(3))
+    kept = first._get_field(fieldname='a', index=0)
+    assert_true((np.asarray(kept) == 1).all())
@@ -1,5 +1,9 @@
 function outval = unpy(inval)
-outval = pymex('TO_MXARRAY', inval);
+persistent OP
+if isempty(OP)
+    OP = pymexop('TO_MXARRAY');
+end
+outval = pymex(OP, inval);
 
 
 % Copyright (c) 2009 Ken Watford (kwatford@cise.ufl.edu)